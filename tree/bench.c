@@ -0,0 +1,497 @@
+// Benchmarks for the tree library.
+//
+// Every workload runs once per tree size, from -m to -n nodes in powers of
+// ten, each run in its own child process so that peak RSS belongs to that
+// run alone. Workloads are generated from a fixed-seed PRNG, so two runs with
+// the same arguments build the same trees and issue the same operations.
+//
+// Usage: bench [-n max_nodes] [-m min_nodes] [-w workload[,workload...]]
+//              [-o tree_options] [-s seed] [-c]
+
+#include "tree.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAX_SAMPLES 200000 // Timed operations per run (find_leaf scans use far fewer)
+#define BENCH_DEEP_DEPTH 1024    // Length of each chain in the deep workload
+#define BENCH_TEARDOWN_DIRS 256  // Top-level subtrees removed by the teardown workload
+#define BENCH_LEAVES_PER_DIR 64  // Ingest fan-out
+
+typedef struct Run
+{
+    size_t nodes;     // Target tree size
+    uint32_t options; // TREE_OPT_* flags for init_tree_ex
+    uint64_t rng;     // xorshift64 state
+    uint64_t *lat;    // Latency of each timed operation, in nanoseconds
+    size_t ops;
+    size_t capacity;
+    uint64_t elapsed; // Sum of lat
+    Tree tree;
+} Run;
+
+typedef struct Workload
+{
+    const char *name;
+    const char *description;
+    void (*run)(Run *run);
+} Workload;
+
+static void bench_wide(Run *run);
+static void bench_deep(Run *run);
+static void bench_find_directory(Run *run);
+static void bench_find_leaf(Run *run);
+static void bench_ingest(Run *run);
+static void bench_teardown(Run *run);
+
+static const Workload workloads[] = {
+    {"wide", "create_directory into one flat directory", bench_wide},
+    {"deep", "create_leaf at the bottom of deep chains", bench_deep},
+    {"find_directory", "find_directory on random paths", bench_find_directory},
+    {"find_leaf", "find_leaf depth-first search from the root", bench_find_leaf},
+    {"ingest", "bulk create_leaf across directories", bench_ingest},
+    {"teardown", "remove_directory of top-level subtrees", bench_teardown},
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+#ifdef BENCH_PGO
+// Writes the -fprofile-generate counters, which _exit would otherwise discard
+void __gcov_dump(void);
+#endif
+
+static void die(const char *what)
+{
+    fprintf(stderr, "bench: %s\n", what);
+    exit(1);
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t rng_next(Run *run)
+{
+    uint64_t x = run->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    run->rng = x;
+    return x;
+}
+
+static inline size_t rng_below(Run *run, size_t n)
+{
+    return (size_t)(rng_next(run) % n);
+}
+
+static void run_reserve(Run *run, size_t ops)
+{
+    run->capacity = ops;
+    run->lat = malloc((ops ? ops : 1) * sizeof(uint64_t));
+    if (run->lat == NULL)
+        die("out of memory");
+}
+
+// Records the latency of one operation started at 'start'
+static inline void run_record(Run *run, uint64_t start)
+{
+    uint64_t ns = now_ns() - start;
+    if (run->ops < run->capacity)
+        run->lat[run->ops++] = ns;
+    run->elapsed += ns;
+}
+
+static size_t min_size(size_t a, size_t b)
+{
+    return a < b ? a : b;
+}
+
+static Directory *make_directory(Run *run, Directory *parent, size_t id)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "d%zu", id);
+    Directory *dir = create_directory(&run->tree, parent, name);
+    if (dir == NULL)
+        die("create_directory failed");
+    return dir;
+}
+
+static Leaf *make_leaf(Run *run, Directory *parent, size_t id)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "f%zu", id);
+    Leaf *leaf = create_leaf(&run->tree, parent, name, NULL, (uint64_t)(id & 4095));
+    if (leaf == NULL)
+        die("create_leaf failed");
+    return leaf;
+}
+
+/**
+ * @brief Builds a random recursive tree: each new directory hangs off a uniformly
+ *        chosen earlier one, giving logarithmic expected depth with a mix of wide
+ *        and narrow directories.
+ *
+ * @param run The benchmark run, whose tree must already hold its root
+ * @param count Number of directories to create below the root
+ * @return Directory** All directories, root first (free with free())
+ */
+static Directory **build_random_tree(Run *run, size_t count)
+{
+    Directory **dirs = malloc((count + 1) * sizeof(Directory *));
+    if (dirs == NULL)
+        die("out of memory");
+    dirs[0] = run->tree.root;
+    for (size_t i = 1; i <= count; i++)
+        dirs[i] = make_directory(run, dirs[rng_below(run, i)], i);
+    return dirs;
+}
+
+// Writes dir's path into buf; returns false if it does not fit
+static bool directory_path(Directory *dir, char *buf, size_t size)
+{
+    size_t len = 0;
+    for (Node *node = &dir->base; node->parent != NULL; node = node->parent)
+        len += (size_t)node->name_len + 1;
+    if (len + 1 > size)
+        return false;
+    buf[len] = '\0';
+    for (Node *node = &dir->base; node->parent != NULL; node = node->parent)
+    {
+        len -= node->name_len;
+        memcpy(buf + len, node->name, node->name_len);
+        buf[--len] = '/';
+    }
+    return true;
+}
+
+static void bench_wide(Run *run)
+{
+    Directory *root = create_directory(&run->tree, NULL, "root");
+    run_reserve(run, min_size(run->nodes, BENCH_MAX_SAMPLES));
+    // Time an evenly spread sample of the creations as the directory grows
+    size_t stride = (run->nodes + run->capacity - 1) / run->capacity;
+    for (size_t i = 0; i < run->nodes; i++)
+    {
+        if (i % stride != 0)
+        {
+            make_directory(run, root, i);
+            continue;
+        }
+        uint64_t start = now_ns();
+        make_directory(run, root, i);
+        run_record(run, start);
+    }
+}
+
+static void bench_deep(Run *run)
+{
+    Directory *root = create_directory(&run->tree, NULL, "root");
+    size_t depth = min_size(run->nodes, BENCH_DEEP_DEPTH);
+    size_t chains = run->nodes / depth;
+    Directory **bottoms = malloc(chains * sizeof(Directory *));
+    if (bottoms == NULL)
+        die("out of memory");
+    for (size_t c = 0; c < chains; c++)
+    {
+        Directory *dir = root;
+        for (size_t d = 0; d < depth; d++)
+            dir = make_directory(run, dir, c * depth + d);
+        bottoms[c] = dir;
+    }
+
+    // Each new leaf propagates its size up a whole chain
+    run_reserve(run, min_size(run->nodes, BENCH_MAX_SAMPLES));
+    for (size_t i = 0; i < run->capacity; i++)
+    {
+        Directory *bottom = bottoms[rng_below(run, chains)];
+        uint64_t start = now_ns();
+        make_leaf(run, bottom, i);
+        run_record(run, start);
+    }
+    free(bottoms);
+}
+
+static void bench_find_directory(Run *run)
+{
+    create_directory(&run->tree, NULL, "root");
+    Directory **dirs = build_random_tree(run, run->nodes);
+
+    size_t queries = min_size(run->nodes, BENCH_MAX_SAMPLES);
+    char **paths = malloc(queries * sizeof(char *));
+    if (paths == NULL)
+        die("out of memory");
+    char buf[4096];
+    for (size_t i = 0; i < queries; i++)
+    {
+        Directory *dir = dirs[1 + rng_below(run, run->nodes)];
+        if (!directory_path(dir, buf, sizeof(buf)) || (paths[i] = strdup(buf)) == NULL)
+            die("path too long or out of memory");
+    }
+
+    run_reserve(run, queries);
+    for (size_t i = 0; i < queries; i++)
+    {
+        uint64_t start = now_ns();
+        Directory *found = find_directory(&run->tree, paths[i]);
+        run_record(run, start);
+        if (found == NULL)
+            die("find_directory missed an existing path");
+        free(paths[i]);
+    }
+    free(paths);
+    free(dirs);
+}
+
+static void bench_find_leaf(Run *run)
+{
+    create_directory(&run->tree, NULL, "root");
+    size_t dir_count = run->nodes / 2;
+    size_t leaf_count = run->nodes - dir_count;
+    Directory **dirs = build_random_tree(run, dir_count);
+    for (size_t i = 0; i < leaf_count; i++)
+        make_leaf(run, dirs[rng_below(run, dir_count + 1)], i);
+
+    // Every lookup may scan the whole tree, so the sample shrinks as it grows
+    size_t queries = min_size(leaf_count, 100000000 / (run->nodes + 1) + 16);
+    run_reserve(run, queries);
+    char name[32];
+    for (size_t i = 0; i < queries; i++)
+    {
+        snprintf(name, sizeof(name), "f%zu", rng_below(run, leaf_count));
+        uint64_t start = now_ns();
+        Leaf *found = find_leaf(&run->tree, NULL, name);
+        run_record(run, start);
+        if (found == NULL)
+            die("find_leaf missed an existing leaf");
+    }
+    free(dirs);
+}
+
+static void bench_ingest(Run *run)
+{
+    Directory *root = create_directory(&run->tree, NULL, "root");
+    size_t dir_count = run->nodes / BENCH_LEAVES_PER_DIR + 1;
+    Directory **dirs = malloc(dir_count * sizeof(Directory *));
+    if (dirs == NULL)
+        die("out of memory");
+    for (size_t i = 0; i < dir_count; i++)
+        dirs[i] = make_directory(run, root, i);
+
+    run_reserve(run, min_size(run->nodes, BENCH_MAX_SAMPLES));
+    size_t stride = (run->nodes + run->capacity - 1) / run->capacity;
+    for (size_t i = 0; i < run->nodes; i++)
+    {
+        Directory *dir = dirs[rng_below(run, dir_count)];
+        if (i % stride != 0)
+        {
+            make_leaf(run, dir, i);
+            continue;
+        }
+        uint64_t start = now_ns();
+        make_leaf(run, dir, i);
+        run_record(run, start);
+    }
+    free(dirs);
+}
+
+static void bench_teardown(Run *run)
+{
+    Directory *root = create_directory(&run->tree, NULL, "root");
+    size_t tops = min_size(BENCH_TEARDOWN_DIRS, run->nodes);
+    Directory **dirs = malloc((run->nodes + 1) * sizeof(Directory *));
+    if (dirs == NULL)
+        die("out of memory");
+    for (size_t i = 0; i < tops; i++)
+        dirs[i] = make_directory(run, root, i);
+    // Half the remaining nodes are directories below the top level, half leaves
+    size_t count = tops;
+    for (size_t i = tops; i < run->nodes; i++)
+    {
+        Directory *parent = dirs[rng_below(run, count)];
+        if (i & 1)
+            dirs[count++] = make_directory(run, parent, i);
+        else
+            make_leaf(run, parent, i);
+    }
+
+    run_reserve(run, tops);
+    for (size_t i = 0; i < tops; i++)
+    {
+        uint64_t start = now_ns();
+        int result = remove_directory(&run->tree, dirs[i]);
+        run_record(run, start);
+        if (result != 0)
+            die("remove_directory failed");
+    }
+    free(dirs);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t count, double p)
+{
+    if (count == 0)
+        return 0;
+    size_t i = (size_t)(p * (double)(count - 1) + 0.5);
+    return sorted[i];
+}
+
+static void print_header(bool csv)
+{
+    if (csv)
+        printf("workload,nodes,ops,ops_per_sec,p50_ns,p90_ns,p99_ns,p999_ns,max_ns,peak_rss_kb\n");
+    else
+        printf("%-15s %10s %8s %14s %10s %10s %10s %10s %12s %12s\n", "workload", "nodes", "ops", "ops/sec",
+               "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns", "peak RSS KB");
+    fflush(stdout);
+}
+
+static void run_report(const Workload *workload, Run *run, bool csv)
+{
+    qsort(run->lat, run->ops, sizeof(uint64_t), compare_u64);
+    double rate = run->elapsed > 0 ? (double)run->ops * 1e9 / (double)run->elapsed : 0.0;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    const char *format = csv ? "%s,%zu,%zu,%.0f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%ld\n"
+                             : "%-15s %10zu %8zu %14.0f %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+                               " %12" PRIu64 " %12ld\n";
+    printf(format, workload->name, run->nodes, run->ops, rate, percentile(run->lat, run->ops, 0.50),
+           percentile(run->lat, run->ops, 0.90), percentile(run->lat, run->ops, 0.99),
+           percentile(run->lat, run->ops, 0.999), run->ops ? run->lat[run->ops - 1] : 0, usage.ru_maxrss);
+    fflush(stdout);
+}
+
+// Runs one workload at one size in a child process and waits for it
+static int run_isolated(const Workload *workload, size_t nodes, uint32_t options, uint64_t seed, bool csv)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+        die("fork failed");
+    if (pid == 0)
+    {
+        Run run;
+        memset(&run, 0, sizeof(run));
+        run.nodes = nodes;
+        run.options = options;
+        // Mix the size in so each run draws its own sequence
+        run.rng = (seed ^ (nodes * 0x9E3779B97F4A7C15ull)) | 1;
+        init_tree_ex(&run.tree, NULL, NULL, options);
+        workload->run(&run);
+        run_report(workload, &run, csv);
+        destroy_tree(&run.tree);
+        free(run.lat);
+#ifdef BENCH_PGO
+        __gcov_dump();
+#endif
+        _exit(0);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+            die("waitpid failed");
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "bench: %s at %zu nodes did not finish\n", workload->name, nodes);
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: bench [-n max_nodes] [-m min_nodes] [-w workload[,workload...]] "
+                    "[-o tree_options] [-s seed] [-c]\n\nworkloads:\n");
+    for (size_t i = 0; i < WORKLOAD_COUNT; i++)
+        fprintf(stderr, "  %-15s %s\n", workloads[i].name, workloads[i].description);
+    exit(2);
+}
+
+// Whether 'name' appears in the comma-separated list (NULL selects everything)
+static bool selected(const char *list, const char *name)
+{
+    if (list == NULL)
+        return true;
+    size_t len = strlen(name);
+    for (const char *p = list; *p != '\0';)
+    {
+        const char *end = strchr(p, ',');
+        size_t n = end != NULL ? (size_t)(end - p) : strlen(p);
+        if (n == len && memcmp(p, name, len) == 0)
+            return true;
+        p += n + (end != NULL);
+    }
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    size_t max_nodes = 10000000;
+    size_t min_nodes = 1000;
+    const char *list = NULL;
+    uint32_t options = 0;
+    uint64_t seed = 42;
+    bool csv = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:m:w:o:s:ch")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            max_nodes = strtoull(optarg, NULL, 0);
+            break;
+        case 'm':
+            min_nodes = strtoull(optarg, NULL, 0);
+            break;
+        case 'w':
+            list = optarg;
+            break;
+        case 'o':
+            options = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'c':
+            csv = true;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (min_nodes == 0 || max_nodes < min_nodes)
+        usage();
+
+    print_header(csv);
+    int failures = 0;
+    for (size_t i = 0; i < WORKLOAD_COUNT; i++)
+    {
+        if (!selected(list, workloads[i].name))
+            continue;
+        for (size_t nodes = min_nodes; nodes <= max_nodes; nodes *= 10)
+        {
+            if (run_isolated(&workloads[i], nodes, options, seed, csv) != 0)
+                failures++;
+            if (nodes > SIZE_MAX / 10)
+                break;
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
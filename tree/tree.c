@@ -1,37 +1,405 @@
 #include "tree.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef TREE_STATS
+#include <inttypes.h>
+#include <time.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 static void destroy_directory(Tree *tree, Directory *dir);
-static char **split_path(const char *path, int *count);
-static void free_path_components(char **components, int count);
-static Directory *find_child_directory(Directory *parent, const char *name);
+static void destroy_values(Tree *tree, Directory *dir);
+static Directory *find_child_directory(Directory *parent, const char *name, size_t len, uint32_t hash);
+static Directory *create_directory_n(Tree *tree, Directory *parent, const char *name, size_t len);
+static Directory *create_nested_directory_locked(Tree *tree, const char *path);
+static Leaf *find_child_leaf(Directory *parent, const char *name, size_t len, uint32_t hash);
+static uint32_t hash_name(const char *name, size_t len);
+static void pool_destroy(TreePool *pool);
+static Leaf *leaf_new(Tree *tree, Directory *parent, const char *name, size_t len, void *value, uint64_t size);
+static bool leaf_link(Tree *tree, Directory *parent, Leaf *leaf);
+static void leaf_delete(Tree *tree, Leaf *leaf);
+static void leaf_free(Tree *tree, Leaf *leaf);
+static Leaf *leaf_lookup(Tree *tree, const char *path, TreeValue *pin);
+static inline size_t leaf_alloc_size(const Leaf *leaf);
+static void path_index_add(Tree *tree, Node *node);
+static void path_index_remove(Tree *tree, Node *node);
+static void path_index_remove_subtree(Tree *tree, Directory *dir);
+static void path_index_free(Tree *tree);
+static void reclaimer_free(Tree *tree);
+static void frozen_free(TreeFrozen *frozen);
+static bool versions_live(Tree *tree);
+static bool versions_enter(Tree *tree);
+static void versions_exit(Tree *tree, bool exclusive);
+static void versions_exclude(Tree *tree);
+static void versions_include(Tree *tree);
+static void versions_touch(Tree *tree, Directory *dir, bool lists);
+static bool versions_retire(Tree *tree, Node *node);
+static uint64_t versions_epoch(Tree *tree);
+static void versions_free(Tree *tree);
+static void *tree_alloc(Tree *tree, size_t size);
+static void tree_free(Tree *tree, void *ptr, size_t size);
+static void dir_index_add(Tree *tree, Directory *dir, Node *node);
+static void dir_index_remove(Tree *tree, Directory *dir, Node *node);
+static void dir_index_free(Tree *tree, Directory *dir);
+static void journal_log(Tree *tree, uint32_t op, Node *node, Node *target, const char *name, const void *value,
+                        uint64_t size);
+static void journal_commit(Tree *tree);
+static uint64_t journal_sequence(Tree *tree);
+
+// Mutations recorded by journal_log, see the journal section
+enum
+{
+    JOURNAL_MKDIR = 1,   // path: parent ("" for the root), name: new directory
+    JOURNAL_CREATE,      // path: parent, name: new leaf, value and size
+    JOURNAL_UPDATE,      // path: leaf, value and size
+    JOURNAL_RMDIR,       // path: directory
+    JOURNAL_UNLINK,      // path: leaf
+    JOURNAL_MOVE_DIR,    // path: directory, name: path of the new parent
+    JOURNAL_MOVE_LEAF,   // path: leaf, name: path of the new parent
+    JOURNAL_RENAME_DIR,  // path: parent ("" for the root), name: new name, value: old name
+    JOURNAL_RENAME_LEAF, // path: parent, name: new name, value: old name
+};
+
+// Reader-writer spin locks for TREE_OPT_CONCURRENT. The low bits count
+// readers; a waiting writer sets LOCK_WAITING so new readers back off.
+#define LOCK_WRITER 0x80000000u
+#define LOCK_WAITING 0x40000000u
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static void lock_backoff(unsigned *spins)
+{
+    if (++*spins < 64)
+        cpu_relax();
+    else
+        sched_yield();
+}
+
+static void lock_read(TreeLock *lock)
+{
+    unsigned spins = 0;
+    for (;;)
+    {
+        uint32_t state = __atomic_load_n(lock, __ATOMIC_RELAXED);
+        if (!(state & (LOCK_WRITER | LOCK_WAITING)) &&
+            __atomic_compare_exchange_n(lock, &state, state + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+        lock_backoff(&spins);
+    }
+}
+
+static void unlock_read(TreeLock *lock)
+{
+    __atomic_sub_fetch(lock, 1, __ATOMIC_RELEASE);
+}
+
+static void lock_write(TreeLock *lock)
+{
+    unsigned spins = 0;
+    for (;;)
+    {
+        uint32_t state = __atomic_load_n(lock, __ATOMIC_RELAXED);
+        if ((state & ~LOCK_WAITING) == 0)
+        {
+            if (__atomic_compare_exchange_n(lock, &state, LOCK_WRITER, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return;
+        }
+        else if (!(state & LOCK_WAITING))
+        {
+            __atomic_fetch_or(lock, LOCK_WAITING, __ATOMIC_RELAXED);
+        }
+        lock_backoff(&spins);
+    }
+}
+
+static void unlock_write(TreeLock *lock)
+{
+    // Leaves LOCK_WAITING alone so another queued writer keeps priority
+    __atomic_and_fetch(lock, ~LOCK_WRITER, __ATOMIC_RELEASE);
+}
+
+static inline bool is_concurrent(const Tree *tree)
+{
+    return (tree->options & TREE_OPT_CONCURRENT) != 0;
+}
+
+// Directory locking helpers; no-ops unless the tree is concurrent
+static inline void dir_read_lock(Tree *tree, Directory *dir)
+{
+    if (is_concurrent(tree))
+        lock_read(&dir->lock);
+}
+
+static inline void dir_read_unlock(Tree *tree, Directory *dir)
+{
+    if (is_concurrent(tree))
+        unlock_read(&dir->lock);
+}
+
+static inline void dir_write_lock(Tree *tree, Directory *dir)
+{
+    if (is_concurrent(tree))
+        lock_write(&dir->lock);
+}
+
+static inline void dir_write_unlock(Tree *tree, Directory *dir)
+{
+    if (is_concurrent(tree))
+        unlock_write(&dir->lock);
+}
+
+// Adds a (possibly negative, two's complement) delta to a shared counter
+static inline void counter_add(Tree *tree, uint32_t *counter, uint32_t delta)
+{
+    if (is_concurrent(tree))
+        __atomic_add_fetch(counter, delta, __ATOMIC_RELAXED);
+    else
+        *counter += delta;
+}
+
+static inline void counter_add64(Tree *tree, uint64_t *counter, uint64_t delta)
+{
+    if (is_concurrent(tree))
+        __atomic_add_fetch(counter, delta, __ATOMIC_RELAXED);
+    else
+        *counter += delta;
+}
+
+// Instrumentation. Builds with -DTREE_STATS give every tree a TreeStats block
+// of counters and per-operation latency histograms; other builds compile every
+// hook below away. Counters that need no tree pointer (sibling scans and name
+// comparisons) go to the tree of the innermost timed operation on this thread,
+// so work done outside one is not attributed.
+#ifdef TREE_STATS
+#define STATS_BUCKETS 48 // Bucket i holds latencies in [2^i, 2^(i+1)) ns, bucket 0 also 0 ns
+
+typedef struct OpStats
+{
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_BUCKETS];
+} OpStats;
+
+struct TreeStats
+{
+    uint64_t siblings_scanned; // Entries examined by child lookups: list nodes, index probes, fingerprint keys
+    uint64_t name_compares;    // Name byte comparisons after hash and length matched
+    uint64_t allocations;
+    uint64_t allocated_bytes;
+    uint64_t frees;
+    uint64_t freed_bytes;
+    uint64_t propagations;     // Size/count updates pushed up the ancestor chain
+    uint64_t propagation_hops; // Directories those updates touched
+    OpStats ops[TREE_OP_COUNT];
+    tree_trace_fn trace;
+    void *trace_ctx;
+};
+
+static __thread TreeStats *stats_current;
+
+typedef struct StatsScope
+{
+    TreeStats *stats;
+    TreeStats *outer;
+    const char *arg;
+    uint64_t start;
+    uint32_t op;
+} StatsScope;
+
+static inline uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline void stats_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline StatsScope stats_enter(Tree *tree, uint32_t op, const char *arg)
+{
+    StatsScope scope = {.stats = tree != NULL ? tree->stats : NULL, .outer = stats_current, .arg = arg, .op = op};
+    stats_current = scope.stats;
+    if (scope.stats != NULL)
+        scope.start = stats_now();
+    return scope;
+}
+
+// Runs when a timed operation's scope ends, whichever way the function returns
+static void stats_leave(StatsScope *scope)
+{
+    stats_current = scope->outer;
+    TreeStats *stats = scope->stats;
+    if (stats == NULL)
+        return;
+
+    uint64_t ns = stats_now() - scope->start;
+    OpStats *op = &stats->ops[scope->op];
+    unsigned bucket = ns > 0 ? 63 - (unsigned)__builtin_clzll(ns) : 0;
+    stats_add(&op->calls, 1);
+    stats_add(&op->total_ns, ns);
+    stats_add(&op->buckets[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1], 1);
+    uint64_t max = __atomic_load_n(&op->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&op->max_ns, &max, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    tree_trace_fn trace = __atomic_load_n(&stats->trace, __ATOMIC_ACQUIRE);
+    if (trace != NULL)
+        trace(scope->op, scope->arg, ns, stats->trace_ctx);
+}
+
+// Times the rest of the enclosing function as operation op
+#define STATS_SCOPE(tree, op, arg) \
+    StatsScope stats_scope __attribute__((cleanup(stats_leave))) = stats_enter(tree, op, arg)
+#define STATS_COUNT(field, n)                          \
+    do                                                 \
+    {                                                  \
+        if (stats_current != NULL)                     \
+            stats_add(&stats_current->field, (n));     \
+    } while (0)
+#define STATS_TREE_COUNT(tree, field, n)               \
+    do                                                 \
+    {                                                  \
+        if ((tree)->stats != NULL)                     \
+            stats_add(&(tree)->stats->field, (n));     \
+    } while (0)
+#else
+#define STATS_SCOPE(tree, op, arg) ((void)0)
+#define STATS_COUNT(field, n) ((void)0)
+#define STATS_TREE_COUNT(tree, field, n) ((void)0)
+#endif
+
+/**
+ * @brief Applies a size, file and directory count change to a directory, all of its ancestors and the tree.
+ *
+ * @param tree Pointer to the tree structure
+ * @param dir The innermost directory whose totals change
+ * @param size_delta Change in total_size
+ * @param file_delta Change in subtree_files
+ * @param dir_delta Change in subtree_dirs
+ *
+ * @note In concurrent trees every counter is updated atomically, so no lock
+ *       other than the one on the modified directory is needed. Each ancestor's
+ *       previous totals are saved first if a snapshot still needs them.
+ */
+static void propagate_totals(Tree *tree, Directory *dir, int64_t size_delta, int32_t file_delta, int32_t dir_delta)
+{
+    STATS_TREE_COUNT(tree, propagations, 1);
+    for (; dir != NULL; dir = (Directory *)dir->base.parent)
+    {
+        STATS_TREE_COUNT(tree, propagation_hops, 1);
+        versions_touch(tree, dir, false);
+        counter_add64(tree, &dir->total_size, (uint64_t)size_delta);
+        counter_add(tree, &dir->subtree_files, (uint32_t)file_delta);
+        if (dir_delta != 0)
+            counter_add(tree, &dir->subtree_dirs, (uint32_t)dir_delta);
+    }
+    counter_add64(tree, &tree->total_size, (uint64_t)size_delta);
+    counter_add(tree, &tree->total_files, (uint32_t)file_delta);
+    if (dir_delta != 0)
+        counter_add(tree, &tree->total_dirs, (uint32_t)dir_delta);
+}
+
+// Size classes of TREE_OPT_SIZE_HISTOGRAM, see TREE_HISTOGRAM_BINS
+static inline uint32_t size_bin(uint64_t size)
+{
+    return size == 0 ? 0 : 64 - (uint32_t)__builtin_clzll(size);
+}
+
+// Counts one leaf of the given size into (delta 1) or out of (delta -1) the
+// histograms of dir and all of its ancestors
+static void propagate_bin(Tree *tree, Directory *dir, uint64_t size, int32_t delta)
+{
+    if (!(tree->options & TREE_OPT_SIZE_HISTOGRAM))
+        return;
+    uint32_t bin = size_bin(size);
+    for (; dir != NULL; dir = (Directory *)dir->base.parent)
+    {
+        if (dir->histogram != NULL)
+            counter_add(tree, &dir->histogram[bin], (uint32_t)delta);
+    }
+}
+
+// Adds (sign 1) or subtracts (sign -1) a whole histogram along dir's ancestor chain
+static void propagate_histogram(Tree *tree, Directory *dir, const uint32_t *bins, int32_t sign)
+{
+    if (!(tree->options & TREE_OPT_SIZE_HISTOGRAM) || bins == NULL)
+        return;
+    for (; dir != NULL; dir = (Directory *)dir->base.parent)
+    {
+        if (dir->histogram == NULL)
+            continue;
+        for (uint32_t i = 0; i < TREE_HISTOGRAM_BINS; i++)
+        {
+            if (bins[i] != 0)
+                counter_add(tree, &dir->histogram[i], (uint32_t)sign * bins[i]);
+        }
+    }
+}
+
+static void dir_histogram_free(Tree *tree, Directory *dir)
+{
+    tree_free(tree, dir->histogram, TREE_HISTOGRAM_BINS * sizeof(uint32_t));
+    dir->histogram = NULL;
+}
 
 // utility functions
-uint32_t get_directory_size(Directory *dir)
+uint64_t get_directory_size(Directory *dir)
 {
     if (dir == NULL)
         return 0;
-    return dir->total_size;
+    return __atomic_load_n(&dir->total_size, __ATOMIC_RELAXED);
 }
 
-uint32_t get_total_size(Tree *tree)
+uint64_t get_total_size(Tree *tree)
 {
     if (tree == NULL)
         return 0;
-    return tree->total_size;
+    return __atomic_load_n(&tree->total_size, __ATOMIC_RELAXED);
+}
+
+uint32_t get_directory_count(Directory *dir)
+{
+    if (dir == NULL)
+        return 0;
+    return __atomic_load_n(&dir->dir_count, __ATOMIC_RELAXED);
 }
 
-uint16_t get_directory_count(Directory *dir)
+uint32_t get_directory_file_count(Directory *dir)
 {
     if (dir == NULL)
         return 0;
-    return dir->dir_count;
+    return __atomic_load_n(&dir->subtree_files, __ATOMIC_RELAXED);
 }
 
 uint32_t get_total_directories(Tree *tree)
 {
     if (tree == NULL)
         return 0;
-    return tree->total_dirs;
+    return __atomic_load_n(&tree->total_dirs, __ATOMIC_RELAXED);
 }
 
 bool is_directory(Node *node)
@@ -69,646 +437,7993 @@ Directory *get_parent_directory(Directory *dir)
     return (Directory *)dir->base.parent;
 }
 
-// Helper function to split and normalize path
-static char **split_path(const char *path, int *count)
+// Slab allocator used with TREE_OPT_ARENA. Small requests are rounded up to
+// a 16-byte size class and served from a per-class freelist, falling back to
+// bump allocation out of large chunks. Requests above ARENA_MAX_SMALL go to
+// malloc but stay linked to the arena, so teardown never walks the nodes.
+#define ARENA_ALIGN 16
+#define ARENA_MAX_SMALL 512
+#define ARENA_CLASSES (ARENA_MAX_SMALL / ARENA_ALIGN)
+#define ARENA_CHUNK_SIZE (256 * 1024)
+
+typedef struct ArenaChunk
+{
+    struct ArenaChunk *next;
+} ArenaChunk;
+
+typedef union ArenaLarge
+{
+    struct
+    {
+        union ArenaLarge *prev;
+        union ArenaLarge *next;
+    } link;
+    max_align_t align;
+} ArenaLarge;
+
+struct TreeArena
+{
+    void *freelist[ARENA_CLASSES]; // Freed blocks, one list per size class
+    char *bump;                    // Next unused byte in the newest chunk
+    char *bump_end;
+    ArenaChunk *chunks;
+    ArenaLarge *large;
+};
+
+#define ARENA_CHUNK_HEADER (((sizeof(ArenaChunk) + ARENA_ALIGN - 1) / ARENA_ALIGN) * ARENA_ALIGN)
+
+static void *arena_alloc(TreeArena *arena, size_t size)
 {
-    char *path_copy = strdup(path);
-    char **components = malloc(sizeof(char *) * 256); // Max 256 components
-    *count = 0;
+    if (size > ARENA_MAX_SMALL)
+    {
+        ArenaLarge *block = malloc(sizeof(ArenaLarge) + size);
+        if (block == NULL)
+            return NULL;
+        block->link.prev = NULL;
+        block->link.next = arena->large;
+        if (arena->large != NULL)
+            arena->large->link.prev = block;
+        arena->large = block;
+        return block + 1;
+    }
 
-    // Skip leading slash
-    char *token = strtok(path_copy, "/");
-    while (token != NULL && *count < 256)
+    size_t cls = (size + ARENA_ALIGN - 1) / ARENA_ALIGN;
+    if (cls == 0)
+        cls = 1;
+    void *block = arena->freelist[cls - 1];
+    if (block != NULL)
     {
-        components[*count] = strdup(token);
-        (*count)++;
-        token = strtok(NULL, "/");
+        arena->freelist[cls - 1] = *(void **)block;
+        return block;
     }
 
-    free(path_copy);
-    return components;
+    size_t bytes = cls * ARENA_ALIGN;
+    if ((size_t)(arena->bump_end - arena->bump) < bytes)
+    {
+        ArenaChunk *chunk = malloc(ARENA_CHUNK_SIZE);
+        if (chunk == NULL)
+            return NULL;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->bump = (char *)chunk + ARENA_CHUNK_HEADER;
+        arena->bump_end = (char *)chunk + ARENA_CHUNK_SIZE;
+    }
+    block = arena->bump;
+    arena->bump += bytes;
+    return block;
 }
 
-// Helper to free split path
-static void free_path_components(char **components, int count)
+static void arena_free(TreeArena *arena, void *ptr, size_t size)
 {
-    for (int i = 0; i < count; i++)
+    if (size > ARENA_MAX_SMALL)
     {
-        free(components[i]);
+        ArenaLarge *block = (ArenaLarge *)ptr - 1;
+        if (block->link.prev != NULL)
+            block->link.prev->link.next = block->link.next;
+        else
+            arena->large = block->link.next;
+        if (block->link.next != NULL)
+            block->link.next->link.prev = block->link.prev;
+        free(block);
+        return;
     }
-    free(components);
+
+    size_t cls = (size + ARENA_ALIGN - 1) / ARENA_ALIGN;
+    if (cls == 0)
+        cls = 1;
+    *(void **)ptr = arena->freelist[cls - 1];
+    arena->freelist[cls - 1] = ptr;
 }
 
-/**
- * @brief Finds a child directory with the specified name within a parent directory
- *
- * @param parent The parent directory to search in
- * @param name The name of the child directory to find
- * @return Directory* Pointer to the found directory, or NULL if not found
- *
- * @note This is an internal helper function used by create_directory and create_nested_directory
- * @warning Not thread-safe, assumes parent and name are valid
- */
-Directory *find_child_directory(Directory *parent, const char *name)
+// Releases every chunk and large block in O(chunks)
+static void arena_release(TreeArena *arena)
 {
-    if (!parent || !name)
-        return NULL;
-
-    Directory *child = parent->first_child;
-    while (child != NULL)
+    ArenaChunk *chunk = arena->chunks;
+    while (chunk != NULL)
     {
-        if (strcmp(child->base.name, name) == 0)
-        {
-            return child;
-        }
-        child = child->next_dir;
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
     }
-    return NULL;
+    ArenaLarge *block = arena->large;
+    while (block != NULL)
+    {
+        ArenaLarge *next = block->link.next;
+        free(block);
+        block = next;
+    }
+    free(arena);
 }
 
 /**
- * @brief Initializes a new tree structure with the specified comparison and destruction functions.
- *
- * @param tree Pointer to the tree structure to initialize
- * @param compare Function pointer for comparing node values (can be NULL)
- * @param destroy Function pointer for cleaning up node values (can be NULL)
+ * @brief Allocates memory owned by the tree.
  *
- * @note This function sets initial values for root, directory count, and total size to zero.
- *       It stores the provided function pointers for later use.
- *       This function does not allocate any memory.
+ * @param tree Pointer to the tree that will own the memory
+ * @param size Number of bytes to allocate
+ * @return void* Uninitialized memory, or NULL if allocation fails
  *
- * @warning Ensure that the tree pointer is valid before calling this function.
+ * @note With TREE_OPT_ARENA the block comes from the tree's slabs, which are
+ *       created on first use; otherwise this is plain malloc.
+ *       Blocks must be returned with tree_free using the same size.
  */
-void init_tree(Tree *tree, int (*compare)(void *key1, void *key2), void (*destroy)(void *data))
+static void *tree_alloc(Tree *tree, size_t size)
 {
-    tree->root = NULL;
-    tree->total_dirs = 0;
-    tree->total_size = 0;
-    tree->destroy = destroy;
-    tree->compare = compare;
+    STATS_TREE_COUNT(tree, allocations, 1);
+    STATS_TREE_COUNT(tree, allocated_bytes, size);
+    if (!(tree->options & TREE_OPT_ARENA))
+        return malloc(size);
+
+    void *block = NULL;
+    if (is_concurrent(tree))
+        lock_write(&tree->alloc_lock);
+    if (tree->arena == NULL)
+        tree->arena = calloc(1, sizeof(TreeArena));
+    if (tree->arena != NULL)
+        block = arena_alloc(tree->arena, size);
+    if (is_concurrent(tree))
+        unlock_write(&tree->alloc_lock);
+    return block;
 }
 
-/**
- * @brief Destroys the entire tree structure and frees all associated memory.
- *
- * @param tree Pointer to the tree structure to destroy
- *
- * @note This function recursively destroys all directories and their contents,
- *       resets all tree counters to zero, and is safe to call with a NULL pointer.
- *       It uses destroy_directory for recursive cleanup.
- *
- * @warning Ensure that no other references to the tree exist before calling this function
- *          to avoid memory access violations.
- */
-void destroy_tree(Tree *tree)
+static void tree_free(Tree *tree, void *ptr, size_t size)
 {
-    if (tree == NULL)
+    if (ptr == NULL)
+        return;
+    STATS_TREE_COUNT(tree, frees, 1);
+    STATS_TREE_COUNT(tree, freed_bytes, size);
+    if (!(tree->options & TREE_OPT_ARENA))
+    {
+        free(ptr);
         return;
+    }
 
-    destroy_directory(tree, tree->root);
-    tree->root = NULL;
-    tree->total_dirs = 0;
-    tree->total_size = 0;
+    if (is_concurrent(tree))
+        lock_write(&tree->alloc_lock);
+    arena_free(tree->arena, ptr, size);
+    if (is_concurrent(tree))
+        unlock_write(&tree->alloc_lock);
 }
 
+// One component of a path, pointing into the caller's string
+typedef struct PathSlice
+{
+    const char *ptr;
+    size_t len;
+} PathSlice;
+
 /**
- * @brief Helper function that recursively destroys a directory and all its contents.
- *
- * @param tree Pointer to the tree structure
- * @param dir Pointer to the directory to destroy
+ * @brief Advances over the next component of a '/'-separated path without copying it.
  *
- * @note This function processes subdirectories first, then leaves, and finally the directory itself.
- *       It uses depth-first traversal to ensure proper cleanup and calls the tree's destroy function
- *       for leaf values if provided. It handles both sibling and child relationships separately.
+ * @param cursor In/out position within the path; updated past the returned component
+ * @param out Receives the component as a (pointer, length) slice
+ * @return true if a component was produced, false at the end of the path
  *
- * @warning This function assumes that the directory pointer is valid and not NULL.
+ * @note Leading, trailing and repeated slashes produce no empty components.
+ *       This is reentrant and never allocates.
  */
-static void destroy_directory(Tree *tree, Directory *dir)
+static bool path_next(const char **cursor, PathSlice *out)
 {
-    if (tree == NULL || dir == NULL)
-        return;
-
-    // Process subdirectories (children)
-    // The key is that next_dir links handle siblings, while recursive calls to destroy_directory handle children through first_child.
-
-    Directory *curr_dir = dir->first_child;
-    while (curr_dir != NULL)
+    const char *p = *cursor;
+    while (*p == '/')
+        p++;
+    if (*p == '\0')
     {
-        Directory *next_dir = curr_dir->next_dir; // Save sibling link
-        destroy_directory(tree, curr_dir);        // Recursively destroy this subdirectory
-        curr_dir = next_dir;                      // Move to next sibling
+        *cursor = p;
+        return false;
     }
 
-    // Then destroy all leaves (files) in this directory
-    Leaf *curr_leaf = dir->first_leaf;
-    while (curr_leaf != NULL)
+    out->ptr = p;
+    while (*p != '\0' && *p != '/')
+        p++;
+    out->len = (size_t)(p - out->ptr);
+    *cursor = p;
+    return true;
+}
+
+// FNV-1a over the name bytes, cached in every node
+static uint32_t hash_name(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
     {
-        Leaf *next_leaf = curr_leaf->next_leaf;
-        // call destroy function on leaf if provides
-        if (tree->destroy != NULL && curr_leaf->value != NULL)
-            tree->destroy(curr_leaf->value);
-        free(curr_leaf);
-        curr_leaf = next_leaf;
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
     }
-    // Finally, destroy the directory itself
-    free(dir);
+    return hash;
 }
 
-/**
- * @brief Creates a single directory node in the tree
- *
- * @param tree Pointer to the tree structure where the directory will be created
- * @param parent Pointer to the parent directory (NULL for root directory)
- * @param name Name of the directory to create (must be less than 256 characters)
- *
- * @return Directory* Pointer to the newly created directory, or NULL if:
- *         - Any input parameter is NULL
- *         - name length >= 256
- *         - Memory allocation fails
- *         - A directory with the same name already exists under the parent
- *         - Attempting to create a root when one already exists
- *
- * @note This function:
- *       - Creates a single directory node
- *       - Sets up parent-child relationships
- *       - Updates directory counts
- *       - Handles both root and child directory creation
- *
- * @example
- *     // Create root directory
- *     Directory *root = create_directory(tree, NULL, "root");
- *     // Create child directory
- *     Directory *child = create_directory(tree, root, "child");
- */
+// Compares hash and length before touching the name bytes
+static inline bool node_name_equals(const Node *node, const char *name, size_t len, uint32_t hash)
+{
+    if (node->hash != hash || node->name_len != len)
+        return false;
+    STATS_COUNT(name_compares, 1);
+    return memcmp(node->name, name, len) == 0;
+}
 
-Directory *create_directory(Tree *tree, Directory *parent, const char *name)
+// Byte-wise name order used by images and frozen trees
+static int name_compare(const char *a, size_t a_len, const char *b, size_t b_len)
 {
-    if (tree == NULL || name == NULL || strlen(name) >= 256)
-        return NULL;
+    int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (cmp != 0)
+        return cmp;
+    return a_len < b_len ? -1 : a_len > b_len;
+}
 
-    // Check for existing directory with same name
-    if (parent != NULL && find_child_directory(parent, name) != NULL)
-    {
-        return NULL;
-    }
+// Copies name into tree-owned storage sized to fit and caches its length and hash
+static bool node_set_name(Tree *tree, Node *node, const char *name, size_t len)
+{
+    char *copy = tree_alloc(tree, len + 1);
+    if (copy == NULL)
+        return false;
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    node->name = copy;
+    node->name_len = (uint8_t)len;
+    node->hash = hash_name(name, len);
+    return true;
+}
 
-    Directory *new_dir = (Directory *)malloc(sizeof(Directory));
-    if (new_dir == NULL)
-        return NULL;
+static void node_free_name(Tree *tree, Node *node)
+{
+    tree_free(tree, (char *)node->name, (size_t)node->name_len + 1);
+    node->name = NULL;
+}
 
-    // Initialize the new directory
-    memset(new_dir, 0, sizeof(Directory));
-    strncpy(new_dir->base.name, name, 255);
-    new_dir->base.parent = (Node *)parent;
+// Per-directory name fingerprints: one 16-bit key per entry holding the name's
+// length and a byte of its hash, kept in a dense array beside the node
+// pointers. A scan compares a whole vector of keys at a time, so only entries
+// whose key matches have their names compared. Subdirectories and leaves are
+// kept apart so each lookup scans only its own kind.
+typedef struct FingerprintSet
+{
+    Node **nodes;   // Entry i is nodes[i]; order is arbitrary
+    uint16_t *keys; // Lives in the same block, after nodes
+    uint32_t count;
+    uint32_t capacity;
+} FingerprintSet;
 
-    // Handle root directory
-    if (parent == NULL)
+struct DirPrints
+{
+    FingerprintSet dirs;
+    FingerprintSet leaves;
+};
+
+static inline uint16_t fingerprint(size_t len, uint32_t hash)
+{
+    return (uint16_t)(len << 8 | hash >> 24);
+}
+
+static Node *prints_find(const FingerprintSet *set, const char *name, size_t len, uint32_t hash)
+{
+    const uint16_t key = fingerprint(len, hash);
+    const uint16_t *keys = set->keys;
+    uint32_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i needle = _mm256_set1_epi16((short)key);
+    for (; i + 16 <= set->count; i += 16)
     {
-        if (tree->root != NULL)
+        STATS_COUNT(siblings_scanned, 16);
+        __m256i block = _mm256_loadu_si256((const __m256i *)(keys + i));
+        uint32_t hits = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi16(block, needle));
+        while (hits != 0)
         {
-            free(new_dir);
-            return NULL;
+            // Two mask bits per 16-bit lane
+            unsigned lane = (unsigned)__builtin_ctz(hits) / 2;
+            Node *node = set->nodes[i + lane];
+            if (node_name_equals(node, name, len, hash))
+                return node;
+            hits &= ~(3u << (lane * 2));
         }
-        new_dir->base.tag = TREE_TAG_ROOT;
-        tree->root = new_dir;
+    }
+#elif defined(__SSE2__)
+    const __m128i needle = _mm_set1_epi16((short)key);
+    for (; i + 8 <= set->count; i += 8)
+    {
+        STATS_COUNT(siblings_scanned, 8);
+        __m128i block = _mm_loadu_si128((const __m128i *)(keys + i));
+        uint32_t hits = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi16(block, needle));
+        while (hits != 0)
+        {
+            unsigned lane = (unsigned)__builtin_ctz(hits) / 2;
+            Node *node = set->nodes[i + lane];
+            if (node_name_equals(node, name, len, hash))
+                return node;
+            hits &= ~(3u << (lane * 2));
+        }
+    }
+#elif defined(__ARM_NEON)
+    const uint16x8_t needle = vdupq_n_u16(key);
+    for (; i + 8 <= set->count; i += 8)
+    {
+        STATS_COUNT(siblings_scanned, 8);
+        // Narrow each 16-bit lane's match to 8 bits of a 64-bit mask
+        uint16x8_t eq = vceqq_u16(vld1q_u16(keys + i), needle);
+        uint64_t hits = vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(eq)), 0);
+        while (hits != 0)
+        {
+            unsigned lane = (unsigned)__builtin_ctzll(hits) / 8;
+            Node *node = set->nodes[i + lane];
+            if (node_name_equals(node, name, len, hash))
+                return node;
+            hits &= ~(0xffull << (lane * 8));
+        }
+    }
+#endif
+
+    for (; i < set->count; i++)
+    {
+        STATS_COUNT(siblings_scanned, 1);
+        if (keys[i] == key && node_name_equals(set->nodes[i], name, len, hash))
+            return set->nodes[i];
+    }
+    return NULL;
+}
+
+// Bytes of the single block holding a set's node pointers and keys
+static inline size_t prints_block_size(uint32_t capacity)
+{
+    return (size_t)capacity * (sizeof(Node *) + sizeof(uint16_t));
+}
+
+static bool prints_append(Tree *tree, FingerprintSet *set, Node *node)
+{
+    if (set->count == set->capacity)
+    {
+        uint32_t capacity = set->capacity ? set->capacity * 2 : 16;
+        Node **nodes = tree_alloc(tree, prints_block_size(capacity));
+        if (nodes == NULL)
+            return false;
+        uint16_t *keys = (uint16_t *)(nodes + capacity);
+        if (set->count > 0)
+        {
+            memcpy(nodes, set->nodes, set->count * sizeof(Node *));
+            memcpy(keys, set->keys, set->count * sizeof(uint16_t));
+        }
+        tree_free(tree, set->nodes, prints_block_size(set->capacity));
+        set->nodes = nodes;
+        set->keys = keys;
+        set->capacity = capacity;
+    }
+    set->nodes[set->count] = node;
+    set->keys[set->count] = fingerprint(node->name_len, node->hash);
+    set->count++;
+    return true;
+}
+
+// Removes a node by moving the last entry into its place
+static void prints_remove(FingerprintSet *set, Node *node)
+{
+    uint16_t key = fingerprint(node->name_len, node->hash);
+    for (uint32_t i = 0; i < set->count; i++)
+    {
+        if (set->keys[i] == key && set->nodes[i] == node)
+        {
+            set->count--;
+            set->nodes[i] = set->nodes[set->count];
+            set->keys[i] = set->keys[set->count];
+            return;
+        }
+    }
+}
+
+static void prints_free(Tree *tree, Directory *dir)
+{
+    DirPrints *prints = dir->prints;
+    if (prints == NULL)
+        return;
+    tree_free(tree, prints->dirs.nodes, prints_block_size(prints->dirs.capacity));
+    tree_free(tree, prints->leaves.nodes, prints_block_size(prints->leaves.capacity));
+    tree_free(tree, prints, sizeof(DirPrints));
+    dir->prints = NULL;
+}
+
+// Fingerprints an existing directory's lists; on failure it stays on list scans
+static void prints_build(Tree *tree, Directory *dir)
+{
+    DirPrints *prints = tree_alloc(tree, sizeof(DirPrints));
+    if (prints == NULL)
+        return;
+    memset(prints, 0, sizeof(DirPrints));
+    dir->prints = prints;
+
+    for (Directory *child = dir->first_child; child != NULL; child = child->next_dir)
+    {
+        if (!prints_append(tree, &prints->dirs, &child->base))
+        {
+            prints_free(tree, dir);
+            return;
+        }
+    }
+    for (Leaf *leaf = dir->first_leaf; leaf != NULL; leaf = leaf->next_leaf)
+    {
+        if (!prints_append(tree, &prints->leaves, &leaf->base))
+        {
+            prints_free(tree, dir);
+            return;
+        }
+    }
+}
+
+// Per-directory ordered view: a B+-tree over the Node pointers of a directory's
+// subdirectories and leaves, built on the first ordered query and then kept
+// in sync by dir_index_add and dir_index_remove. Entries are ordered by name,
+// with the tree's compare function when it has one and byte-wise otherwise;
+// a subdirectory sorts before a leaf of the same name.
+// Entries are held in the leaves, which are linked in order so scans never
+// climb back up; an inner node keeps the smallest entry under each child but
+// the first as that child's separator. Under byte-wise order each node also
+// records how many leading bytes all of its keys share, and keeps the next four
+// bytes of every key in one 64-byte block that SIMD compares four or eight at a
+// time, so most search steps read one name at most.
+#define ORDER_FANOUT 16 // Keys per node; nodes other than the root keep at least half as many
+#define ORDER_MIN_KEYS (ORDER_FANOUT / 2)
+#define ORDER_MAX_HEIGHT 16 // Far above what 2^32 entries need at this fanout
+
+typedef struct OrderNode OrderNode;
+struct OrderNode
+{
+    int32_t prefixes[ORDER_FANOUT]; // order_prefix of each key's name past the shared bytes
+    uint16_t count;                 // Entries of a leaf, or children of an inner node
+    bool leaf;
+    uint8_t skip;                      // Leading name bytes all keys share (byte-wise order only)
+    OrderNode *next;                   // Next leaf in order (leaves only)
+    Node *items[ORDER_FANOUT];         // Entries, or the separators of children 1..count-1
+    OrderNode *children[ORDER_FANOUT]; // Not allocated for leaf nodes
+};
+
+struct DirOrder
+{
+    OrderNode *root;
+};
+
+// Search key. Bound kinds sort before or after every entry whose name compares equal.
+#define ORDER_BELOW (-1)
+#define ORDER_DIR 0
+#define ORDER_LEAF 1
+#define ORDER_ABOVE 2
+
+typedef struct OrderKey
+{
+    const char *name; // NUL-terminated
+    size_t len;
+    int kind;
+} OrderKey;
+
+// In-order position: a leaf and the index of the next entry in it
+typedef struct OrderCursor
+{
+    const OrderNode *leaf; // NULL once the entries are used up
+    uint32_t pos;
+} OrderCursor;
+
+// Inner nodes from the root down to a leaf, with the child taken at each
+typedef struct OrderPath
+{
+    OrderNode *nodes[ORDER_MAX_HEIGHT];
+    uint32_t pos[ORDER_MAX_HEIGHT];
+    int depth;
+} OrderPath;
+
+static inline OrderKey order_key(const Node *node)
+{
+    return (OrderKey){.name = node->name, .len = node->name_len, .kind = (node->tag & TREE_TAG_LEAF) ? ORDER_LEAF : ORDER_DIR};
+}
+
+static int order_compare(const Tree *tree, const OrderKey *key, const Node *node)
+{
+    int cmp = tree->compare != NULL ? tree->compare((void *)key->name, (void *)node->name)
+                                    : name_compare(key->name, key->len, node->name, node->name_len);
+    if (cmp != 0)
+        return cmp;
+    if (key->kind == ORDER_BELOW || key->kind == ORDER_ABOVE)
+        return key->kind == ORDER_BELOW ? -1 : 1;
+    // Names the user's order considers equal still need a fixed order
+    if (tree->compare != NULL && (cmp = name_compare(key->name, key->len, node->name, node->name_len)) != 0)
+        return cmp;
+    return key->kind - ((node->tag & TREE_TAG_LEAF) ? ORDER_LEAF : ORDER_DIR);
+}
+
+// The four bytes of a name that follow its first skip, zero-padded, as a
+// big-endian number biased so that signed comparison follows byte-wise order.
+// Between names that agree on their first skip bytes, different prefixes
+// decide a comparison and equal ones leave it to the names. A user compare
+// function need not agree, so its trees keep every prefix at zero.
+static inline int32_t order_prefix(const char *name, size_t len, size_t skip)
+{
+    uint32_t prefix = 0;
+    for (size_t i = skip; i < skip + 4; i++)
+        prefix = prefix << 8 | (i < len ? (uint8_t)name[i] : 0);
+    return (int32_t)(prefix ^ 0x80000000u);
+}
+
+// Length of the longest common prefix of two names
+static inline size_t order_common(const Node *a, const Node *b)
+{
+    size_t len = a->name_len < b->name_len ? a->name_len : b->name_len;
+    size_t i = 0;
+    while (i < len && a->name[i] == b->name[i])
+        i++;
+    return i;
+}
+
+// Recomputes a node's shared byte count and prefixes after keys moved in or out
+static void order_node_refresh(const Tree *tree, OrderNode *node)
+{
+    uint32_t first = node->leaf ? 0 : 1;
+    node->skip = 0;
+    if (tree->compare != NULL || node->count <= first)
+        return;
+    const Node *ref = node->items[first];
+    size_t skip = ref->name_len;
+    for (uint32_t i = first + 1; i < node->count && skip > 0; i++)
+    {
+        size_t common = order_common(ref, node->items[i]);
+        if (common < skip)
+            skip = common;
+    }
+    node->skip = (uint8_t)skip;
+    for (uint32_t i = first; i < node->count; i++)
+        node->prefixes[i] = order_prefix(node->items[i]->name, node->items[i]->name_len, skip);
+}
+
+// Stores a key in slot i of a node, keeping the shared byte count valid
+static void order_node_set(const Tree *tree, OrderNode *node, uint32_t i, Node *item)
+{
+    node->items[i] = item;
+    if (tree->compare != NULL)
+        return;
+    // Any other key stands for all of them, as they share the first skip bytes
+    uint32_t first = node->leaf ? 0 : 1;
+    uint32_t other = i == first ? first + 1 : first;
+    if (other >= node->count || order_common(item, node->items[other]) < node->skip)
+        order_node_refresh(tree, node);
+    else
+        node->prefixes[i] = order_prefix(item->name, item->name_len, node->skip);
+}
+
+// Bit i of *below is set when prefixes[i] is smaller than prefix, and of *above when it is larger
+static inline void order_prefix_masks(const OrderNode *node, int32_t prefix, uint32_t *below, uint32_t *above)
+{
+    uint32_t lt = 0, gt = 0;
+#if defined(__AVX2__)
+    const __m256i needle = _mm256_set1_epi32(prefix);
+    for (int i = 0; i < ORDER_FANOUT; i += 8)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(node->prefixes + i));
+        lt |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(needle, block))) << i;
+        gt |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(block, needle))) << i;
+    }
+#elif defined(__SSE2__)
+    const __m128i needle = _mm_set1_epi32(prefix);
+    for (int i = 0; i < ORDER_FANOUT; i += 4)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(node->prefixes + i));
+        lt |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(needle, block))) << i;
+        gt |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(block, needle))) << i;
+    }
+#elif defined(__ARM_NEON)
+    static const uint32_t lanes[4] = {1, 2, 4, 8};
+    const int32x4_t needle = vdupq_n_s32(prefix);
+    const uint32x4_t bits = vld1q_u32(lanes);
+    for (int i = 0; i < ORDER_FANOUT; i += 4)
+    {
+        int32x4_t block = vld1q_s32(node->prefixes + i);
+        uint32x4_t l = vandq_u32(vcltq_s32(block, needle), bits);
+        uint32x4_t g = vandq_u32(vcgtq_s32(block, needle), bits);
+        // Fold the four lane bits of each mask together
+        uint32x2_t lf = vorr_u32(vget_low_u32(l), vget_high_u32(l));
+        uint32x2_t gf = vorr_u32(vget_low_u32(g), vget_high_u32(g));
+        lt |= (vget_lane_u32(lf, 0) | vget_lane_u32(lf, 1)) << i;
+        gt |= (vget_lane_u32(gf, 0) | vget_lane_u32(gf, 1)) << i;
+    }
+#else
+    for (int i = 0; i < ORDER_FANOUT; i++)
+    {
+        lt |= (uint32_t)(node->prefixes[i] < prefix) << i;
+        gt |= (uint32_t)(node->prefixes[i] > prefix) << i;
+    }
+#endif
+    *below = lt;
+    *above = gt;
+}
+
+// Index of the first key in items[first..count) not below key; *found tells whether it equals key
+static uint32_t order_search(const Tree *tree, const OrderNode *node, uint32_t first, const OrderKey *key,
+                             bool *found)
+{
+    *found = false;
+    if (first >= node->count)
+        return first;
+    STATS_COUNT(siblings_scanned, 1);
+    int32_t prefix = 0;
+    if (tree->compare == NULL)
+    {
+        // A key that leaves the node's shared bytes sorts before or after all of its keys
+        size_t skip = node->skip;
+        if (skip > 0)
+        {
+            const Node *ref = node->items[first];
+            int cmp = memcmp(key->name, ref->name, key->len < skip ? key->len : skip);
+            if (cmp == 0 && key->len < skip)
+                cmp = -1;
+            if (cmp != 0)
+                return cmp < 0 ? first : node->count;
+        }
+        prefix = order_prefix(key->name, key->len, skip);
+    }
+
+    uint32_t below, above;
+    uint32_t keys = ((1u << node->count) - 1) & ~((1u << first) - 1);
+    order_prefix_masks(node, prefix, &below, &above);
+
+    // Keys are sorted, so the ones sharing key's prefix form a single run
+    uint32_t low = first + (uint32_t)__builtin_popcount(below & keys);
+    uint32_t high = node->count - (uint32_t)__builtin_popcount(above & keys);
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        STATS_COUNT(siblings_scanned, 1);
+        int cmp = order_compare(tree, key, node->items[mid]);
+        if (cmp == 0)
+        {
+            *found = true;
+            return mid;
+        }
+        if (cmp < 0)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return low;
+}
+
+// Child of an inner node whose range holds key; *found tells whether key is its separator
+static inline uint32_t order_child(const Tree *tree, const OrderNode *node, const OrderKey *key, bool *found)
+{
+    uint32_t i = order_search(tree, node, 1, key, found);
+    return *found ? i : i - 1;
+}
+
+static inline size_t order_node_size(bool leaf)
+{
+    return leaf ? offsetof(OrderNode, children) : sizeof(OrderNode);
+}
+
+static OrderNode *order_node_new(Tree *tree, bool leaf)
+{
+    OrderNode *node = tree_alloc(tree, order_node_size(leaf));
+    if (node == NULL)
+        return NULL;
+    memset(node->prefixes, 0, sizeof(node->prefixes));
+    node->count = 0;
+    node->leaf = leaf;
+    node->skip = 0;
+    node->next = NULL;
+    return node;
+}
+
+static void order_node_free(Tree *tree, OrderNode *node)
+{
+    tree_free(tree, node, order_node_size(node->leaf));
+}
+
+// Opens slot i of a node with room to spare for a key (and, in inner nodes, its
+// child); the caller then stores the key with order_node_set or refreshes the node
+static void order_node_insert(OrderNode *node, uint32_t i, Node *item, OrderNode *child)
+{
+    uint32_t tail = node->count - i;
+    memmove(node->items + i + 1, node->items + i, tail * sizeof(Node *));
+    memmove(node->prefixes + i + 1, node->prefixes + i, tail * sizeof(int32_t));
+    node->items[i] = item;
+    if (!node->leaf)
+    {
+        memmove(node->children + i + 1, node->children + i, tail * sizeof(OrderNode *));
+        node->children[i] = child;
+    }
+    node->count++;
+}
+
+static void order_node_erase(OrderNode *node, uint32_t i)
+{
+    uint32_t tail = node->count - i - 1;
+    memmove(node->items + i, node->items + i + 1, tail * sizeof(Node *));
+    memmove(node->prefixes + i, node->prefixes + i + 1, tail * sizeof(int32_t));
+    if (!node->leaf)
+        memmove(node->children + i, node->children + i + 1, tail * sizeof(OrderNode *));
+    node->count--;
+}
+
+// Moves the upper half of a full node into the empty node right, which then follows it
+static void order_split(OrderNode *node, OrderNode *right)
+{
+    uint32_t moved = ORDER_FANOUT - ORDER_MIN_KEYS;
+    memcpy(right->items, node->items + ORDER_MIN_KEYS, moved * sizeof(Node *));
+    if (node->leaf)
+    {
+        right->next = node->next;
+        node->next = right;
+    }
+    else
+    {
+        // right->items[0] keeps the separator of its first child for the parent to take
+        memcpy(right->children, node->children + ORDER_MIN_KEYS, moved * sizeof(OrderNode *));
+    }
+    right->count = (uint16_t)moved;
+    node->count = ORDER_MIN_KEYS;
+}
+
+// Inserts a node, splitting full nodes from the leaf up; false if memory ran out,
+// in which case the tree is unchanged
+static bool order_insert(Tree *tree, DirOrder *order, Node *item)
+{
+    if (order->root == NULL && (order->root = order_node_new(tree, true)) == NULL)
+        return false;
+
+    OrderKey key = order_key(item);
+    OrderPath path;
+    path.depth = 0;
+    OrderNode *node = order->root;
+    bool found;
+    while (!node->leaf)
+    {
+        uint32_t i = order_child(tree, node, &key, &found);
+        path.nodes[path.depth] = node;
+        path.pos[path.depth] = i;
+        path.depth++;
+        node = node->children[i];
+    }
+    uint32_t at = order_search(tree, node, 0, &key, &found);
+
+    // Allocate every node the splits need before changing anything
+    OrderNode *spare[ORDER_MAX_HEIGHT + 1];
+    int needed = 0;
+    if (node->count == ORDER_FANOUT)
+    {
+        needed = 1;
+        while (needed <= path.depth && path.nodes[path.depth - needed]->count == ORDER_FANOUT)
+            needed++;
+        if (needed == path.depth + 1)
+            needed++; // The root splits too
+    }
+    for (int i = 0; i < needed; i++)
+    {
+        // One right sibling per full level, and a new root once the old one splits
+        if ((spare[i] = order_node_new(tree, i == 0)) == NULL)
+        {
+            while (i-- > 0)
+                order_node_free(tree, spare[i]);
+            return false;
+        }
+    }
+
+    Node *entry = item;
+    OrderNode *child = NULL;
+    for (int level = path.depth, used = 0;; level--)
+    {
+        if (node->count < ORDER_FANOUT)
+        {
+            order_node_insert(node, at, entry, child);
+            order_node_set(tree, node, at, entry);
+            return true;
+        }
+        OrderNode *right = spare[used++];
+        order_split(node, right);
+        if (at <= ORDER_MIN_KEYS)
+            order_node_insert(node, at, entry, child);
+        else
+            order_node_insert(right, at - ORDER_MIN_KEYS, entry, child);
+        // Each half may share more leading bytes than the full node did
+        order_node_refresh(tree, node);
+        order_node_refresh(tree, right);
+
+        // right joins the parent right after node, separated by its smallest entry
+        entry = right->items[0];
+        child = right;
+        if (level == 0)
+        {
+            OrderNode *root = spare[used];
+            root->children[0] = node;
+            root->children[1] = right;
+            root->items[1] = entry;
+            root->count = 2;
+            order_node_refresh(tree, root);
+            order->root = root;
+            return true;
+        }
+        node = path.nodes[level - 1];
+        at = path.pos[level - 1] + 1;
+    }
+}
+
+// Refills child i of parent, which has dropped below ORDER_MIN_KEYS keys, with
+// a key from a sibling that can spare one, or else merges it with a sibling
+static void order_rebalance(Tree *tree, OrderNode *parent, uint32_t i)
+{
+    OrderNode *child = parent->children[i];
+    if (i > 0 && parent->children[i - 1]->count > ORDER_MIN_KEYS)
+    {
+        // The left sibling's last key moves over, and becomes child's separator
+        OrderNode *left = parent->children[i - 1];
+        uint32_t last = left->count - 1u;
+        if (!child->leaf)
+            child->items[0] = parent->items[i]; // Ends up over child's old first child
+        order_node_insert(child, 0, left->items[last], child->leaf ? NULL : left->children[last]);
+        order_node_refresh(tree, child);
+        order_node_set(tree, parent, i, left->items[last]);
+        left->count--;
+        return;
+    }
+    if (i + 1 < parent->count && parent->children[i + 1]->count > ORDER_MIN_KEYS)
+    {
+        // The right sibling's first key moves over; its second becomes the sibling's separator
+        OrderNode *right = parent->children[i + 1];
+        Node *moved = child->leaf ? right->items[0] : parent->items[i + 1];
+        order_node_insert(child, child->count, moved, child->leaf ? NULL : right->children[0]);
+        order_node_set(tree, child, child->count - 1u, moved);
+        order_node_set(tree, parent, i + 1, right->items[1]);
+        order_node_erase(right, 0);
+        return;
+    }
+
+    // Merge the pair into its left node; neither has a key to spare
+    uint32_t j = i > 0 ? i - 1 : i;
+    OrderNode *left = parent->children[j];
+    OrderNode *right = parent->children[j + 1];
+    if (left->leaf)
+    {
+        left->next = right->next;
     }
     else
     {
-        new_dir->base.tag = TREE_TAG_NODE;
-        // Add to parent's children list
-        if (parent->first_child == NULL)
+        right->items[0] = parent->items[j + 1];
+        memcpy(left->children + left->count, right->children, right->count * sizeof(OrderNode *));
+    }
+    memcpy(left->items + left->count, right->items, right->count * sizeof(Node *));
+    left->count += right->count;
+    order_node_refresh(tree, left);
+    order_node_erase(parent, j + 1);
+    order_node_free(tree, right);
+}
+
+// Points the separator still naming a deleted entry at the smallest entry now
+// under its child. Rebalancing only moves separators, so the stale one is
+// still on the deleted key's search path.
+static void order_replace_separator(const Tree *tree, OrderNode *node, const OrderKey *key, const Node *item)
+{
+    while (!node->leaf)
+    {
+        bool found;
+        uint32_t i = order_child(tree, node, key, &found);
+        if (found && node->items[i] == item)
+        {
+            const OrderNode *min = node->children[i];
+            while (!min->leaf)
+                min = min->children[0];
+            order_node_set(tree, node, i, min->items[0]);
+            return;
+        }
+        node = node->children[i];
+    }
+}
+
+// Removes a node, rebalancing from the leaf up; called while item's name is still readable
+static void order_remove(Tree *tree, DirOrder *order, Node *item)
+{
+    if (order->root == NULL)
+        return;
+
+    OrderKey key = order_key(item);
+    OrderPath path;
+    path.depth = 0;
+    OrderNode *node = order->root;
+    bool found, separator = false;
+    while (!node->leaf)
+    {
+        uint32_t i = order_child(tree, node, &key, &found);
+        separator |= found;
+        path.nodes[path.depth] = node;
+        path.pos[path.depth] = i;
+        path.depth++;
+        node = node->children[i];
+    }
+    uint32_t at = order_search(tree, node, 0, &key, &found);
+    if (!found)
+        return;
+    order_node_erase(node, at);
+
+    for (int level = path.depth; level > 0 && node->count < ORDER_MIN_KEYS; level--)
+    {
+        order_rebalance(tree, path.nodes[level - 1], path.pos[level - 1]);
+        node = path.nodes[level - 1];
+    }
+
+    // A root left with one child hands over to it, and an empty one goes
+    OrderNode *root = order->root;
+    if (root->leaf ? root->count == 0 : root->count == 1)
+    {
+        order->root = root->leaf ? NULL : root->children[0];
+        order_node_free(tree, root);
+    }
+    if (separator && order->root != NULL)
+        order_replace_separator(tree, order->root, &key, item);
+}
+
+static void order_free(Tree *tree, Directory *dir)
+{
+    DirOrder *order = dir->order;
+    if (order == NULL)
+        return;
+    dir->order = NULL;
+
+    // Free bottom-up with the path from the root as the stack
+    OrderNode *stack[ORDER_MAX_HEIGHT];
+    uint16_t next[ORDER_MAX_HEIGHT];
+    int depth = 0;
+    if (order->root != NULL)
+    {
+        stack[0] = order->root;
+        next[0] = 0;
+        depth = 1;
+    }
+    while (depth > 0)
+    {
+        OrderNode *node = stack[depth - 1];
+        if (!node->leaf && next[depth - 1] < node->count)
+        {
+            stack[depth] = node->children[next[depth - 1]++];
+            next[depth] = 0;
+            depth++;
+            continue;
+        }
+        order_node_free(tree, node);
+        depth--;
+    }
+    tree_free(tree, order, sizeof(DirOrder));
+}
+
+static void order_build(Tree *tree, Directory *dir)
+{
+    DirOrder *order = tree_alloc(tree, sizeof(DirOrder));
+    if (order == NULL)
+        return;
+    order->root = NULL;
+    dir->order = order;
+
+    bool ok = true;
+    for (Directory *child = dir->first_child; ok && child != NULL; child = child->next_dir)
+        ok = order_insert(tree, order, &child->base);
+    for (Leaf *leaf = dir->first_leaf; ok && leaf != NULL; leaf = leaf->next_leaf)
+        ok = order_insert(tree, order, &leaf->base);
+    if (!ok)
+        order_free(tree, dir);
+}
+
+// Moves past the end of a leaf onto the next one
+static inline void order_cursor_settle(OrderCursor *cursor)
+{
+    while (cursor->leaf != NULL && cursor->pos >= cursor->leaf->count)
+    {
+        cursor->leaf = cursor->leaf->next;
+        cursor->pos = 0;
+    }
+}
+
+// Positions the cursor at the first entry not below key, or at the very first entry for a NULL key
+static void order_seek(const Tree *tree, const DirOrder *order, const OrderKey *key, OrderCursor *cursor)
+{
+    cursor->leaf = NULL;
+    cursor->pos = 0;
+    const OrderNode *node = order->root;
+    if (node == NULL)
+        return;
+    bool found;
+    while (!node->leaf)
+        node = node->children[key != NULL ? order_child(tree, node, key, &found) : 0];
+    cursor->leaf = node;
+    if (key != NULL)
+        cursor->pos = order_search(tree, node, 0, key, &found);
+    order_cursor_settle(cursor);
+}
+
+static inline Node *order_cursor_node(const OrderCursor *cursor)
+{
+    if (cursor->leaf == NULL)
+        return NULL;
+    return cursor->leaf->items[cursor->pos];
+}
+
+static inline void order_cursor_next(OrderCursor *cursor)
+{
+    cursor->pos++;
+    order_cursor_settle(cursor);
+}
+
+// Per-directory name index: open addressing with linear probing over Node
+// pointers. Directories and leaves share one table and are told apart by tag.
+struct DirIndex
+{
+    Node **slots;
+    uint32_t capacity; // Always a power of two
+    uint32_t count;    // Live entries
+    uint32_t used;     // Live entries plus tombstones
+};
+
+static char index_tombstone;
+#define DIR_INDEX_TOMBSTONE ((Node *)&index_tombstone)
+
+static Node *dir_index_find(DirIndex *index, const char *name, size_t len, uint32_t hash, bool leaf)
+{
+    uint32_t mask = index->capacity - 1;
+    uint32_t i = hash & mask;
+    Node *slot;
+    while ((slot = index->slots[i]) != NULL)
+    {
+        STATS_COUNT(siblings_scanned, 1);
+        if (slot != DIR_INDEX_TOMBSTONE && is_leaf(slot) == leaf && node_name_equals(slot, name, len, hash))
+            return slot;
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+// Places a node into a table known to have a free slot
+static void dir_index_place(DirIndex *index, Node *node)
+{
+    uint32_t mask = index->capacity - 1;
+    uint32_t i = node->hash & mask;
+    while (index->slots[i] != NULL && index->slots[i] != DIR_INDEX_TOMBSTONE)
+        i = (i + 1) & mask;
+    if (index->slots[i] == NULL)
+        index->used++;
+    index->slots[i] = node;
+    index->count++;
+}
+
+// Rebuilds the table with room for at least 'entries' live entries
+static bool dir_index_resize(Tree *tree, DirIndex *index, uint32_t entries)
+{
+    uint32_t capacity = 64;
+    while (capacity / 2 < entries)
+        capacity *= 2;
+
+    Node **slots = tree_alloc(tree, capacity * sizeof(Node *));
+    if (slots == NULL)
+        return false;
+    memset(slots, 0, capacity * sizeof(Node *));
+
+    Node **old_slots = index->slots;
+    uint32_t old_capacity = index->capacity;
+    index->slots = slots;
+    index->capacity = capacity;
+    index->count = 0;
+    index->used = 0;
+    for (uint32_t i = 0; i < old_capacity; i++)
+    {
+        if (old_slots[i] != NULL && old_slots[i] != DIR_INDEX_TOMBSTONE)
+            dir_index_place(index, old_slots[i]);
+    }
+    tree_free(tree, old_slots, old_capacity * sizeof(Node *));
+    return true;
+}
+
+/**
+ * @brief Builds the name index of a directory from its child and leaf lists.
+ *
+ * @param tree Pointer to the tree that owns the directory
+ * @param dir The directory to index
+ *
+ * @note The index is optional: if memory runs out the directory simply stays
+ *       unindexed and lookups fall back to scanning the lists.
+ */
+static void dir_index_build(Tree *tree, Directory *dir)
+{
+    DirIndex *index = tree_alloc(tree, sizeof(DirIndex));
+    if (index == NULL)
+        return;
+    memset(index, 0, sizeof(DirIndex));
+    if (!dir_index_resize(tree, index, dir->dir_count + dir->leaf_count))
+    {
+        tree_free(tree, index, sizeof(DirIndex));
+        return;
+    }
+
+    for (Directory *child = dir->first_child; child != NULL; child = child->next_dir)
+        dir_index_place(index, &child->base);
+    for (Leaf *leaf = dir->first_leaf; leaf != NULL; leaf = leaf->next_leaf)
+        dir_index_place(index, &leaf->base);
+    dir->index = index;
+}
+
+// Keeps the indexes in sync after a node has been linked into dir. Directories
+// gain fingerprints past TREE_FINGERPRINT_THRESHOLD entries of either kind and
+// trade them for the hash index past TREE_INDEX_THRESHOLD.
+static void dir_index_add(Tree *tree, Directory *dir, Node *node)
+{
+    if (dir->order != NULL && !order_insert(tree, dir->order, node))
+        order_free(tree, dir); // Rebuilt by the next ordered query
+    DirIndex *index = dir->index;
+    if (index == NULL)
+    {
+        if (dir->dir_count > TREE_INDEX_THRESHOLD || dir->leaf_count > TREE_INDEX_THRESHOLD)
+        {
+            dir_index_build(tree, dir);
+            if (dir->index != NULL)
+            {
+                prints_free(tree, dir);
+                return;
+            }
+        }
+        if (dir->prints != NULL)
+        {
+            FingerprintSet *set = is_leaf(node) ? &dir->prints->leaves : &dir->prints->dirs;
+            if (!prints_append(tree, set, node))
+                prints_free(tree, dir);
+        }
+        else if (dir->dir_count > TREE_FINGERPRINT_THRESHOLD || dir->leaf_count > TREE_FINGERPRINT_THRESHOLD)
+        {
+            prints_build(tree, dir);
+        }
+        return;
+    }
+
+    if ((index->used + 1) * 4 > index->capacity * 3 && !dir_index_resize(tree, index, index->count + 1))
+    {
+        // Could not grow: drop the index rather than let it go stale
+        dir_index_free(tree, dir);
+        return;
+    }
+    dir_index_place(index, node);
+}
+
+// Removes a node that is about to be unlinked from dir
+static void dir_index_remove(Tree *tree, Directory *dir, Node *node)
+{
+    if (dir->order != NULL)
+        order_remove(tree, dir->order, node);
+    if (dir->prints != NULL)
+        prints_remove(is_leaf(node) ? &dir->prints->leaves : &dir->prints->dirs, node);
+
+    DirIndex *index = dir->index;
+    if (index == NULL)
+        return;
+
+    uint32_t mask = index->capacity - 1;
+    uint32_t i = node->hash & mask;
+    while (index->slots[i] != NULL)
+    {
+        if (index->slots[i] == node)
+        {
+            index->slots[i] = DIR_INDEX_TOMBSTONE;
+            index->count--;
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+static void dir_index_free(Tree *tree, Directory *dir)
+{
+    prints_free(tree, dir);
+    order_free(tree, dir);
+    if (dir->index == NULL)
+        return;
+    tree_free(tree, dir->index->slots, dir->index->capacity * sizeof(Node *));
+    tree_free(tree, dir->index, sizeof(DirIndex));
+    dir->index = NULL;
+}
+
+// Length of the full path of a node as used by the path index: "/" for the
+// root, otherwise "/" followed by every name below the root joined by "/"
+static size_t node_path_length(Node *node)
+{
+    if (node->parent == NULL)
+        return 1;
+    size_t len = 0;
+    for (; node->parent != NULL; node = node->parent)
+        len += (size_t)node->name_len + 1;
+    return len;
+}
+
+// Writes the full path of a node into buf, which must hold node_path_length + 1 bytes
+static void node_path_write(Node *node, char *buf, size_t len)
+{
+    buf[len] = '\0';
+    if (node->parent == NULL)
+    {
+        buf[0] = '/';
+        return;
+    }
+    for (; node->parent != NULL; node = node->parent)
+    {
+        len -= node->name_len;
+        memcpy(buf + len, node->name, node->name_len);
+        buf[--len] = '/';
+    }
+}
+
+// Hash of the normalized form of any '/'-separated path, computed without
+// copying it; matches hash_name over the keys produced by node_path_write
+static uint32_t path_hash(const char *path)
+{
+    uint32_t hash = 2166136261u;
+    const char *cursor = path;
+    PathSlice component;
+    bool any = false;
+    while (path_next(&cursor, &component))
+    {
+        hash ^= '/';
+        hash *= 16777619u;
+        for (size_t i = 0; i < component.len; i++)
+        {
+            hash ^= (uint8_t)component.ptr[i];
+            hash *= 16777619u;
+        }
+        any = true;
+    }
+    if (!any)
+    {
+        hash ^= '/';
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Compares a normalized key with an arbitrary path, component by component
+static bool path_equals(const char *key, const char *path)
+{
+    const char *cursor = path;
+    PathSlice component;
+    const char *k = key;
+    while (path_next(&cursor, &component))
+    {
+        if (*k != '/' || strncmp(k + 1, component.ptr, component.len) != 0)
+            return false;
+        k += component.len + 1;
+        if (*k != '\0' && *k != '/')
+            return false;
+    }
+    return *k == '\0' || (k == key && strcmp(key, "/") == 0);
+}
+
+// Tree-wide index from normalized full path to node, used with
+// TREE_OPT_PATH_INDEX. Keys are owned copies of the paths; a directory and a
+// leaf may share a path and are told apart by the node's tag.
+typedef struct PathEntry
+{
+    Node *node; // NULL for an empty slot, DIR_INDEX_TOMBSTONE once removed
+    char *path;
+    uint32_t hash;
+    uint32_t len;
+} PathEntry;
+
+struct PathIndex
+{
+    PathEntry *slots;
+    uint32_t capacity; // Always a power of two
+    uint32_t count;
+    uint32_t used;
+};
+
+static void path_index_place(PathIndex *index, PathEntry entry)
+{
+    uint32_t mask = index->capacity - 1;
+    uint32_t i = entry.hash & mask;
+    while (index->slots[i].node != NULL && index->slots[i].node != DIR_INDEX_TOMBSTONE)
+        i = (i + 1) & mask;
+    if (index->slots[i].node == NULL)
+        index->used++;
+    index->slots[i] = entry;
+    index->count++;
+}
+
+static bool path_index_resize(Tree *tree, PathIndex *index, uint32_t entries)
+{
+    uint32_t capacity = 256;
+    while (capacity / 2 < entries)
+        capacity *= 2;
+
+    PathEntry *slots = tree_alloc(tree, capacity * sizeof(PathEntry));
+    if (slots == NULL)
+        return false;
+    memset(slots, 0, capacity * sizeof(PathEntry));
+
+    PathEntry *old_slots = index->slots;
+    uint32_t old_capacity = index->capacity;
+    index->slots = slots;
+    index->capacity = capacity;
+    index->count = 0;
+    index->used = 0;
+    for (uint32_t i = 0; i < old_capacity; i++)
+    {
+        if (old_slots[i].node != NULL && old_slots[i].node != DIR_INDEX_TOMBSTONE)
+            path_index_place(index, old_slots[i]);
+    }
+    tree_free(tree, old_slots, old_capacity * sizeof(PathEntry));
+    return true;
+}
+
+static void path_index_free(Tree *tree)
+{
+    PathIndex *index = tree->paths;
+    if (index == NULL)
+        return;
+    for (uint32_t i = 0; i < index->capacity; i++)
+    {
+        PathEntry *entry = &index->slots[i];
+        if (entry->node != NULL && entry->node != DIR_INDEX_TOMBSTONE)
+            tree_free(tree, entry->path, (size_t)entry->len + 1);
+    }
+    tree_free(tree, index->slots, index->capacity * sizeof(PathEntry));
+    tree_free(tree, index, sizeof(PathIndex));
+    tree->paths = NULL;
+}
+
+/**
+ * @brief Records a newly linked node in the tree's path index.
+ *
+ * @param tree Pointer to the tree structure
+ * @param node The node that has just been created
+ *
+ * @note The index is created with the first node. If memory runs out the index
+ *       is dropped as a whole and lookup_path falls back to walking the tree.
+ */
+static void path_index_add_locked(Tree *tree, Node *node)
+{
+
+    PathIndex *index = tree->paths;
+    if (index == NULL)
+    {
+        if (node->parent != NULL)
+            return; // Index was dropped: stay unindexed
+        index = tree_alloc(tree, sizeof(PathIndex));
+        if (index == NULL)
+            return;
+        memset(index, 0, sizeof(PathIndex));
+        tree->paths = index;
+    }
+
+    PathEntry entry = {.node = node};
+    entry.len = (uint32_t)node_path_length(node);
+    entry.path = tree_alloc(tree, (size_t)entry.len + 1);
+    bool ok = entry.path != NULL;
+    if (ok && (index->used + 1) * 4 > index->capacity * 3)
+        ok = path_index_resize(tree, index, index->count + 1);
+    if (!ok)
+    {
+        tree_free(tree, entry.path, (size_t)entry.len + 1);
+        path_index_free(tree);
+        return;
+    }
+    node_path_write(node, entry.path, entry.len);
+    entry.hash = hash_name(entry.path, entry.len);
+    path_index_place(index, entry);
+}
+
+static void path_index_add(Tree *tree, Node *node)
+{
+    if (!(tree->options & TREE_OPT_PATH_INDEX))
+        return;
+
+    if (is_concurrent(tree))
+        lock_write(&tree->paths_lock);
+    path_index_add_locked(tree, node);
+    if (is_concurrent(tree))
+        unlock_write(&tree->paths_lock);
+}
+
+// Drops the entry of a node that is still linked into the tree
+static void path_index_remove_locked(Tree *tree, Node *node)
+{
+    PathIndex *index = tree->paths;
+    if (index == NULL)
+        return;
+
+    char inline_path[512];
+    size_t len = node_path_length(node);
+    char *path = len < sizeof(inline_path) ? inline_path : malloc(len + 1);
+    uint32_t hash = 0;
+    bool hashed = path != NULL;
+    if (hashed)
+    {
+        node_path_write(node, path, len);
+        hash = hash_name(path, len);
+        if (path != inline_path)
+            free(path);
+    }
+    // Otherwise fall back to scanning the whole table for the node
+
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t i = hash & mask, n = 0; n < index->capacity; i = (i + 1) & mask, n++)
+    {
+        PathEntry *entry = &index->slots[i];
+        if (hashed && entry->node == NULL)
+            return;
+        if (entry->node == node)
+        {
+            tree_free(tree, entry->path, (size_t)entry->len + 1);
+            entry->node = DIR_INDEX_TOMBSTONE;
+            entry->path = NULL;
+            index->count--;
+            return;
+        }
+    }
+}
+
+static void path_index_remove(Tree *tree, Node *node)
+{
+    if (!(tree->options & TREE_OPT_PATH_INDEX))
+        return;
+
+    if (is_concurrent(tree))
+        lock_write(&tree->paths_lock);
+    path_index_remove_locked(tree, node);
+    if (is_concurrent(tree))
+        unlock_write(&tree->paths_lock);
+}
+
+static void path_index_remove_tree(Tree *tree, Directory *dir)
+{
+    TreeIter iter;
+    tree_iter_begin(&iter, tree, dir, TREE_ITER_PREORDER);
+    for (Node *node = tree_iter_next(&iter); node != NULL; node = tree_iter_next(&iter))
+        path_index_remove_locked(tree, node);
+}
+
+// Drops the entries of a directory and everything below it
+static void path_index_remove_subtree(Tree *tree, Directory *dir)
+{
+    if (!(tree->options & TREE_OPT_PATH_INDEX))
+        return;
+
+    if (is_concurrent(tree))
+        lock_write(&tree->paths_lock);
+    if (tree->paths != NULL)
+        path_index_remove_tree(tree, dir);
+    if (is_concurrent(tree))
+        unlock_write(&tree->paths_lock);
+}
+
+// Re-adds the entries of a subtree whose path has changed
+static void path_index_add_tree(Tree *tree, Directory *dir)
+{
+    TreeIter iter;
+    tree_iter_begin(&iter, tree, dir, TREE_ITER_PREORDER);
+    for (Node *node = tree_iter_next(&iter); node != NULL && tree->paths != NULL; node = tree_iter_next(&iter))
+        path_index_add_locked(tree, node);
+}
+
+static Node *path_index_find(PathIndex *index, const char *path, bool leaf)
+{
+    uint32_t hash = path_hash(path);
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t i = hash & mask; index->slots[i].node != NULL; i = (i + 1) & mask)
+    {
+        PathEntry *entry = &index->slots[i];
+        if (entry->node != DIR_INDEX_TOMBSTONE && entry->hash == hash && is_leaf(entry->node) == leaf &&
+            path_equals(entry->path, path))
+            return entry->node;
+    }
+    return NULL;
+}
+
+// Directory paths memoized for tree_node_path. Each directory maps to one slot
+// of a direct-mapped table; a slot only counts while its generation matches the
+// cache's, so renaming, moving or removing a directory drops every entry at
+// once. Paths are kept without the root's "/", which makes a child's path its
+// parent's followed by "/" and its name.
+#define PATH_CACHE_SLOTS 1024
+
+typedef struct PathSlot
+{
+    const Directory *dir;
+    uint64_t generation;
+    char *path;        // len bytes, not necessarily NUL-terminated
+    uint32_t len;
+    uint32_t capacity; // Bytes allocated for path
+} PathSlot;
+
+struct PathCache
+{
+    TreeLock lock;       // Guards the slots (TREE_OPT_CONCURRENT only)
+    uint64_t generation; // Starts at 1 so that empty slots never match
+    PathSlot slots[PATH_CACHE_SLOTS];
+};
+
+static inline PathSlot *path_cache_slot(PathCache *cache, const Directory *dir)
+{
+    uint32_t mix = (uint32_t)((uintptr_t)dir >> 4) * 2654435761u;
+    return &cache->slots[mix >> 22];
+}
+
+// The tree's cache, created on first use; NULL if memory ran out
+static PathCache *path_cache_get(Tree *tree)
+{
+    PathCache *cache = __atomic_load_n(&tree->path_cache, __ATOMIC_ACQUIRE);
+    if (cache != NULL)
+        return cache;
+    cache = calloc(1, sizeof(PathCache));
+    if (cache == NULL)
+        return NULL;
+    cache->generation = 1;
+
+    // Concurrent first callers race to install theirs
+    PathCache *expected = NULL;
+    if (!__atomic_compare_exchange_n(&tree->path_cache, &expected, cache, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE))
+    {
+        free(cache);
+        return expected;
+    }
+    return cache;
+}
+
+// Called wherever a directory's path changes or a directory is freed, which
+// would let a new one inherit its address
+static void path_cache_invalidate(Tree *tree)
+{
+    PathCache *cache = __atomic_load_n(&tree->path_cache, __ATOMIC_ACQUIRE);
+    if (cache != NULL)
+        __atomic_add_fetch(&cache->generation, 1, __ATOMIC_RELAXED);
+}
+
+static bool path_slot_reserve(PathSlot *slot, size_t len)
+{
+    if (len <= slot->capacity)
+        return true;
+    if (len > UINT32_MAX)
+        return false;
+    char *path = realloc(slot->path, len);
+    if (path == NULL)
+        return false;
+    slot->path = path;
+    slot->capacity = (uint32_t)len;
+    return true;
+}
+
+// Returns dir's slot if it holds dir's current path, else NULL. Caller holds
+// the cache lock, shared or exclusive.
+static PathSlot *path_cache_hit(PathCache *cache, const Directory *dir)
+{
+    PathSlot *slot = path_cache_slot(cache, dir);
+    uint64_t generation = __atomic_load_n(&cache->generation, __ATOMIC_RELAXED);
+    return slot->dir == dir && slot->generation == generation ? slot : NULL;
+}
+
+// Returns dir's slot with its current path, filled from the parent's slot when
+// that one is cached; NULL if memory ran out. Caller holds the cache lock exclusively.
+static PathSlot *path_cache_lookup(PathCache *cache, const Directory *dir)
+{
+    PathSlot *slot = path_cache_slot(cache, dir);
+    uint64_t generation = __atomic_load_n(&cache->generation, __ATOMIC_RELAXED);
+    if (slot->dir == dir && slot->generation == generation)
+        return slot;
+
+    slot->dir = NULL;
+    const Node *node = &dir->base;
+    const PathSlot *parent = NULL;
+    size_t len = 0;
+    if (node->parent != NULL)
+    {
+        parent = path_cache_slot(cache, (const Directory *)node->parent);
+        if (parent != slot && parent->dir == (const Directory *)node->parent && parent->generation == generation)
+        {
+            len = (size_t)parent->len + 1 + node->name_len;
+        }
+        else
+        {
+            parent = NULL;
+            len = node_path_length((Node *)node);
+        }
+    }
+    // Room for node_path_write's terminator, and never a NULL path
+    if (!path_slot_reserve(slot, len + 1))
+        return NULL;
+    if (parent != NULL)
+    {
+        memcpy(slot->path, parent->path, parent->len);
+        slot->path[parent->len] = '/';
+        memcpy(slot->path + parent->len + 1, node->name, node->name_len);
+    }
+    else if (node->parent != NULL)
+    {
+        node_path_write((Node *)node, slot->path, len);
+    }
+    slot->dir = dir;
+    slot->generation = generation;
+    slot->len = (uint32_t)len;
+    return slot;
+}
+
+static void path_cache_free(Tree *tree)
+{
+    PathCache *cache = tree->path_cache;
+    if (cache == NULL)
+        return;
+    for (uint32_t i = 0; i < PATH_CACHE_SLOTS; i++)
+        free(cache->slots[i].path);
+    free(cache);
+    tree->path_cache = NULL;
+}
+
+/**
+ * @brief Writes the full path of a node into a caller-supplied buffer.
+ *
+ * @param tree Pointer to the tree structure
+ * @param node The directory or leaf
+ * @param buf Receives the NUL-terminated path, such as "/a/b/file"
+ * @param size Size of buf
+ *
+ * @return size_t Length of the path without its terminator, or 0 if either
+ *         pointer is NULL. The path was only written if this is less than size;
+ *         otherwise buf holds an empty string and the caller can retry with a
+ *         buffer of the returned length plus one.
+ *
+ * @note The root is "/" and its own name is never part of a path, as with
+ *       lookup_path. Directory paths are memoized in a per-tree cache that is
+ *       created on the first call, so repeated calls for the contents of one
+ *       directory cost O(name length) rather than O(depth). A miss derives the
+ *       path from the parent's cached one when it can. The cache is dropped as
+ *       a whole whenever a directory is renamed, moved or removed, and again
+ *       when a removed directory kept for a snapshot is freed.
+ *       Concurrent trees hold off renames, moves and subtree removals for the
+ *       duration of the call; concurrent hits share the cache lock.
+ */
+size_t tree_node_path(Tree *tree, Node *node, char *buf, size_t size)
+{
+    if (buf != NULL && size > 0)
+        buf[0] = '\0';
+    if (tree == NULL || node == NULL)
+        return 0;
+
+    if (is_concurrent(tree))
+        lock_read(&tree->structure_lock);
+
+    const Directory *dir = (const Directory *)(node->tag & TREE_TAG_LEAF ? node->parent : node);
+    size_t len = SIZE_MAX;
+    PathCache *cache = path_cache_get(tree);
+    if (cache != NULL)
+    {
+        // Hits only read the slot; a miss fills it under the exclusive lock
+        bool exclusive = false;
+        if (is_concurrent(tree))
+            lock_read(&cache->lock);
+        PathSlot *slot = path_cache_hit(cache, dir);
+        if (slot == NULL)
+        {
+            if (is_concurrent(tree))
+            {
+                unlock_read(&cache->lock);
+                lock_write(&cache->lock);
+                exclusive = true;
+            }
+            slot = path_cache_lookup(cache, dir);
+        }
+        if (slot != NULL)
+        {
+            if (dir == (const Directory *)node)
+                len = node->parent == NULL ? 1 : slot->len;
+            else
+                len = (size_t)slot->len + 1 + node->name_len;
+            if (len < size)
+            {
+                if (node->parent == NULL)
+                {
+                    buf[0] = '/';
+                }
+                else
+                {
+                    memcpy(buf, slot->path, slot->len);
+                    if (dir != (const Directory *)node)
+                    {
+                        buf[slot->len] = '/';
+                        memcpy(buf + slot->len + 1, node->name, node->name_len);
+                    }
+                }
+                buf[len] = '\0';
+            }
+        }
+        if (exclusive)
+            unlock_write(&cache->lock);
+        else if (is_concurrent(tree))
+            unlock_read(&cache->lock);
+    }
+    if (len == SIZE_MAX)
+    {
+        // No cache to work from: walk the parent chain
+        len = node_path_length(node);
+        if (len < size)
+            node_path_write(node, buf, len);
+    }
+
+    if (is_concurrent(tree))
+        unlock_read(&tree->structure_lock);
+    return len;
+}
+
+/**
+ * @brief Returns the full path of a node in a newly allocated string.
+ *
+ * @param node The directory or leaf
+ * @return char* The path, such as "/a/b/file", to be released with free(), or
+ *         NULL if node is NULL or memory ran out
+ *
+ * @note Walks the parent chain on every call; tree_node_path writes into a
+ *       caller's buffer and reuses cached directory paths. As the tree is not
+ *       known here, a concurrent caller must keep node's ancestors from being
+ *       renamed, moved or removed meanwhile.
+ */
+char *get_node_path(Node *node)
+{
+    if (node == NULL)
+        return NULL;
+    size_t len = node_path_length(node);
+    char *path = malloc(len + 1);
+    if (path != NULL)
+        node_path_write(node, path, len);
+    return path;
+}
+
+// Frozen trees keep every group of siblings contiguous and sorted by name.
+// nodes points at the first of count elements of stride bytes, each starting with a Node.
+static Node *frozen_find(char *nodes, size_t stride, uint32_t count, const char *name, size_t len)
+{
+    uint32_t low = 0, high = count;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        Node *node = (Node *)(nodes + (size_t)mid * stride);
+        STATS_COUNT(siblings_scanned, 1);
+        STATS_COUNT(name_compares, 1);
+        int cmp = name_compare(name, len, node->name, node->name_len);
+        if (cmp == 0)
+            return node;
+        if (cmp < 0)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Finds a child directory with the specified name within a parent directory
+ *
+ * @param parent The parent directory to search in
+ * @param name The name of the child directory to find; need not be NUL-terminated
+ * @param len Length of name
+ * @param hash hash_name of name, computed once by the caller
+ * @return Directory* Pointer to the found directory, or NULL if not found
+ *
+ * @note This is an internal helper function used by create_directory and create_nested_directory.
+ *       Directories past TREE_INDEX_THRESHOLD entries are searched through their name index,
+ *       medium-sized ones by their name fingerprints, and frozen directories by binary search.
+ * @warning Assumes parent and name are valid. In concurrent trees the caller must
+ *          hold parent's lock (shared is enough).
+ */
+static Directory *find_child_directory(Directory *parent, const char *name, size_t len, uint32_t hash)
+{
+    if (parent->base.tag & TREE_TAG_FROZEN)
+        return (Directory *)frozen_find((char *)parent->first_child, sizeof(Directory), parent->dir_count, name, len);
+    if (parent->index != NULL)
+        return (Directory *)dir_index_find(parent->index, name, len, hash, false);
+    if (parent->prints != NULL)
+        return (Directory *)prints_find(&parent->prints->dirs, name, len, hash);
+
+    Directory *child = parent->first_child;
+    while (child != NULL)
+    {
+        STATS_COUNT(siblings_scanned, 1);
+        if (node_name_equals(&child->base, name, len, hash))
+        {
+            return child;
+        }
+        child = child->next_dir;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Finds a leaf with the specified name directly within a directory
+ *
+ * @param parent The directory whose leaves are searched
+ * @param name The name of the leaf to find
+ * @param len Length of name
+ * @param hash hash_name of name
+ * @return Leaf* Pointer to the found leaf, or NULL if not found
+ *
+ * @note Uses the directory's name index or fingerprints when it has them, binary
+ *       search when the tree is frozen, otherwise scans the leaf list.
+ */
+static Leaf *find_child_leaf(Directory *parent, const char *name, size_t len, uint32_t hash)
+{
+    if (parent->base.tag & TREE_TAG_FROZEN)
+        return (Leaf *)frozen_find((char *)parent->first_leaf, sizeof(Leaf), parent->leaf_count, name, len);
+    if (parent->index != NULL)
+        return (Leaf *)dir_index_find(parent->index, name, len, hash, true);
+    if (parent->prints != NULL)
+        return (Leaf *)prints_find(&parent->prints->leaves, name, len, hash);
+
+    Leaf *leaf = parent->first_leaf;
+    while (leaf != NULL)
+    {
+        STATS_COUNT(siblings_scanned, 1);
+        if (node_name_equals(&leaf->base, name, len, hash))
+            return leaf;
+        leaf = leaf->next_leaf;
+    }
+    return NULL;
+}
+
+// Iterator positions for a directory: about to be entered, returned in
+// pre-order but not yet expanded, or finished with all of its contents
+#define ITER_ENTER 0
+#define ITER_OPENED 1
+#define ITER_EXIT 2
+
+static inline void iter_move(TreeIter *iter, Node *node, uint8_t phase)
+{
+    // The next call starts by reading this node, so get it on its way now
+    if (node != NULL)
+        __builtin_prefetch(node);
+    iter->node = node;
+    iter->phase = phase;
+}
+
+// Tracked paths: the buffer holds the path of the directory being walked, whose
+// entries are then that path, "/" and their name. Bytes past the buffer are
+// dropped but still counted, so the length stays right on the way back up.
+static void iter_path_push(TreeIter *iter, const Node *dir)
+{
+    if (dir->parent == NULL)
+        return; // The root's path is empty here
+    const char *name = dir->name;
+    size_t len = (size_t)dir->name_len + 1;
+    for (size_t i = 0; i < len && iter->path_len + i + 1 < iter->path_size; i++)
+        iter->path[iter->path_len + i] = i == 0 ? '/' : name[i - 1];
+    iter->path_len += len;
+}
+
+static void iter_path_pop(TreeIter *iter, const Node *dir)
+{
+    if (dir->parent != NULL)
+        iter->path_len -= (size_t)dir->name_len + 1;
+}
+
+static inline Node *iter_yield(TreeIter *iter, Node *node)
+{
+    if (iter->path != NULL)
+        iter->last = node;
+    return node;
+}
+
+// Moves to the first thing inside dir: its first leaf, its first child or its exit
+static void iter_descend(TreeIter *iter, Directory *dir)
+{
+    if (iter->path != NULL)
+        iter_path_push(iter, &dir->base);
+    if ((iter->flags & TREE_ITER_LEAVES) && dir->first_leaf != NULL)
+        iter_move(iter, &dir->first_leaf->base, ITER_ENTER);
+    else if (dir->first_child != NULL)
+        iter_move(iter, &dir->first_child->base, ITER_ENTER);
+    else
+        iter_move(iter, &dir->base, ITER_EXIT);
+}
+
+// Moves past a finished directory using only links owned by its parent
+static void iter_leave(TreeIter *iter, Directory *dir)
+{
+    if (dir == iter->start)
+        iter_move(iter, NULL, ITER_ENTER);
+    else if (dir->next_dir != NULL)
+        iter_move(iter, &dir->next_dir->base, ITER_ENTER);
+    else
+        iter_move(iter, dir->base.parent, ITER_EXIT);
+}
+
+/**
+ * @brief Starts a depth-first walk over a directory and everything below it.
+ *
+ * @param iter Iterator to initialize; it needs no cleanup
+ * @param tree Pointer to the tree structure
+ * @param start Directory whose subtree is walked (NULL for the root)
+ * @param flags TREE_ITER_PREORDER or TREE_ITER_POSTORDER, optionally combined with
+ *        TREE_ITER_DIRECTORIES and/or TREE_ITER_LEAVES to choose what is returned
+ *
+ * @note Within a directory, leaves come first in list order, then each
+ *       subdirectory's subtree in list order. A walk that returns only
+ *       directories never touches leaves.
+ */
+void tree_iter_begin(TreeIter *iter, Tree *tree, Directory *start, uint32_t flags)
+{
+    if (iter == NULL)
+        return;
+
+    if (!(flags & (TREE_ITER_DIRECTORIES | TREE_ITER_LEAVES)))
+        flags |= TREE_ITER_DIRECTORIES | TREE_ITER_LEAVES;
+    if (start == NULL && tree != NULL)
+        start = tree->root;
+    iter->start = start;
+    iter->flags = (uint8_t)flags;
+    iter->last = NULL;
+    iter->path = NULL;
+    iter->path_size = 0;
+    iter->path_len = 0;
+    iter_move(iter, start != NULL ? &start->base : NULL, ITER_ENTER);
+}
+
+/**
+ * @brief Returns the next node of a walk started by tree_iter_begin.
+ *
+ * @param iter Iterator from tree_iter_begin
+ * @return Node* The next directory or leaf, or NULL once the walk is over
+ *
+ * @note Runs in constant space: the position lives in the iterator and the
+ *       way back up is the nodes' parent links. Before a node is returned in
+ *       post-order the walk has already moved past it, so the caller may
+ *       remove or free it. A directory returned in pre-order is only expanded
+ *       on the following call.
+ *
+ * @warning The iterator takes no locks. Apart from removing the node just
+ *          returned in post-order, the subtree must not change during the walk.
+ */
+Node *tree_iter_next(TreeIter *iter)
+{
+    if (iter == NULL)
+        return NULL;
+
+    bool postorder = (iter->flags & TREE_ITER_POSTORDER) != 0;
+    bool want_dirs = (iter->flags & TREE_ITER_DIRECTORIES) != 0;
+    while (iter->node != NULL)
+    {
+        Node *node = iter->node;
+        if (node->tag & TREE_TAG_LEAF)
+        {
+            Leaf *leaf = (Leaf *)node;
+            if (leaf->next_leaf != NULL)
+            {
+                iter_move(iter, &leaf->next_leaf->base, ITER_ENTER);
+            }
+            else
+            {
+                Directory *parent = (Directory *)node->parent;
+                if (parent->first_child != NULL)
+                    iter_move(iter, &parent->first_child->base, ITER_ENTER);
+                else
+                    iter_move(iter, &parent->base, ITER_EXIT);
+            }
+            return iter_yield(iter, node);
+        }
+
+        Directory *dir = (Directory *)node;
+        if (iter->phase == ITER_EXIT)
+        {
+            if (iter->path != NULL)
+                iter_path_pop(iter, node);
+            iter_leave(iter, dir);
+            if (postorder && want_dirs)
+                return iter_yield(iter, node);
+        }
+        else if (iter->phase == ITER_ENTER && !postorder && want_dirs)
+        {
+            iter->phase = ITER_OPENED;
+            return iter_yield(iter, node);
+        }
+        else
+        {
+            iter_descend(iter, dir);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Makes a walk build the path of every node it returns, for tree_iter_path.
+ *
+ * @param iter Iterator from tree_iter_begin, before its first tree_iter_next
+ * @param buf Buffer the paths are built in, owned by the caller for the whole walk
+ * @param size Size of buf
+ *
+ * @note Each step only appends or drops the name of the directory it enters or
+ *       leaves, so the paths of a whole subtree cost O(1) per node on top of
+ *       the name bytes, instead of a walk up to the root per node. The start
+ *       directory's own path is computed once here.
+ */
+void tree_iter_paths(TreeIter *iter, char *buf, size_t size)
+{
+    if (iter == NULL || buf == NULL || size == 0)
+        return;
+
+    iter->path = buf;
+    iter->path_size = size;
+    iter->path_len = 0;
+    iter->last = NULL;
+    Node *parent = iter->start != NULL ? iter->start->base.parent : NULL;
+    if (parent != NULL && parent->parent != NULL)
+    {
+        // The walked directory is the start's parent until the start is entered
+        iter->path_len = node_path_length(parent);
+        if (iter->path_len < size)
+            node_path_write(parent, buf, iter->path_len);
+    }
+}
+
+/**
+ * @brief Returns the full path of the node last returned by tree_iter_next.
+ *
+ * @param iter Iterator set up with tree_iter_paths
+ * @param len Receives the length of the path, even when it did not fit (may be NULL)
+ *
+ * @return const char* The NUL-terminated path inside the buffer given to
+ *         tree_iter_paths, or NULL if the path does not fit in it, no node has
+ *         been returned yet or paths are not being tracked
+ *
+ * @note The path is overwritten by the next call to tree_iter_next.
+ */
+const char *tree_iter_path(TreeIter *iter, size_t *len)
+{
+    if (len != NULL)
+        *len = 0;
+    if (iter == NULL || iter->path == NULL || iter->last == NULL)
+        return NULL;
+
+    Node *node = iter->last;
+    if (node->parent == NULL)
+    {
+        if (len != NULL)
+            *len = 1;
+        if (iter->path_size < 2)
+            return NULL;
+        iter->path[0] = '/';
+        iter->path[1] = '\0';
+        return iter->path;
+    }
+
+    size_t total = iter->path_len + 1 + node->name_len;
+    if (len != NULL)
+        *len = total;
+    if (total >= iter->path_size)
+        return NULL;
+    iter->path[iter->path_len] = '/';
+    memcpy(iter->path + iter->path_len + 1, node->name, node->name_len);
+    iter->path[total] = '\0';
+    return iter->path;
+}
+
+/**
+ * @brief Initializes a new tree structure with the specified comparison and destruction functions.
+ *
+ * @param tree Pointer to the tree structure to initialize
+ * @param compare Orders entry names for the list_* queries, given two NUL-terminated names (NULL for byte order)
+ * @param destroy Function pointer for cleaning up node values (can be NULL)
+ *
+ * @note This function sets initial values for root, directory count, and total size to zero.
+ *       It stores the provided function pointers for later use.
+ *       This function does not allocate any memory, except for the counters
+ *       of builds with -DTREE_STATS (see tree_stats_dump).
+ *
+ * @warning Ensure that the tree pointer is valid before calling this function.
+ */
+void init_tree(Tree *tree, int (*compare)(void *key1, void *key2), void (*destroy)(void *data))
+{
+    init_tree_ex(tree, compare, destroy, 0);
+}
+
+/**
+ * @brief Initializes a new tree structure with additional behaviour options.
+ *
+ * @param tree Pointer to the tree structure to initialize
+ * @param compare Orders entry names for the list_* queries, given two NUL-terminated names (NULL for byte order)
+ * @param destroy Function pointer for cleaning up node values (can be NULL)
+ * @param options Bitwise OR of TREE_OPT_* flags, 0 for the defaults used by init_tree
+ *
+ * @note TREE_OPT_ARENA serves all node allocations from per-size-class slabs owned
+ *       by the tree. Slabs are created on the first allocation, so this function
+ *       still does not allocate any memory. destroy_tree then releases whole chunks
+ *       instead of freeing nodes one by one.
+ *       TREE_OPT_PATH_INDEX maintains a hash index from full path to node on every
+ *       create and remove, so lookup_path and find_leaf_by_path do not depend on
+ *       tree depth or directory size.
+ *       TREE_OPT_CONCURRENT makes the tree safe to use from several threads.
+ *       Lookups take shared per-directory locks hand-over-hand from the root;
+ *       create_directory, create_leaf and remove_leaf lock only the parent
+ *       directory and update the size and count totals of the ancestors atomically.
+ *       The size and count getters are plain atomic loads. remove_directory
+ *       additionally waits for running traversals, and the root cannot be removed.
+ *       Returned node pointers stay valid only until the node is removed, which
+ *       callers must coordinate among themselves.
+ *       TREE_OPT_INLINE_VALUES copies the value of a leaf no larger than
+ *       TREE_INLINE_VALUE_MAX bytes into the leaf's own allocation, treating value
+ *       as pointing to size bytes. Such a leaf's value points at its copy, and the
+ *       destroy function is never called for it; the caller keeps the original.
+ *       TREE_OPT_BACKGROUND_RECLAIM, together with TREE_OPT_CONCURRENT, starts a
+ *       thread on the first remove_directory_async that frees removed subtrees,
+ *       and calls the destroy function for their values, in the background.
+ *       TREE_OPT_SIZE_HISTOGRAM gives every directory TREE_HISTOGRAM_BINS counters
+ *       of leaf sizes for its subtree, kept along with the size totals, which
+ *       tree_size_histogram then returns without a walk.
+ *
+ * @warning Ensure that the tree pointer is valid before calling this function.
+ */
+void init_tree_ex(Tree *tree, int (*compare)(void *key1, void *key2), void (*destroy)(void *data), uint32_t options)
+{
+    tree->root = NULL;
+    tree->total_dirs = 0;
+    tree->total_files = 0;
+    tree->total_size = 0;
+    tree->destroy = destroy;
+    tree->compare = compare;
+    tree->options = options;
+    tree->arena = NULL;
+    tree->pool = NULL;
+    tree->paths = NULL;
+    tree->path_cache = NULL;
+    tree->reclaimer = NULL;
+    tree->frozen = NULL;
+    tree->journal = NULL;
+    tree->versions = NULL;
+    tree->stats = NULL;
+    tree->pinned = 0;
+#ifdef TREE_STATS
+    tree->stats = calloc(1, sizeof(TreeStats));
+#endif
+    tree->root_lock = 0;
+    tree->structure_lock = 0;
+    tree->paths_lock = 0;
+    tree->alloc_lock = 0;
+    tree->versions_lock = 0;
+    tree->versions_gate = 0;
+    tree->versions_writers = 0;
+}
+
+/**
+ * @brief Destroys the entire tree structure and frees all associated memory.
+ *
+ * @param tree Pointer to the tree structure to destroy
+ *
+ * @note This function destroys all directories and their contents,
+ *       resets all tree counters to zero, and is safe to call with a NULL pointer.
+ *       It uses destroy_directory for the cleanup. Arena-backed trees only
+ *       visit nodes to destroy leaf values, then release the slabs chunk by chunk.
+ *       Worker threads started by tree_set_parallelism are joined first.
+ *
+ * @warning Ensure that no other references to the tree exist before calling this function
+ *          to avoid memory access violations.
+ */
+void destroy_tree(Tree *tree)
+{
+    if (tree == NULL)
+        return;
+
+    if (tree->journal != NULL)
+        tree_journal_close(tree);
+    if (tree->pool != NULL)
+    {
+        pool_destroy(tree->pool);
+        tree->pool = NULL;
+    }
+    reclaimer_free(tree);
+
+    path_index_free(tree);
+    path_cache_free(tree);
+    versions_free(tree);
+
+    if (tree->frozen != NULL)
+    {
+        // The nodes live in the frozen arrays, not individual allocations
+        if (tree->destroy != NULL)
+            destroy_values(tree, tree->root);
+        TreeIter iter;
+        tree_iter_begin(&iter, tree, tree->root, TREE_ITER_PREORDER | TREE_ITER_DIRECTORIES);
+        for (Node *node = tree_iter_next(&iter); node != NULL; node = tree_iter_next(&iter))
+            order_free(tree, (Directory *)node);
+        frozen_free(tree->frozen);
+        tree->frozen = NULL;
+        tree->root = NULL;
+    }
+
+    if (tree->arena != NULL)
+    {
+        // Nodes go away with their chunks; only leaf values need a walk
+        if (tree->destroy != NULL)
+            destroy_values(tree, tree->root);
+        arena_release(tree->arena);
+        tree->arena = NULL;
+    }
+    else
+    {
+        destroy_directory(tree, tree->root);
+    }
+    tree->root = NULL;
+    tree->total_dirs = 0;
+    tree->total_files = 0;
+    tree->total_size = 0;
+    free(tree->stats);
+    tree->stats = NULL;
+}
+
+// Calls the tree's destroy function on every leaf value below dir without freeing nodes
+static void destroy_values(Tree *tree, Directory *dir)
+{
+    if (dir == NULL)
+        return;
+
+    TreeIter iter;
+    tree_iter_begin(&iter, tree, dir, TREE_ITER_PREORDER | TREE_ITER_LEAVES);
+    for (Node *node = tree_iter_next(&iter); node != NULL; node = tree_iter_next(&iter))
+    {
+        Leaf *leaf = (Leaf *)node;
+        if (leaf->value != NULL && !(leaf->base.tag & TREE_TAG_INLINE))
+            tree->destroy(leaf->value);
+    }
+}
+
+// Frees one node of a subtree being torn down in post-order
+static void node_destroy(Tree *tree, Node *node)
+{
+    if (node->tag & TREE_TAG_LEAF)
+    {
+        leaf_free(tree, (Leaf *)node);
+    }
+    else
+    {
+        dir_index_free(tree, (Directory *)node);
+        dir_histogram_free(tree, (Directory *)node);
+        node_free_name(tree, node);
+        tree_free(tree, node, sizeof(Directory));
+    }
+}
+
+/**
+ * @brief Helper function that destroys a directory and all its contents.
+ *
+ * @param tree Pointer to the tree structure
+ * @param dir Pointer to the directory to destroy
+ *
+ * @note This function walks the subtree in post-order, so every directory is freed
+ *       after its leaves and subdirectories, and calls the tree's destroy function
+ *       for leaf values if provided. The walk holds no stack, so depth is unbounded.
+ *
+ * @warning This function assumes that the directory pointer is valid and not NULL.
+ */
+static void destroy_directory(Tree *tree, Directory *dir)
+{
+    if (tree == NULL || dir == NULL)
+        return;
+
+    // The iterator has already stepped past each node it returns
+    TreeIter iter;
+    tree_iter_begin(&iter, tree, dir, TREE_ITER_POSTORDER);
+    for (Node *node = tree_iter_next(&iter); node != NULL; node = tree_iter_next(&iter))
+        node_destroy(tree, node);
+}
+
+// Appends a directory to the end of parent's children list
+static void list_append_dir(Directory *parent, Directory *dir)
+{
+    dir->next_dir = NULL;
+    dir->prev_dir = parent->last_child;
+    if (parent->last_child == NULL)
+        parent->first_child = dir;
+    else
+        parent->last_child->next_dir = dir;
+    parent->last_child = dir;
+    parent->dir_count++;
+}
+
+static void list_remove_dir(Directory *parent, Directory *dir)
+{
+    if (dir->prev_dir == NULL)
+        parent->first_child = dir->next_dir;
+    else
+        dir->prev_dir->next_dir = dir->next_dir;
+    if (dir->next_dir == NULL)
+        parent->last_child = dir->prev_dir;
+    else
+        dir->next_dir->prev_dir = dir->prev_dir;
+    parent->dir_count--;
+}
+
+// Appends a leaf to the end of parent's leaf list
+static void list_append_leaf(Directory *parent, Leaf *leaf)
+{
+    leaf->next_leaf = NULL;
+    leaf->prev_leaf = parent->last_leaf;
+    if (parent->last_leaf == NULL)
+        parent->first_leaf = leaf;
+    else
+        parent->last_leaf->next_leaf = leaf;
+    parent->last_leaf = leaf;
+    parent->leaf_count++;
+}
+
+static void list_remove_leaf(Directory *parent, Leaf *leaf)
+{
+    if (leaf->prev_leaf == NULL)
+        parent->first_leaf = leaf->next_leaf;
+    else
+        leaf->prev_leaf->next_leaf = leaf->next_leaf;
+    if (leaf->next_leaf == NULL)
+        parent->last_leaf = leaf->prev_leaf;
+    else
+        leaf->next_leaf->prev_leaf = leaf->prev_leaf;
+    parent->leaf_count--;
+}
+
+// Puts replacement where leaf is in parent's leaf list
+static void list_replace_leaf(Directory *parent, Leaf *leaf, Leaf *replacement)
+{
+    replacement->prev_leaf = leaf->prev_leaf;
+    replacement->next_leaf = leaf->next_leaf;
+    if (leaf->prev_leaf == NULL)
+        parent->first_leaf = replacement;
+    else
+        leaf->prev_leaf->next_leaf = replacement;
+    if (leaf->next_leaf == NULL)
+        parent->last_leaf = replacement;
+    else
+        leaf->next_leaf->prev_leaf = replacement;
+}
+
+/**
+ * @brief Creates a single directory node in the tree
+ *
+ * @param tree Pointer to the tree structure where the directory will be created
+ * @param parent Pointer to the parent directory (NULL for root directory)
+ * @param name Name of the directory to create (must be less than 256 characters)
+ *
+ * @return Directory* Pointer to the newly created directory, or NULL if:
+ *         - Any input parameter is NULL
+ *         - name length >= 256
+ *         - Memory allocation fails
+ *         - A directory with the same name already exists under the parent
+ *         - Attempting to create a root when one already exists
+ *         - The tree is frozen
+ *
+ * @note This function:
+ *       - Creates a single directory node
+ *       - Sets up parent-child relationships
+ *       - Updates directory counts
+ *       - Handles both root and child directory creation
+ *
+ * @example
+ *     // Create root directory
+ *     Directory *root = create_directory(tree, NULL, "root");
+ *     // Create child directory
+ *     Directory *child = create_directory(tree, root, "child");
+ */
+
+Directory *create_directory(Tree *tree, Directory *parent, const char *name)
+{
+    STATS_SCOPE(tree, TREE_OP_CREATE_DIRECTORY, name);
+    if (tree == NULL || name == NULL)
+        return NULL;
+
+    bool exclusive = versions_enter(tree);
+    Directory *dir = create_directory_n(tree, parent, name, strlen(name));
+    versions_exit(tree, exclusive);
+    journal_commit(tree);
+    return dir;
+}
+
+// create_directory for a name given as (pointer, length), which need not be NUL-terminated
+static Directory *create_directory_n(Tree *tree, Directory *parent, const char *name, size_t len)
+{
+    if (len >= 256 || tree->frozen != NULL)
+        return NULL;
+
+    Directory *new_dir = (Directory *)tree_alloc(tree, sizeof(Directory));
+    if (new_dir == NULL)
+        return NULL;
+
+    // Initialize the new directory
+    memset(new_dir, 0, sizeof(Directory));
+    if (tree->options & TREE_OPT_SIZE_HISTOGRAM)
+    {
+        new_dir->histogram = tree_alloc(tree, TREE_HISTOGRAM_BINS * sizeof(uint32_t));
+        if (new_dir->histogram == NULL)
+        {
+            tree_free(tree, new_dir, sizeof(Directory));
+            return NULL;
+        }
+        memset(new_dir->histogram, 0, TREE_HISTOGRAM_BINS * sizeof(uint32_t));
+    }
+    if (!node_set_name(tree, &new_dir->base, name, len))
+    {
+        dir_histogram_free(tree, new_dir);
+        tree_free(tree, new_dir, sizeof(Directory));
+        return NULL;
+    }
+    new_dir->base.parent = (Node *)parent;
+    new_dir->version = versions_epoch(tree);
+
+    // Handle root directory
+    if (parent == NULL)
+    {
+        if (is_concurrent(tree))
+            lock_write(&tree->root_lock);
+        // Cannot create a second root
+        bool exists = tree->root != NULL;
+        if (!exists)
+        {
+            new_dir->base.tag = TREE_TAG_ROOT;
+            journal_log(tree, JOURNAL_MKDIR, NULL, NULL, new_dir->base.name, NULL, 0);
+            counter_add(tree, &tree->total_dirs, 1);
+            path_index_add(tree, &new_dir->base);
+            __atomic_store_n(&tree->root, new_dir, __ATOMIC_RELEASE);
+        }
+        if (is_concurrent(tree))
+            unlock_write(&tree->root_lock);
+        if (exists)
+        {
+            dir_histogram_free(tree, new_dir);
+            node_free_name(tree, &new_dir->base);
+            tree_free(tree, new_dir, sizeof(Directory));
+            return NULL;
+        }
+        return new_dir;
+    }
+
+    dir_write_lock(tree, parent);
+    // Check for existing directory with same name
+    if (find_child_directory(parent, name, len, new_dir->base.hash) != NULL)
+    {
+        dir_write_unlock(tree, parent);
+        dir_histogram_free(tree, new_dir);
+        node_free_name(tree, &new_dir->base);
+        tree_free(tree, new_dir, sizeof(Directory));
+        return NULL;
+    }
+
+    new_dir->base.tag = TREE_TAG_NODE;
+    // Logged before the directory can be found, so nothing inside it is logged first
+    journal_log(tree, JOURNAL_MKDIR, &parent->base, NULL, new_dir->base.name, NULL, 0);
+    versions_touch(tree, parent, true);
+    list_append_dir(parent, new_dir);
+    dir_index_add(tree, parent, &new_dir->base);
+    path_index_add(tree, &new_dir->base);
+    propagate_totals(tree, parent, 0, 0, 1);
+    dir_write_unlock(tree, parent);
+    return new_dir;
+}
+
+/**
+ * @brief Creates a nested directory path, creating intermediate directories as needed
+ *
+ * @param tree Pointer to the tree structure where the directories will be created
+ * @param path Full path of directories to create (e.g., "/hello/world")
+ *
+ * @return Directory* Pointer to the last directory in the path, or NULL if:
+ *         - Any input parameter is NULL
+ *         - Path is empty
+ *         - Memory allocation fails
+ *         - Path component name >= 256 characters
+ *         - Invalid path format
+ *
+ * @note This function:
+ *       - Walks the path components in place, without copying or allocating
+ *       - Creates or finds each directory in the path
+ *       - Creates missing intermediate directories
+ *       - Returns existing directories if they already exist
+ *       - Properly handles absolute paths (starting with /)
+ *
+ * @example
+ *     // Create nested directories
+ *     Directory *dir = create_nested_directory(tree, "/hello/world");
+ *     // Creates:
+ *     // /
+ *     // └── hello/
+ *     //     └── world/
+ *
+ * @warning
+ *     - Path components must be separated by '/'
+ *     - Each path component must be < 256 characters
+ */
+Directory *create_nested_directory(Tree *tree, const char *path)
+{
+    STATS_SCOPE(tree, TREE_OP_CREATE_NESTED_DIRECTORY, path);
+    if (tree == NULL || path == NULL || *path == '\0')
+        return NULL;
+
+    bool exclusive = versions_enter(tree);
+    Directory *dir = create_nested_directory_locked(tree, path);
+    versions_exit(tree, exclusive);
+    journal_commit(tree);
+    return dir;
+}
+
+// create_nested_directory once the caller has entered the version lock
+static Directory *create_nested_directory_locked(Tree *tree, const char *path)
+{
+    const char *cursor = path;
+    PathSlice component;
+    if (!path_next(&cursor, &component))
+        return __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+
+    Directory *current = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+    if (current == NULL)
+    {
+        // Handle root level: the first component names the root
+        current = create_directory_n(tree, NULL, component.ptr, component.len);
+        if (current == NULL)
+            current = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE); // Lost a race to create it
+        if (current == NULL || !path_next(&cursor, &component))
+            return current;
+    }
+
+    // In concurrent trees the walk holds read locks on the current directory
+    // and its parent, so neither can be removed while a child is created
+    Directory *parent = NULL;
+    dir_read_lock(tree, current);
+    do
+    {
+        Directory *found = NULL;
+        uint32_t hash = hash_name(component.ptr, component.len);
+        if (component.len < 256)
+            found = find_child_directory(current, component.ptr, component.len, hash);
+        if (found == NULL)
+        {
+            dir_read_unlock(tree, current);
+            found = create_directory_n(tree, current, component.ptr, component.len);
+            if (found == NULL && is_concurrent(tree) && component.len < 256)
+            {
+                // Another writer may have created it first
+                dir_read_lock(tree, current);
+                found = find_child_directory(current, component.ptr, component.len, hash);
+                dir_read_unlock(tree, current);
+            }
+            if (found == NULL)
+            {
+                if (parent != NULL)
+                    dir_read_unlock(tree, parent);
+                return NULL;
+            }
+            dir_read_lock(tree, current);
+        }
+
+        dir_read_lock(tree, found);
+        if (parent != NULL)
+            dir_read_unlock(tree, parent);
+        parent = current;
+        current = found;
+    } while (path_next(&cursor, &component));
+
+    dir_read_unlock(tree, current);
+    if (parent != NULL)
+        dir_read_unlock(tree, parent);
+    return current;
+}
+
+/**
+ * @brief Searches for a directory in the tree based on the specified path.
+ *
+ * @param tree Pointer to the tree structure where the search will be performed
+ * @param path A string representing the full path of the directory to search for
+ *
+ * @return Directory* Pointer to the found directory if it exists, or NULL if:
+ *         - Any input parameter is NULL
+ *         - The path is empty
+ *         - The directory is not found in the tree
+ *
+ * @note This function walks the path components in place as (pointer, length) slices,
+ *       so a lookup performs no allocation. Each component is resolved against the
+ *       current directory, hashed once and matched by length and hash first.
+ *       If any component is not found, the function returns NULL.
+ *       The search is case-sensitive.
+ */
+
+Directory *find_directory(Tree *tree, const char *path)
+{
+    STATS_SCOPE(tree, TREE_OP_FIND_DIRECTORY, path);
+    if (!tree || !path || *path == '\0')
+        return NULL;
+
+    Directory *current = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+    if (current == NULL)
+        return NULL;
+
+    // Concurrent trees couple locks: a child is locked before its parent is released
+    const char *cursor = path;
+    PathSlice component;
+    dir_read_lock(tree, current);
+    while (path_next(&cursor, &component))
+    {
+        Directory *child = NULL;
+        if (component.len < 256)
+            child = find_child_directory(current, component.ptr, component.len,
+                                         hash_name(component.ptr, component.len));
+        if (child != NULL)
+            dir_read_lock(tree, child);
+        dir_read_unlock(tree, current);
+        current = child;
+        if (current == NULL)
+            return NULL;
+    }
+    dir_read_unlock(tree, current);
+
+    return current;
+}
+
+// Write-locks a directory and all of its descendants top-down, the same order
+// readers take them in, so readers already inside the subtree drain out first
+static void lock_subtree(Tree *tree, Directory *dir)
+{
+    // Pre-order expands each directory only after it has been returned and locked
+    TreeIter iter;
+    tree_iter_begin(&iter, tree, dir, TREE_ITER_PREORDER | TREE_ITER_DIRECTORIES);
+    for (Node *node = tree_iter_next(&iter); node != NULL; node = tree_iter_next(&iter))
+        lock_write(&((Directory *)node)->lock);
+}
+
+// Subtrees detached by remove_directory_async wait here, oldest first, until
+// tree_reclaim or the background thread frees them. Each job keeps its own
+// post-order walk, so freeing can stop after any node and resume later.
+#define RECLAIM_BATCH 4096 // Nodes the background thread frees per turn of the lock
+
+typedef struct ReclaimJob
+{
+    struct ReclaimJob *next;
+    TreeIter iter; // Walk over the detached subtree
+    tree_reclaim_fn done;
+    void *ctx;
+} ReclaimJob;
+
+struct TreeReclaimer
+{
+    pthread_mutex_t lock; // Guards the queue and is held while freeing
+    pthread_cond_t wake;  // Signals the thread about new work or shutdown
+    ReclaimJob *head;
+    ReclaimJob *tail;
+    pthread_t thread;
+    bool started; // thread is running
+    bool stop;
+};
+
+// The tree's reclaimer, created on first use; NULL if that failed
+static TreeReclaimer *reclaimer_get(Tree *tree)
+{
+    TreeReclaimer *reclaimer = __atomic_load_n(&tree->reclaimer, __ATOMIC_ACQUIRE);
+    if (reclaimer != NULL)
+        return reclaimer;
+    reclaimer = calloc(1, sizeof(TreeReclaimer));
+    if (reclaimer == NULL)
+        return NULL;
+    pthread_mutex_init(&reclaimer->lock, NULL);
+    pthread_cond_init(&reclaimer->wake, NULL);
+
+    TreeReclaimer *expected = NULL;
+    if (!__atomic_compare_exchange_n(&tree->reclaimer, &expected, reclaimer, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE))
+    {
+        pthread_cond_destroy(&reclaimer->wake);
+        pthread_mutex_destroy(&reclaimer->lock);
+        free(reclaimer);
+        return expected;
+    }
+    return reclaimer;
+}
+
+// Frees up to budget nodes from the front of the queue. Finished jobs are
+// moved to *finished so their callbacks can run without the lock held.
+static void reclaim_run(Tree *tree, TreeReclaimer *reclaimer, size_t budget, ReclaimJob **finished)
+{
+    while (reclaimer->head != NULL && budget > 0)
+    {
+        ReclaimJob *job = reclaimer->head;
+        Node *node;
+        while (budget > 0 && (node = tree_iter_next(&job->iter)) != NULL)
+        {
+            node_destroy(tree, node);
+            budget--;
+        }
+        if (job->iter.node != NULL)
+            return;
+
+        reclaimer->head = job->next;
+        if (reclaimer->head == NULL)
+            reclaimer->tail = NULL;
+        job->next = *finished;
+        *finished = job;
+    }
+}
+
+static void reclaim_finish(Tree *tree, ReclaimJob *finished)
+{
+    // Newest first from reclaim_run; report them in removal order
+    ReclaimJob *ordered = NULL;
+    while (finished != NULL)
+    {
+        ReclaimJob *next = finished->next;
+        finished->next = ordered;
+        ordered = finished;
+        finished = next;
+    }
+    while (ordered != NULL)
+    {
+        ReclaimJob *next = ordered->next;
+        if (ordered->done != NULL)
+            ordered->done(tree, ordered->ctx);
+        free(ordered);
+        ordered = next;
+    }
+}
+
+static void *reclaim_thread(void *arg)
+{
+    Tree *tree = arg;
+    TreeReclaimer *reclaimer = tree->reclaimer;
+    pthread_mutex_lock(&reclaimer->lock);
+    for (;;)
+    {
+        while (reclaimer->head == NULL && !reclaimer->stop)
+            pthread_cond_wait(&reclaimer->wake, &reclaimer->lock);
+        if (reclaimer->head == NULL)
+            break;
+
+        ReclaimJob *finished = NULL;
+        reclaim_run(tree, reclaimer, RECLAIM_BATCH, &finished);
+        pthread_mutex_unlock(&reclaimer->lock);
+        reclaim_finish(tree, finished);
+        pthread_mutex_lock(&reclaimer->lock);
+    }
+    pthread_mutex_unlock(&reclaimer->lock);
+    return NULL;
+}
+
+// Queues a detached subtree. Without a reclaimer the subtree is freed at once,
+// which is all that is left to do when memory is that short.
+static void reclaim_queue(Tree *tree, ReclaimJob *job, Directory *dir)
+{
+    tree_iter_begin(&job->iter, tree, dir, TREE_ITER_POSTORDER);
+    TreeReclaimer *reclaimer = reclaimer_get(tree);
+    if (reclaimer == NULL)
+    {
+        destroy_directory(tree, dir);
+        reclaim_finish(tree, job);
+        return;
+    }
+
+    pthread_mutex_lock(&reclaimer->lock);
+    if (reclaimer->tail == NULL)
+        reclaimer->head = job;
+    else
+        reclaimer->tail->next = job;
+    reclaimer->tail = job;
+    if ((tree->options & TREE_OPT_BACKGROUND_RECLAIM) && is_concurrent(tree) && !reclaimer->started)
+        reclaimer->started = pthread_create(&reclaimer->thread, NULL, reclaim_thread, tree) == 0;
+    pthread_cond_signal(&reclaimer->wake);
+    pthread_mutex_unlock(&reclaimer->lock);
+}
+
+/**
+ * @brief Frees part of the subtrees queued by remove_directory_async.
+ *
+ * @param tree Pointer to the tree structure
+ * @param budget Most nodes (directories and leaves) to free, SIZE_MAX for all
+ *
+ * @return int - 1 if queued work remains, 0 if the queue is empty, or -1 if
+ *         tree is NULL
+ *
+ * @note Callbacks of the jobs this call finishes run before it returns. In
+ *       concurrent trees it can be called from any thread, also alongside the
+ *       background reclaimer; otherwise it needs the same exclusion as any
+ *       other change to the tree.
+ */
+int tree_reclaim(Tree *tree, size_t budget)
+{
+    if (tree == NULL)
+        return -1;
+    TreeReclaimer *reclaimer = __atomic_load_n(&tree->reclaimer, __ATOMIC_ACQUIRE);
+    if (reclaimer == NULL)
+        return 0;
+
+    ReclaimJob *finished = NULL;
+    pthread_mutex_lock(&reclaimer->lock);
+    reclaim_run(tree, reclaimer, budget, &finished);
+    bool pending = reclaimer->head != NULL;
+    pthread_mutex_unlock(&reclaimer->lock);
+    reclaim_finish(tree, finished);
+    return pending ? 1 : 0;
+}
+
+// Stops the background thread once it has drained the queue, then frees
+// whatever is left
+static void reclaimer_free(Tree *tree)
+{
+    TreeReclaimer *reclaimer = tree->reclaimer;
+    if (reclaimer == NULL)
+        return;
+
+    pthread_mutex_lock(&reclaimer->lock);
+    reclaimer->stop = true;
+    pthread_cond_signal(&reclaimer->wake);
+    pthread_mutex_unlock(&reclaimer->lock);
+    if (reclaimer->started)
+        pthread_join(reclaimer->thread, NULL);
+    tree_reclaim(tree, SIZE_MAX);
+
+    pthread_cond_destroy(&reclaimer->wake);
+    pthread_mutex_destroy(&reclaimer->lock);
+    free(reclaimer);
+    tree->reclaimer = NULL;
+}
+
+// Shared by remove_directory and remove_directory_async, which passes the job
+// that takes over freeing the subtree
+static int directory_remove(Tree *tree, Directory *dir, ReclaimJob *job)
+{
+    STATS_SCOPE(tree, TREE_OP_REMOVE_DIRECTORY, dir->base.name);
+    if (tree->frozen != NULL)
+        return -1;
+
+    Directory *parent = (Directory *)dir->base.parent;
+    if (parent == NULL)
+    {
+        // Concurrent readers start from the root without holding anything
+        // that could stop it being freed, so it stays for the tree's lifetime
+        if (is_concurrent(tree))
+            return -1;
+        // Cannot remove root if it has children
+        if (dir->first_child != NULL || dir->first_leaf != NULL)
+            return -1;
+    }
+
+    bool exclusive = versions_enter(tree);
+
+    if (is_concurrent(tree))
+    {
+        // Wait out traversals, then chase any point readers out of the subtree
+        lock_write(&tree->structure_lock);
+        lock_write(&parent->lock);
+        lock_subtree(tree, dir);
+    }
+
+    journal_log(tree, JOURNAL_RMDIR, &dir->base, NULL, NULL, NULL, 0);
+    path_index_remove_subtree(tree, dir);
+    path_cache_invalidate(tree);
+
+    // Find parent and remove from parent's list
+    uint64_t size = dir->total_size;
+    uint32_t files = dir->subtree_files;
+    uint32_t dirs = dir->subtree_dirs + 1;
+    if (parent != NULL)
+    {
+        versions_touch(tree, parent, true);
+        list_remove_dir(parent, dir);
+        dir_index_remove(tree, parent, &dir->base);
+
+        // Everything below dir, and dir itself, no longer counts towards any ancestor
+        propagate_totals(tree, parent, -(int64_t)size, -(int32_t)files, -(int32_t)dirs);
+        propagate_histogram(tree, parent, dir->histogram, -1);
+    }
+    else
+    {
+        // Only an empty root gets here, but still keep the totals exact
+        counter_add64(tree, &tree->total_size, -size);
+        counter_add(tree, &tree->total_files, -files);
+        counter_add(tree, &tree->total_dirs, -dirs);
+        tree->root = NULL;
+    }
+
+    if (is_concurrent(tree))
+    {
+        unlock_write(&parent->lock);
+        unlock_write(&tree->structure_lock);
+    }
+
+    // Destroy the directory and its contents, unless a snapshot can still see them
+    bool retired = versions_retire(tree, &dir->base);
+    if (job == NULL)
+    {
+        if (!retired)
+            destroy_directory(tree, dir);
+    }
+    else if (retired)
+    {
+        // snapshot_release frees it instead, so the job is already over
+        reclaim_finish(tree, job);
+    }
+    else
+    {
+        reclaim_queue(tree, job, dir);
+    }
+    versions_exit(tree, exclusive);
+    journal_commit(tree);
+
+    return 0;
+}
+
+/**
+ * @brief Removes a directory from the tree and its contents.
+ *
+ * @param tree Pointer to the tree structure
+ * @param dir Pointer to the directory to be removed
+ *
+ * @return int - 0 on success, or -1 if:
+ *         - The tree or directory is NULL
+ *         - The directory is the root with children
+ *         - The directory is the root of a concurrent tree
+ *         - The tree is frozen
+ *
+ * @note This function cannot remove the root directory if it has children or leaves.
+ *       It updates the parent's child list and directory count, subtracts the removed
+ *       subtree's size, files and directories from every ancestor's and the tree's
+ *       totals in one O(depth) pass, and destroys the directory and all its contents.
+ *       Removing the (empty) root leaves the tree without one.
+ *       While a live snapshot still contains the directory, destroying it is deferred
+ *       until the last such snapshot is released.
+ */
+int remove_directory(Tree *tree, Directory *dir)
+{
+    if (tree == NULL || dir == NULL)
+        return -1;
+    return directory_remove(tree, dir, NULL);
+}
+
+/**
+ * @brief Detaches a directory like remove_directory but frees its contents later.
+ *
+ * @param tree Pointer to the tree structure
+ * @param dir Pointer to the directory to be removed
+ * @param done Called once the whole subtree has been freed (can be NULL)
+ * @param ctx Passed to done
+ *
+ * @return int - 0 on success, or -1 in the cases remove_directory fails or if
+ *         memory ran out, in which case nothing was removed
+ *
+ * @note The directory leaves the tree and the totals before this returns, in
+ *       O(1) apart from its path index entries and, in concurrent trees, the
+ *       locking that drains readers out of the subtree. Freeing the nodes and
+ *       calling the destroy function for their values is queued: tree_reclaim
+ *       does it in bounded increments, and with TREE_OPT_BACKGROUND_RECLAIM a
+ *       thread owned by the tree does it as soon as work arrives. Subtrees are
+ *       freed in the order they were removed, and done runs on the thread that
+ *       finished the job. While a snapshot can still see the directory it is
+ *       freed by snapshot_release as with remove_directory, and done is called
+ *       before this returns. destroy_tree finishes any outstanding work.
+ */
+int remove_directory_async(Tree *tree, Directory *dir, tree_reclaim_fn done, void *ctx)
+{
+    if (tree == NULL || dir == NULL)
+        return -1;
+
+    ReclaimJob *job = malloc(sizeof(ReclaimJob));
+    if (job == NULL)
+        return -1;
+    job->next = NULL;
+    job->done = done;
+    job->ctx = ctx;
+    if (directory_remove(tree, dir, job) != 0)
+    {
+        free(job);
+        return -1;
+    }
+    return 0;
+}
+
+// Allocates and initializes a leaf that is not linked into any directory yet
+static Leaf *leaf_new(Tree *tree, Directory *parent, const char *name, size_t len, void *value, uint64_t size)
+{
+    if (len >= 256)
+        return NULL;
+
+    // Small values are copied in behind the leaf, saving the reader a pointer chase
+    bool inline_value = (tree->options & TREE_OPT_INLINE_VALUES) && value != NULL && size <= TREE_INLINE_VALUE_MAX;
+    size_t alloc_size = sizeof(Leaf) + (inline_value ? (size_t)size : 0);
+    Leaf *leaf = (Leaf *)tree_alloc(tree, alloc_size);
+    if (leaf == NULL)
+        return NULL;
+
+    memset(leaf, 0, sizeof(Leaf));
+    if (!node_set_name(tree, &leaf->base, name, len))
+    {
+        tree_free(tree, leaf, alloc_size);
+        return NULL;
+    }
+    leaf->base.parent = (Node *)parent;
+    leaf->base.tag = TREE_TAG_LEAF;
+    leaf->value = value;
+    leaf->size = size;
+    if (inline_value)
+    {
+        leaf->base.tag |= TREE_TAG_INLINE;
+        leaf->value = memcpy(leaf + 1, value, (size_t)size);
+    }
+    return leaf;
+}
+
+static inline size_t leaf_alloc_size(const Leaf *leaf)
+{
+    return sizeof(Leaf) + ((leaf->base.tag & TREE_TAG_INLINE) ? (size_t)leaf->size : 0);
+}
+
+// Frees a leaf that never made it into the tree; its value stays with the caller
+static void leaf_delete(Tree *tree, Leaf *leaf)
+{
+    node_free_name(tree, &leaf->base);
+    tree_free(tree, leaf, leaf_alloc_size(leaf));
+}
+
+// Set in Leaf.pins once the leaf has left the tree; the low bits count leaf_acquire handles
+#define LEAF_RETIRED 0x80000000u
+
+static void leaf_reclaim(Tree *tree, Leaf *leaf)
+{
+    if (tree->destroy != NULL && leaf->value != NULL && !(leaf->base.tag & TREE_TAG_INLINE))
+        tree->destroy(leaf->value);
+    leaf_delete(tree, leaf);
+}
+
+// Frees a leaf that has left the tree, destroying its value unless it was copied
+// inline. A pinned leaf is only marked, and the last leaf_release frees it.
+static void leaf_free(Tree *tree, Leaf *leaf)
+{
+    if (__atomic_fetch_or(&leaf->pins, LEAF_RETIRED, __ATOMIC_ACQ_REL) != 0)
+        return;
+    leaf_reclaim(tree, leaf);
+}
+
+/**
+ * @brief Appends a new leaf to its parent's leaf list and indexes.
+ *
+ * @param tree Pointer to the tree structure
+ * @param parent The directory the leaf was created for (write-locked in concurrent trees)
+ * @param leaf A leaf from leaf_new
+ * @return true on success, false if parent already has a leaf with that name
+ *
+ * @note Totals are left to the caller so batches can propagate them once.
+ */
+static bool leaf_link(Tree *tree, Directory *parent, Leaf *leaf)
+{
+    // Check if a file with the same name already exists in this directory
+    if (find_child_leaf(parent, leaf->base.name, leaf->base.name_len, leaf->base.hash) != NULL)
+        return false;
+
+    journal_log(tree, JOURNAL_CREATE, &parent->base, NULL, leaf->base.name, leaf->value, leaf->size);
+    versions_touch(tree, parent, true);
+    list_append_leaf(parent, leaf);
+    dir_index_add(tree, parent, &leaf->base);
+    path_index_add(tree, &leaf->base);
+    return true;
+}
+
+/**
+ * @brief Creates a new leaf (file) node and adds it to the specified parent directory.
+ *
+ * @param tree Pointer to the tree structure
+ * @param parent Pointer to the parent directory where the leaf will be added
+ * @param name Name of the new leaf (must be less than 256 characters)
+ * @param value Pointer to the leaf's data value
+ * @param size Size of the leaf in bytes
+ *
+ * @return Leaf* Pointer to the newly created leaf on success, or NULL if:
+ *         - Any input parameter is NULL
+ *         - Name is too long (>= 256 chars)
+ *         - A file with the same name exists in parent
+ *         - Memory allocation fails
+ *         - The tree is frozen
+ *
+ * @note This function updates the total size and file count of the parent directory and all ancestors,
+ *       adds the leaf to the end of the parent's leaf list, initializes all leaf fields
+ *       including base node properties, and copies the name into tree-owned storage sized
+ *       to fit, caching its length and hash for later comparisons. With
+ *       TREE_OPT_INLINE_VALUES a small value is copied into the leaf (see init_tree_ex).
+ */
+Leaf *create_leaf(Tree *tree, Directory *parent, const char *name, void *value, uint64_t size)
+{
+    STATS_SCOPE(tree, TREE_OP_CREATE_LEAF, name);
+    if (tree == NULL || parent == NULL || name == NULL || tree->frozen != NULL)
+        return NULL;
+
+    Leaf *new_leaf = leaf_new(tree, parent, name, strlen(name), value, size);
+    if (new_leaf == NULL)
+        return NULL;
+
+    bool exclusive = versions_enter(tree);
+    dir_write_lock(tree, parent);
+    if (!leaf_link(tree, parent, new_leaf))
+    {
+        dir_write_unlock(tree, parent);
+        versions_exit(tree, exclusive);
+        leaf_delete(tree, new_leaf);
+        return NULL;
+    }
+
+    // Update size and file totals. Holding the parent's lock keeps the
+    // ancestor chain alive: removing an ancestor has to lock it first.
+    propagate_totals(tree, parent, size, 1, 0);
+    propagate_bin(tree, parent, size, 1);
+    dir_write_unlock(tree, parent);
+    versions_exit(tree, exclusive);
+    journal_commit(tree);
+
+    return new_leaf;
+}
+
+/**
+ * @brief Removes a leaf (file) from the tree and updates the necessary size totals.
+ *
+ * @param tree Pointer to the tree structure
+ * @param leaf Pointer to the leaf (file) to be removed
+ *
+ * @return int - 0 on success, or -1 if:
+ *         - The tree or leaf is NULL
+ *         - The leaf has no parent
+ *         - The tree is frozen
+ *
+ * @note This function updates the total size and file count of the parent directory, its ancestors and the tree.
+ *       If the leaf has a value and a destroy function is provided, it calls the destroy
+ *       function on the value. The leaf is freed after removal from the parent's list,
+ *       or, if a live snapshot still contains it, when the last such snapshot is released;
+ *       a leaf held by leaf_acquire handles is freed by the last leaf_release.
+ */
+int remove_leaf(Tree *tree, Leaf *leaf)
+{
+    STATS_SCOPE(tree, TREE_OP_REMOVE_LEAF, leaf != NULL ? leaf->base.name : NULL);
+    if (tree == NULL || leaf == NULL || tree->frozen != NULL)
+        return -1;
+
+    Directory *parent = (Directory *)leaf->base.parent;
+    if (parent == NULL)
+        return -1;
+
+    bool exclusive = versions_enter(tree);
+    dir_write_lock(tree, parent);
+    journal_log(tree, JOURNAL_UNLINK, &leaf->base, NULL, NULL, NULL, 0);
+    path_index_remove(tree, &leaf->base);
+    versions_touch(tree, parent, true);
+
+    list_remove_leaf(parent, leaf);
+    dir_index_remove(tree, parent, &leaf->base);
+
+    // Update size and file totals
+    propagate_totals(tree, parent, -(int64_t)leaf->size, -1, 0);
+    propagate_bin(tree, parent, leaf->size, -1);
+    dir_write_unlock(tree, parent);
+
+    // Clean up leaf data, unless a snapshot can still see the leaf
+    if (!versions_retire(tree, &leaf->base))
+        leaf_free(tree, leaf);
+    versions_exit(tree, exclusive);
+    journal_commit(tree);
+    return 0;
+}
+
+/**
+ * @brief Replaces the value and size of a leaf (file).
+ *
+ * @param tree Pointer to the tree structure
+ * @param leaf The leaf to update
+ * @param value The new value
+ * @param size The new size in bytes
+ *
+ * @return Leaf* The leaf now holding the value, or NULL if:
+ *         - The tree or leaf is NULL
+ *         - The leaf has no parent
+ *         - Memory allocation fails, in which case the leaf is unchanged
+ *         - The tree is frozen
+ *
+ * @note A new leaf with the same name takes the old one's place in the parent's
+ *       list and indexes, so live snapshots keep the old value, a small value is
+ *       copied in with TREE_OPT_INLINE_VALUES, and the totals of the ancestors
+ *       change by the size difference. The old leaf is then freed, and its value
+ *       destroyed, as by remove_leaf.
+ *
+ * @warning Pointers to the old leaf are invalidated. With a destroy function,
+ *          value must not be the leaf's current value, which is destroyed.
+ */
+Leaf *update_leaf(Tree *tree, Leaf *leaf, void *value, uint64_t size)
+{
+    if (tree == NULL || leaf == NULL || tree->frozen != NULL)
+        return NULL;
+
+    Directory *parent = (Directory *)leaf->base.parent;
+    if (parent == NULL)
+        return NULL;
+
+    Leaf *new_leaf = leaf_new(tree, parent, leaf->base.name, leaf->base.name_len, value, size);
+    if (new_leaf == NULL)
+        return NULL;
+
+    bool exclusive = versions_enter(tree);
+    dir_write_lock(tree, parent);
+    journal_log(tree, JOURNAL_UPDATE, &leaf->base, NULL, NULL, new_leaf->value, size);
+    path_index_remove(tree, &leaf->base);
+    versions_touch(tree, parent, true);
+    list_replace_leaf(parent, leaf, new_leaf);
+    dir_index_remove(tree, parent, &leaf->base);
+    dir_index_add(tree, parent, &new_leaf->base);
+    path_index_add(tree, &new_leaf->base);
+
+    propagate_totals(tree, parent, (int64_t)size - (int64_t)leaf->size, 0, 0);
+    propagate_bin(tree, parent, leaf->size, -1);
+    propagate_bin(tree, parent, size, 1);
+    dir_write_unlock(tree, parent);
+
+    if (!versions_retire(tree, &leaf->base))
+        leaf_free(tree, leaf);
+    versions_exit(tree, exclusive);
+    journal_commit(tree);
+    return new_leaf;
+}
+
+// Waits out every other writer, snapshot reader and traversal before a node
+// is relinked or renamed: the paths and ancestor chains they follow change
+static void relink_enter(Tree *tree)
+{
+    if (!is_concurrent(tree))
+        return;
+    versions_exclude(tree);
+    lock_write(&tree->structure_lock);
+}
+
+static void relink_exit(Tree *tree)
+{
+    if (!is_concurrent(tree))
+        return;
+    unlock_write(&tree->structure_lock);
+    versions_include(tree);
+}
+
+static uint32_t directory_depth(Directory *dir)
+{
+    uint32_t depth = 0;
+    for (Node *node = dir->base.parent; node != NULL; node = node->parent)
+        depth++;
+    return depth;
+}
+
+// Write-locks two directories, the shallower first as readers descend
+static void dir_write_lock_pair(Tree *tree, Directory *a, Directory *b)
+{
+    if (!is_concurrent(tree))
+        return;
+    if (a != b && directory_depth(a) > directory_depth(b))
+    {
+        Directory *t = a;
+        a = b;
+        b = t;
+    }
+    lock_write(&a->lock);
+    if (a != b)
+        lock_write(&b->lock);
+}
+
+static void dir_write_unlock_pair(Tree *tree, Directory *a, Directory *b)
+{
+    if (!is_concurrent(tree))
+        return;
+    unlock_write(&a->lock);
+    if (a != b)
+        unlock_write(&b->lock);
+}
+
+static inline void paths_write_lock(Tree *tree)
+{
+    if ((tree->options & TREE_OPT_PATH_INDEX) && is_concurrent(tree))
+        lock_write(&tree->paths_lock);
+}
+
+static inline void paths_write_unlock(Tree *tree)
+{
+    if ((tree->options & TREE_OPT_PATH_INDEX) && is_concurrent(tree))
+        unlock_write(&tree->paths_lock);
+}
+
+/**
+ * @brief Moves a directory and everything below it under another parent.
+ *
+ * @param tree Pointer to the tree structure
+ * @param dir The directory to move
+ * @param new_parent The directory that receives it
+ *
+ * @return int - 0 on success (including when dir is already under new_parent), or -1 if:
+ *         - Any input parameter is NULL
+ *         - dir is the root
+ *         - new_parent is dir itself or one of its descendants
+ *         - new_parent already has a subdirectory with the same name
+ *         - The tree is frozen
+ *
+ * @note The directory is unlinked and relinked in place, so the cost is the
+ *       depth of the two parents: the moved totals are subtracted along the old
+ *       ancestor chain and added along the new one, and tree-wide counts do not
+ *       change. Only the path index, when enabled, has to visit the whole subtree
+ *       to re-key it. Snapshots keep seeing the directory at its old place.
+ *
+ * @warning In concurrent trees a move waits for all other writers and traversals.
+ */
+int move_directory(Tree *tree, Directory *dir, Directory *new_parent)
+{
+    if (tree == NULL || dir == NULL || new_parent == NULL || tree->frozen != NULL)
+        return -1;
+
+    relink_enter(tree);
+    // Moving the root, or into its own subtree, would detach it from the root
+    Directory *parent = (Directory *)dir->base.parent;
+    int result = parent == NULL ? -1 : 0;
+    for (Node *node = &new_parent->base; node != NULL; node = node->parent)
+    {
+        if (node == &dir->base)
+            result = -1;
+    }
+    if (result != 0 || parent == new_parent)
+    {
+        relink_exit(tree);
+        return result;
+    }
+
+    dir_write_lock_pair(tree, parent, new_parent);
+    if (find_child_directory(new_parent, dir->base.name, dir->base.name_len, dir->base.hash) != NULL)
+    {
+        dir_write_unlock_pair(tree, parent, new_parent);
+        relink_exit(tree);
+        return -1;
+    }
+
+    journal_log(tree, JOURNAL_MOVE_DIR, &dir->base, &new_parent->base, NULL, NULL, 0);
+    bool paths = (tree->options & TREE_OPT_PATH_INDEX) != 0;
+    paths_write_lock(tree);
+    if (paths)
+        path_index_remove_tree(tree, dir);
+
+    int64_t size = dir->total_size;
+    int32_t files = (int32_t)dir->subtree_files;
+    int32_t dirs = (int32_t)dir->subtree_dirs + 1;
+    versions_touch(tree, parent, true);
+    list_remove_dir(parent, dir);
+    dir_index_remove(tree, parent, &dir->base);
+    propagate_totals(tree, parent, -size, -files, -dirs);
+    propagate_histogram(tree, parent, dir->histogram, -1);
+
+    dir->base.parent = &new_parent->base;
+    path_cache_invalidate(tree);
+    versions_touch(tree, new_parent, true);
+    list_append_dir(new_parent, dir);
+    dir_index_add(tree, new_parent, &dir->base);
+    propagate_totals(tree, new_parent, size, files, dirs);
+    propagate_histogram(tree, new_parent, dir->histogram, 1);
+
+    if (paths)
+        path_index_add_tree(tree, dir);
+    paths_write_unlock(tree);
+    dir_write_unlock_pair(tree, parent, new_parent);
+    relink_exit(tree);
+    journal_commit(tree);
+    return 0;
+}
+
+/**
+ * @brief Moves a leaf (file) to another directory.
+ *
+ * @param tree Pointer to the tree structure
+ * @param leaf The leaf to move
+ * @param new_parent The directory that receives it
+ *
+ * @return int - 0 on success (including when leaf is already in new_parent), or -1 if:
+ *         - Any input parameter is NULL
+ *         - new_parent already has a leaf with the same name
+ *         - The tree is frozen
+ *
+ * @note The leaf keeps its value and size. Its size and file count are
+ *       subtracted along the old ancestor chain and added along the new one.
+ *
+ * @warning In concurrent trees a move waits for all other writers and traversals.
+ */
+int move_leaf(Tree *tree, Leaf *leaf, Directory *new_parent)
+{
+    if (tree == NULL || leaf == NULL || new_parent == NULL || tree->frozen != NULL)
+        return -1;
+
+    relink_enter(tree);
+    Directory *parent = (Directory *)leaf->base.parent;
+    if (parent == NULL || parent == new_parent)
+    {
+        relink_exit(tree);
+        return parent == NULL ? -1 : 0;
+    }
+
+    dir_write_lock_pair(tree, parent, new_parent);
+    if (find_child_leaf(new_parent, leaf->base.name, leaf->base.name_len, leaf->base.hash) != NULL)
+    {
+        dir_write_unlock_pair(tree, parent, new_parent);
+        relink_exit(tree);
+        return -1;
+    }
+
+    journal_log(tree, JOURNAL_MOVE_LEAF, &leaf->base, &new_parent->base, NULL, NULL, 0);
+    path_index_remove(tree, &leaf->base);
+    versions_touch(tree, parent, true);
+    list_remove_leaf(parent, leaf);
+    dir_index_remove(tree, parent, &leaf->base);
+    propagate_totals(tree, parent, -(int64_t)leaf->size, -1, 0);
+    propagate_bin(tree, parent, leaf->size, -1);
+
+    leaf->base.parent = &new_parent->base;
+    versions_touch(tree, new_parent, true);
+    list_append_leaf(new_parent, leaf);
+    dir_index_add(tree, new_parent, &leaf->base);
+    propagate_totals(tree, new_parent, leaf->size, 1, 0);
+    propagate_bin(tree, new_parent, leaf->size, 1);
+    path_index_add(tree, &leaf->base);
+
+    dir_write_unlock_pair(tree, parent, new_parent);
+    relink_exit(tree);
+    journal_commit(tree);
+    return 0;
+}
+
+/**
+ * @brief Renames a directory or leaf in place.
+ *
+ * @param tree Pointer to the tree structure
+ * @param node The directory or leaf to rename
+ * @param name The new name (must be less than 256 characters)
+ *
+ * @return int - 0 on success, or -1 if:
+ *         - Any input parameter is NULL
+ *         - Name is too long (>= 256 chars)
+ *         - A sibling of the same kind already has that name
+ *         - Memory allocation fails
+ *         - A live snapshot exists, since snapshots share the node and its name
+ *         - The tree is frozen
+ *
+ * @note Renaming a directory re-keys the path index entries of its whole
+ *       subtree when the index is enabled; otherwise only the parent's name
+ *       index changes. Renaming the root changes no paths, as they exclude it.
+ *
+ * @warning In concurrent trees a rename waits for all other writers and traversals.
+ */
+int rename_node(Tree *tree, Node *node, const char *name)
+{
+    if (tree == NULL || node == NULL || name == NULL || tree->frozen != NULL)
+        return -1;
+
+    size_t len = strlen(name);
+    if (len >= 256)
+        return -1;
+
+    relink_enter(tree);
+    if (versions_live(tree))
+    {
+        relink_exit(tree);
+        return -1;
+    }
+
+    Directory *parent = (Directory *)node->parent;
+    uint32_t hash = hash_name(name, len);
+    if (parent != NULL)
+    {
+        dir_write_lock(tree, parent);
+        Node *existing = is_leaf(node) ? (Node *)find_child_leaf(parent, name, len, hash)
+                                       : (Node *)find_child_directory(parent, name, len, hash);
+        if (existing != NULL)
+        {
+            dir_write_unlock(tree, parent);
+            relink_exit(tree);
+            return existing == node ? 0 : -1;
+        }
+    }
+
+    const char *old_name = node->name;
+    size_t old_len = node->name_len;
+    bool paths = parent != NULL && (tree->options & TREE_OPT_PATH_INDEX) != 0;
+    paths_write_lock(tree);
+    if (paths)
+    {
+        if (is_leaf(node))
+            path_index_remove_locked(tree, node);
+        else
+            path_index_remove_tree(tree, (Directory *)node);
+    }
+    if (parent != NULL)
+        dir_index_remove(tree, parent, node);
+
+    bool renamed = node_set_name(tree, node, name, len);
+    if (renamed)
+    {
+        journal_log(tree, is_leaf(node) ? JOURNAL_RENAME_LEAF : JOURNAL_RENAME_DIR, parent != NULL ? &parent->base : NULL,
+                    NULL, node->name, old_name, old_len);
+        tree_free(tree, (char *)old_name, old_len + 1);
+    }
+    if (renamed && !is_leaf(node))
+        path_cache_invalidate(tree);
+
+    if (parent != NULL)
+        dir_index_add(tree, parent, node);
+    if (paths)
+    {
+        if (is_leaf(node))
+            path_index_add_locked(tree, node);
+        else
+            path_index_add_tree(tree, (Directory *)node);
+    }
+    paths_write_unlock(tree);
+    if (parent != NULL)
+        dir_write_unlock(tree, parent);
+    relink_exit(tree);
+    journal_commit(tree);
+    return renamed ? 0 : -1;
+}
+
+// Where a record's parent path ends and its leaf name starts
+typedef struct BatchEntry
+{
+    const TreeRecord *record;
+    size_t parent_len; // Bytes of path before the leaf name
+    size_t order;      // Input position, keeps insertion order within a directory
+} BatchEntry;
+
+static int batch_compare(const void *a, const void *b)
+{
+    const BatchEntry *x = a;
+    const BatchEntry *y = b;
+    size_t len = x->parent_len < y->parent_len ? x->parent_len : y->parent_len;
+    int cmp = memcmp(x->record->path, y->record->path, len);
+    if (cmp != 0)
+        return cmp;
+    if (x->parent_len != y->parent_len)
+        return x->parent_len < y->parent_len ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/**
+ * @brief Bulk-loads leaves and directories from an array of records.
+ *
+ * @param tree Pointer to the tree structure
+ * @param records Array of (path, value, size) records; see TreeRecord
+ * @param count Number of records
+ *
+ * @return long Number of leaves created, or -1 if:
+ *         - The tree is NULL, or records is NULL with a non-zero count
+ *         - The tree has no root directory
+ *         - Memory allocation fails before anything is loaded
+ *         - The tree is frozen
+ *
+ * @note Records are grouped by parent directory, so each directory is resolved
+ *       (and created if missing) once, its new leaves are linked in one pass in
+ *       input order, and the combined size and file deltas are pushed up the
+ *       ancestor chain once per directory instead of once per leaf.
+ *       Records that cannot be loaded (duplicate or over-long names, or an
+ *       unresolvable parent) are skipped and keep their value; the values of
+ *       loaded leaves are owned by the tree as with create_leaf.
+ *       Paths are resolved below the root, as by find_directory, so the root
+ *       has to be created first, as for create_directory and create_leaf.
+ */
+long tree_load_batch(Tree *tree, const TreeRecord *records, size_t count)
+{
+    if (tree == NULL || (records == NULL && count > 0) || tree->frozen != NULL ||
+        __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE) == NULL)
+        return -1;
+    if (count == 0)
+        return 0;
+
+    BatchEntry *entries = malloc(count * sizeof(BatchEntry));
+    if (entries == NULL)
+        return -1;
+
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        const char *path = records[i].path;
+        if (path == NULL)
+            continue;
+        const char *slash = strrchr(path, '/');
+        entries[n].record = &records[i];
+        entries[n].parent_len = slash != NULL ? (size_t)(slash - path) + 1 : 0;
+        entries[n].order = i;
+        n++;
+    }
+    qsort(entries, n, sizeof(BatchEntry), batch_compare);
+
+    long loaded = 0;
+    char *scratch = NULL;
+    size_t scratch_size = 0;
+    for (size_t start = 0; start < n;)
+    {
+        // Find this group: every entry with the same parent path
+        const BatchEntry *first = &entries[start];
+        size_t end = start + 1;
+        while (end < n && entries[end].parent_len == first->parent_len &&
+               memcmp(entries[end].record->path, first->record->path, first->parent_len) == 0)
+            end++;
+
+        Directory *dir;
+        if (first->parent_len == 0 || strspn(first->record->path, "/") == first->parent_len)
+        {
+            dir = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+        }
+        else
+        {
+            if (first->parent_len + 1 > scratch_size)
+            {
+                size_t size = first->parent_len + 1 > 256 ? first->parent_len + 1 : 256;
+                char *grown = realloc(scratch, size);
+                if (grown == NULL)
+                    break;
+                scratch = grown;
+                scratch_size = size;
+            }
+            memcpy(scratch, first->record->path, first->parent_len);
+            scratch[first->parent_len] = '\0';
+            dir = create_nested_directory(tree, scratch);
+        }
+
+        if (dir != NULL)
+        {
+            int64_t size_delta = 0;
+            int32_t file_delta = 0;
+            uint32_t bins[TREE_HISTOGRAM_BINS] = {0};
+            bool exclusive = versions_enter(tree);
+            dir_write_lock(tree, dir);
+            for (size_t i = start; i < end; i++)
+            {
+                const TreeRecord *record = entries[i].record;
+                const char *name = record->path + entries[i].parent_len;
+                if (*name == '\0')
+                    continue; // Directory record: resolving the group created it
+
+                Leaf *leaf = leaf_new(tree, dir, name, strlen(name), record->value, record->size);
+                if (leaf == NULL)
+                    continue;
+                if (!leaf_link(tree, dir, leaf))
+                {
+                    leaf_delete(tree, leaf);
+                    continue;
+                }
+                size_delta += record->size;
+                file_delta++;
+                bins[size_bin(record->size)]++;
+            }
+            propagate_totals(tree, dir, size_delta, file_delta, 0);
+            propagate_histogram(tree, dir, bins, 1);
+            dir_write_unlock(tree, dir);
+            versions_exit(tree, exclusive);
+            loaded += file_delta;
+        }
+        start = end;
+    }
+
+    free(scratch);
+    free(entries);
+    journal_commit(tree);
+    return loaded;
+}
+// Scratch for the find_leaf traversal
+typedef struct LeafQuery
+{
+    const char *name;
+    size_t len;
+    uint32_t hash;
+} LeafQuery;
+
+static bool find_leaf_visit(Directory *dir, void *local, void *ctx)
+{
+    LeafQuery *query = ctx;
+    Leaf *leaf = find_child_leaf(dir, query->name, query->len, query->hash);
+    if (leaf == NULL)
+        return true;
+    *(Leaf **)local = leaf;
+    return false; // Found it: stop the other workers too
+}
+
+static void find_leaf_reduce(void *result, const void *local, void *ctx)
+{
+    (void)ctx;
+    if (*(Leaf **)result == NULL)
+        *(Leaf **)result = *(Leaf *const *)local;
+}
+
+/**
+ * @brief Searches for a leaf (file) in the tree or subtree.
+ *
+ * @param tree Pointer to the tree structure
+ * @param start Pointer to the directory from which to start the search
+ * @param name The name of the leaf to search for
+ *
+ * @return Leaf* Pointer to the found leaf if it exists, or NULL if:
+ *         - The tree is NULL
+ *         - Name is NULL
+ *         - The leaf is not found
+ *
+ * @note If 'start' is NULL, the search begins from the root of the tree.
+ *       The function first searches in the leaves of the current directory,
+ *       and if not found, it searches all child directories depth-first.
+ *       The search is case-sensitive.
+ *       When the tree has a worker pool (tree_set_parallelism) subtrees are
+ *       searched concurrently and the first hit cancels the rest, so any
+ *       matching leaf may be returned rather than the first in depth-first order.
+ */
+Leaf *find_leaf(Tree *tree, Directory *start, const char *name)
+{
+    STATS_SCOPE(tree, TREE_OP_FIND_LEAF, name);
+    if (tree == NULL || name == NULL)
+        return NULL;
+
+    Directory *curr = start ? start : tree->root;
+    if (curr == NULL)
+        return NULL;
+
+    LeafQuery query = {.name = name, .len = strlen(name)};
+    query.hash = hash_name(name, query.len);
+
+    Leaf *found = NULL;
+    if (tree_parallel_visit(tree, curr, find_leaf_visit, sizeof(Leaf *), find_leaf_reduce, &found, &query) < 0)
+        return NULL;
+    return found;
+}
+
+/**
+ * @brief Looks up a node by its full path.
+ *
+ * @param tree Pointer to the tree structure
+ * @param path Full path below the root, e.g. "/logs/app/current.log"
+ *
+ * @return Node* The directory at path if there is one, otherwise the leaf at path,
+ *         or NULL if:
+ *         - Any input parameter is NULL
+ *         - Nothing exists at path
+ *
+ * @note Paths are matched component by component, so repeated or trailing
+ *       slashes are ignored and "/" names the root. With TREE_OPT_PATH_INDEX this
+ *       is a single hash probe that performs no allocation; otherwise it resolves
+ *       the parent with find_directory and checks its children.
+ */
+Node *lookup_path(Tree *tree, const char *path)
+{
+    STATS_SCOPE(tree, TREE_OP_LOOKUP_PATH, path);
+    if (tree == NULL || path == NULL || tree->root == NULL)
+        return NULL;
+
+    if (tree->options & TREE_OPT_PATH_INDEX)
+    {
+        Node *node = NULL;
+        bool indexed;
+        if (is_concurrent(tree))
+            lock_read(&tree->paths_lock);
+        indexed = tree->paths != NULL;
+        if (indexed)
+        {
+            node = path_index_find(tree->paths, path, false);
+            if (node == NULL)
+                node = path_index_find(tree->paths, path, true);
+        }
+        if (is_concurrent(tree))
+            unlock_read(&tree->paths_lock);
+        if (indexed)
+            return node;
+    }
+
+    Directory *dir = find_directory(tree, path);
+    if (dir != NULL)
+        return &dir->base;
+    return (Node *)find_leaf_by_path(tree, path);
+}
+
+/**
+ * @brief Looks up a leaf (file) by its full path.
+ *
+ * @param tree Pointer to the tree structure
+ * @param path Full path below the root, e.g. "/logs/app/current.log"
+ *
+ * @return Leaf* Pointer to the leaf at path, or NULL if:
+ *         - Any input parameter is NULL
+ *         - No leaf exists at path
+ *
+ * @note Unlike find_leaf this matches one exact location rather than searching
+ *       a subtree by bare name. With TREE_OPT_PATH_INDEX it is a single hash probe.
+ */
+Leaf *find_leaf_by_path(Tree *tree, const char *path)
+{
+    STATS_SCOPE(tree, TREE_OP_FIND_LEAF_BY_PATH, path);
+    if (tree == NULL || path == NULL || tree->root == NULL)
+        return NULL;
+    return leaf_lookup(tree, path, NULL);
+}
+
+// Pins a leaf found under a lock that keeps it from leaving the tree
+static void leaf_pin(Tree *tree, Leaf *leaf, TreeValue *value)
+{
+    __atomic_add_fetch(&leaf->pins, 1, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&tree->pinned, 1, __ATOMIC_RELAXED);
+    value->data = leaf->value;
+    value->size = leaf->size;
+    value->leaf = leaf;
+}
+
+// find_leaf_by_path, also pinning the leaf (when pin is not NULL) before the
+// lock it was found under is released
+static Leaf *leaf_lookup(Tree *tree, const char *path, TreeValue *pin)
+{
+    if (tree->options & TREE_OPT_PATH_INDEX)
+    {
+        Leaf *leaf = NULL;
+        bool indexed;
+        if (is_concurrent(tree))
+            lock_read(&tree->paths_lock);
+        indexed = tree->paths != NULL;
+        if (indexed)
+            leaf = (Leaf *)path_index_find(tree->paths, path, true);
+        if (leaf != NULL && pin != NULL)
+            leaf_pin(tree, leaf, pin);
+        if (is_concurrent(tree))
+            unlock_read(&tree->paths_lock);
+        if (indexed)
+            return leaf;
+    }
+
+    // Resolve every component but the last as a directory, coupling locks as find_directory does
+    Directory *dir = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+    const char *cursor = path;
+    PathSlice component;
+    if (!path_next(&cursor, &component))
+        return NULL;
+    dir_read_lock(tree, dir);
+    for (;;)
+    {
+        PathSlice next;
+        if (!path_next(&cursor, &next))
+            break;
+        Directory *child = find_child_directory(dir, component.ptr, component.len,
+                                                hash_name(component.ptr, component.len));
+        if (child != NULL)
+            dir_read_lock(tree, child);
+        dir_read_unlock(tree, dir);
+        dir = child;
+        if (dir == NULL)
+            return NULL;
+        component = next;
+    }
+    Leaf *leaf = find_child_leaf(dir, component.ptr, component.len, hash_name(component.ptr, component.len));
+    if (leaf != NULL && pin != NULL)
+        leaf_pin(tree, leaf, pin);
+    dir_read_unlock(tree, dir);
+    return leaf;
+}
+
+/**
+ * @brief Pins a leaf's value so it can be used in place.
+ *
+ * @param tree Pointer to the tree structure
+ * @param leaf A leaf of the tree
+ * @param value Receives the value's data and size, and the handle for leaf_release
+ *
+ * @return int - 0 on success, or -1 if any input parameter is NULL or the leaf has no parent
+ *
+ * @note Until leaf_release the leaf is not freed and its value not destroyed,
+ *       even by remove_leaf, update_leaf or the removal of a directory above it,
+ *       so value->data can be handed straight to writev or sendfile without a
+ *       copy or a lock. Each handle is one atomic increment. Inline values stay
+ *       inside the pinned leaf.
+ *
+ * @warning leaf must still be in the tree, which concurrent callers have to
+ *          coordinate as for any other use of a leaf pointer; leaf_acquire_path
+ *          looks up and pins in one step instead. Every handle must be released
+ *          before destroy_tree, and tree_freeze fails while any are held.
+ */
+int leaf_acquire(Tree *tree, Leaf *leaf, TreeValue *value)
+{
+    if (tree == NULL || leaf == NULL || value == NULL)
+        return -1;
+
+    // The parent's lock keeps the leaf in the tree; a move may change the parent first
+    for (;;)
+    {
+        Directory *parent = (Directory *)__atomic_load_n(&leaf->base.parent, __ATOMIC_ACQUIRE);
+        if (parent == NULL)
+            return -1;
+        dir_read_lock(tree, parent);
+        bool current = leaf->base.parent == &parent->base;
+        if (current)
+            leaf_pin(tree, leaf, value);
+        dir_read_unlock(tree, parent);
+        if (current)
+            return 0;
+    }
+}
+
+/**
+ * @brief Looks up a leaf by path and pins its value, as leaf_acquire.
+ *
+ * @param tree Pointer to the tree structure
+ * @param path Path of the leaf, as for find_leaf_by_path
+ * @param value Receives the value's data and size, and the handle for leaf_release
+ *
+ * @return int - 0 on success, or -1 if any input parameter is NULL or no leaf has that path
+ *
+ * @note The leaf is pinned before the lock it was found under is released, so
+ *       in concurrent trees a writer removing or updating it at the same time
+ *       cannot free it first.
+ */
+int leaf_acquire_path(Tree *tree, const char *path, TreeValue *value)
+{
+    if (tree == NULL || path == NULL || value == NULL || __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE) == NULL)
+        return -1;
+    return leaf_lookup(tree, path, value) != NULL ? 0 : -1;
+}
+
+/**
+ * @brief Releases a handle from leaf_acquire or leaf_acquire_path.
+ *
+ * @param tree Pointer to the tree structure
+ * @param value The handle, which is cleared
+ *
+ * @note Releasing the last handle of a leaf that has left the tree frees it and
+ *       destroys its value, on the calling thread.
+ */
+void leaf_release(Tree *tree, TreeValue *value)
+{
+    if (tree == NULL || value == NULL || value->leaf == NULL)
+        return;
+
+    Leaf *leaf = value->leaf;
+    value->data = NULL;
+    value->size = 0;
+    value->leaf = NULL;
+    __atomic_sub_fetch(&tree->pinned, 1, __ATOMIC_RELEASE);
+    if (__atomic_sub_fetch(&leaf->pins, 1, __ATOMIC_ACQ_REL) == LEAF_RETIRED)
+        leaf_reclaim(tree, leaf);
+}
+
+/**
+ * @brief Locks a directory for an ordered query, building its ordered view first if needed.
+ *
+ * @param tree Pointer to the tree structure
+ * @param dir The directory to be listed
+ * @return bool Whether dir ended up write-locked; pass it to order_release
+ *
+ * @note Concurrent trees share the lock once the view exists and take it
+ *       exclusively only to build it. dir->order is still NULL afterwards if
+ *       memory ran out.
+ */
+static bool order_acquire(Tree *tree, Directory *dir)
+{
+    dir_read_lock(tree, dir);
+    if (dir->order != NULL)
+        return false;
+    dir_read_unlock(tree, dir);
+    dir_write_lock(tree, dir);
+    if (dir->order == NULL)
+        order_build(tree, dir);
+    return true;
+}
+
+static void order_release(Tree *tree, Directory *dir, bool exclusive)
+{
+    if (exclusive)
+        dir_write_unlock(tree, dir);
+    else
+        dir_read_unlock(tree, dir);
+}
+
+static inline OrderKey order_bound(const char *name, int kind)
+{
+    return (OrderKey){.name = name, .len = strlen(name), .kind = kind};
+}
+
+/**
+ * @brief Finds the first entry of a directory, in name order, that does not sort before name.
+ *
+ * @param tree Pointer to the tree structure
+ * @param dir The directory to search
+ * @param name Lower bound, or NULL for the directory's first entry
+ * @return Node* The subdirectory or leaf found, or NULL if none is left (or memory ran out)
+ *
+ * @note Entries are ordered by the tree's compare function, which receives two
+ *       NUL-terminated names, or byte-wise when it is NULL; a subdirectory sorts
+ *       before a leaf of the same name. The first ordered query on a directory
+ *       builds a B+-tree over its entries, which later changes keep up to date,
+ *       so each query costs O(log n) plus the entries returned. Together with
+ *       list_next this walks a directory in order.
+ */
+Node *list_seek(Tree *tree, Directory *dir, const char *name)
+{
+    if (tree == NULL || dir == NULL)
+        return NULL;
+
+    bool exclusive = order_acquire(tree, dir);
+    Node *node = NULL;
+    if (dir->order != NULL)
+    {
+        OrderCursor cursor;
+        OrderKey key = order_bound(name != NULL ? name : "", ORDER_BELOW);
+        order_seek(tree, dir->order, name != NULL ? &key : NULL, &cursor);
+        node = order_cursor_node(&cursor);
+    }
+    order_release(tree, dir, exclusive);
+    return node;
+}
+
+/**
+ * @brief Returns the entry that follows node in dir's name order.
+ *
+ * @param tree Pointer to the tree structure
+ * @param dir The directory being walked
+ * @param node An entry of dir, as returned by list_seek or list_next
+ * @return Node* The next subdirectory or leaf, or NULL after the last one
+ *
+ * @note See list_seek for the order used.
+ */
+Node *list_next(Tree *tree, Directory *dir, Node *node)
+{
+    if (tree == NULL || dir == NULL || node == NULL)
+        return NULL;
+
+    bool exclusive = order_acquire(tree, dir);
+    Node *next = NULL;
+    if (dir->order != NULL)
+    {
+        OrderCursor cursor;
+        OrderKey key = order_key(node);
+        order_seek(tree, dir->order, &key, &cursor);
+        if (order_cursor_node(&cursor) == node)
+            order_cursor_next(&cursor);
+        next = order_cursor_node(&cursor);
+    }
+    order_release(tree, dir, exclusive);
+    return next;
+}
+
+/**
+ * @brief Lists the entries of a directory whose names fall in [lo, hi), in name order.
+ *
+ * @param tree Pointer to the tree structure
+ * @param dir The directory to list
+ * @param lo Inclusive lower bound, or NULL for no lower bound
+ * @param hi Exclusive upper bound, or NULL for no upper bound
+ * @param out Receives up to capacity nodes
+ * @param capacity Size of out
+ *
+ * @return uint32_t Number of nodes written to out. A full buffer may mean more
+ *         entries follow: continue with list_next from the last one.
+ *
+ * @note See list_seek for the order used. Costs O(log n + capacity).
+ */
+uint32_t list_range(Tree *tree, Directory *dir, const char *lo, const char *hi, Node **out, uint32_t capacity)
+{
+    if (tree == NULL || dir == NULL || (out == NULL && capacity > 0))
+        return 0;
+
+    bool exclusive = order_acquire(tree, dir);
+    uint32_t n = 0;
+    if (dir->order != NULL)
+    {
+        OrderCursor cursor;
+        OrderKey key = order_bound(lo != NULL ? lo : "", ORDER_BELOW);
+        OrderKey end = hi != NULL ? order_bound(hi, ORDER_BELOW) : key;
+        order_seek(tree, dir->order, lo != NULL ? &key : NULL, &cursor);
+        for (Node *node; n < capacity && (node = order_cursor_node(&cursor)) != NULL; order_cursor_next(&cursor))
+        {
+            if (hi != NULL && order_compare(tree, &end, node) < 0)
+                break;
+            out[n++] = node;
+        }
+    }
+    order_release(tree, dir, exclusive);
+    return n;
+}
+
+/**
+ * @brief Lists the entries of a directory whose names start with prefix, in name order.
+ *
+ * @param tree Pointer to the tree structure
+ * @param dir The directory to list
+ * @param prefix Leading bytes every returned name has (an empty prefix matches everything)
+ * @param out Receives up to capacity nodes
+ * @param capacity Size of out
+ *
+ * @return uint32_t Number of nodes written to out; a full buffer may mean more
+ *         entries follow, as with list_range.
+ *
+ * @note With byte-wise order the matches are contiguous, so this costs
+ *       O(log n + capacity). A user compare function need not keep them together,
+ *       so then the whole directory is scanned in order.
+ */
+uint32_t list_prefix(Tree *tree, Directory *dir, const char *prefix, Node **out, uint32_t capacity)
+{
+    if (tree == NULL || dir == NULL || prefix == NULL || (out == NULL && capacity > 0))
+        return 0;
+
+    bool exclusive = order_acquire(tree, dir);
+    uint32_t n = 0;
+    if (dir->order != NULL)
+    {
+        size_t len = strlen(prefix);
+        bool contiguous = tree->compare == NULL;
+        OrderCursor cursor;
+        OrderKey key = order_bound(prefix, ORDER_BELOW);
+        order_seek(tree, dir->order, contiguous ? &key : NULL, &cursor);
+        for (Node *node; n < capacity && (node = order_cursor_node(&cursor)) != NULL; order_cursor_next(&cursor))
+        {
+            bool match = node->name_len >= len && memcmp(node->name, prefix, len) == 0;
+            if (match)
+                out[n++] = node;
+            else if (contiguous)
+                break;
+        }
+    }
+    order_release(tree, dir, exclusive);
+    return n;
+}
+
+// Glob queries. A pattern is split at '/' into segments; the set of segments
+// a name may match next is a bit mask, so "**" (any number of directories)
+// needs no backtracking. Every open directory on the walk keeps the mask its
+// entries are matched against, and a directory none of whose names can lead
+// to a match is never entered.
+#define QUERY_MAX_SEGMENTS 63 // Bit QUERY_MAX_SEGMENTS marks a complete match
+
+#define SEGMENT_LITERAL 0 // Plain name, found through the directory's index
+#define SEGMENT_GLOB 1    // Contains *, ?, [...] or escapes
+#define SEGMENT_ANY 2     // "**"
+
+typedef struct QuerySegment
+{
+    const char *text;
+    size_t len;
+    uint32_t hash; // hash_name of a literal segment
+    uint8_t kind;
+} QuerySegment;
+
+typedef struct QueryFrame
+{
+    Directory *dir;
+    uint64_t states; // Segments the entries of dir can match
+    Leaf *leaf;      // Next leaf to look at
+    Directory *child; // Next subdirectory to look at
+    uint32_t depth;  // Of dir's entries, the root's being 1
+    bool literal;    // Only the single entries found by name are left
+} QueryFrame;
+
+struct TreeQuery
+{
+    Tree *tree;
+    char *pattern; // Copy the segments point into
+    QuerySegment segments[QUERY_MAX_SEGMENTS];
+    uint32_t count;
+    TreeFilter filter;
+    QueryFrame *stack;
+    uint32_t depth;
+    uint32_t capacity;
+    bool root_pending; // The root itself still has to be considered
+};
+
+// Matches one name against a glob segment: * and ? within the name, [set],
+// [!set], ranges and backslash escapes
+static bool glob_match(const char *glob, size_t glob_len, const char *name, size_t len)
+{
+    size_t g = 0, n = 0;
+    size_t star_g = SIZE_MAX, star_n = 0;
+    while (n < len)
+    {
+        if (g < glob_len)
+        {
+            char c = glob[g];
+            if (c == '*')
+            {
+                // Remember the star; first try it matching nothing
+                star_g = ++g;
+                star_n = n;
+                continue;
+            }
+            if (c == '?')
+            {
+                g++;
+                n++;
+                continue;
+            }
+            if (c == '[')
+            {
+                size_t i = g + 1;
+                bool negate = i < glob_len && (glob[i] == '!' || glob[i] == '^');
+                if (negate)
+                    i++;
+                bool matched = false;
+                bool first = true;
+                for (; i < glob_len && (glob[i] != ']' || first); first = false)
+                {
+                    char lo = glob[i];
+                    if (lo == '\\' && i + 1 < glob_len)
+                        lo = glob[++i];
+                    char hi = lo;
+                    if (i + 2 < glob_len && glob[i + 1] == '-' && glob[i + 2] != ']')
+                    {
+                        i += 2;
+                        hi = glob[i];
+                        if (hi == '\\' && i + 1 < glob_len)
+                            hi = glob[++i];
+                    }
+                    if ((unsigned char)name[n] >= (unsigned char)lo && (unsigned char)name[n] <= (unsigned char)hi)
+                        matched = true;
+                    i++;
+                }
+                if (i < glob_len && matched != negate)
+                {
+                    g = i + 1;
+                    n++;
+                    continue;
+                }
+                if (i >= glob_len && name[n] == '[')
+                {
+                    // No closing bracket: a literal '['
+                    g++;
+                    n++;
+                    continue;
+                }
+            }
+            else
+            {
+                if (c == '\\' && g + 1 < glob_len)
+                    c = glob[++g];
+                if (c == name[n])
+                {
+                    g++;
+                    n++;
+                    continue;
+                }
+            }
+        }
+        // Mismatch: let the last star swallow one more byte
+        if (star_g == SIZE_MAX)
+            return false;
+        g = star_g;
+        n = ++star_n;
+    }
+    while (g < glob_len && glob[g] == '*')
+        g++;
+    return g == glob_len;
+}
+
+// Adds the segments after every "**" in states, which may match no directory at all
+static uint64_t query_closure(const TreeQuery *query, uint64_t states)
+{
+    for (uint32_t i = 0; i < query->count; i++)
+    {
+        if ((states & (1ull << i)) && query->segments[i].kind == SEGMENT_ANY)
+            states |= 1ull << (i + 1);
+    }
+    return states;
+}
+
+// The segments left to match after name has matched one of states
+static uint64_t query_advance(const TreeQuery *query, uint64_t states, const Node *node)
+{
+    uint64_t next = 0;
+    for (uint32_t i = 0; i < query->count; i++)
+    {
+        if (!(states & (1ull << i)))
+            continue;
+        const QuerySegment *segment = &query->segments[i];
+        if (segment->kind == SEGMENT_ANY)
+            next |= 1ull << i;
+        else if (segment->kind == SEGMENT_LITERAL ? node_name_equals(node, segment->text, segment->len, segment->hash)
+                                                  : glob_match(segment->text, segment->len, node->name, node->name_len))
+            next |= 1ull << (i + 1);
+    }
+    return query_closure(query, next);
+}
+
+static inline bool query_accepts(const TreeQuery *query, uint64_t states)
+{
+    return (states & (1ull << query->count)) != 0;
+}
+
+static inline bool query_size_ok(const TreeQuery *query, uint64_t size)
+{
+    return size >= query->filter.min_size && (query->filter.max_size == 0 || size <= query->filter.max_size);
+}
+
+// Opens dir for matching its entries against states; false if memory ran out
+static bool query_push(TreeQuery *query, Directory *dir, uint64_t states, uint32_t depth)
+{
+    if (query->depth == query->capacity)
+    {
+        uint32_t capacity = query->capacity ? query->capacity * 2 : 16;
+        QueryFrame *grown = realloc(query->stack, capacity * sizeof(QueryFrame));
+        if (grown == NULL)
+            return false;
+        query->stack = grown;
+        query->capacity = capacity;
+    }
+
+    QueryFrame *frame = &query->stack[query->depth++];
+    frame->dir = dir;
+    frame->states = states;
+    frame->depth = depth;
+    frame->literal = false;
+
+    // A single literal segment names the one entry of either kind that can match
+    uint32_t state = (uint32_t)__builtin_ctzll(states);
+    const QuerySegment *segment = &query->segments[state];
+    if (states == (1ull << state) && state < query->count && segment->kind == SEGMENT_LITERAL)
+    {
+        frame->literal = true;
+        frame->leaf = find_child_leaf(dir, segment->text, segment->len, segment->hash);
+        frame->child = find_child_directory(dir, segment->text, segment->len, segment->hash);
+        return true;
+    }
+    frame->leaf = dir->first_leaf;
+    frame->child = dir->first_child;
+    return true;
+}
+
+// Whether the walk has to go into a directory whose entries would match states
+static bool query_descends(const TreeQuery *query, const Directory *dir, uint64_t states, uint32_t depth)
+{
+    // Nothing but a complete match is left
+    if ((states & ~(1ull << query->count)) == 0)
+        return false;
+    if (query->filter.max_depth != 0 && depth > query->filter.max_depth)
+        return false;
+    // No leaf or directory below can reach min_size when all of them together do not
+    return __atomic_load_n(&dir->total_size, __ATOMIC_RELAXED) >= query->filter.min_size;
+}
+
+/**
+ * @brief Starts a search for the nodes whose full path matches a glob pattern.
+ *
+ * @param tree Pointer to the tree structure
+ * @param pattern Absolute path pattern such as "/logs/2026-??-*.gz". Within
+ *        a segment, * and ? match any run of bytes or any single byte, [abc], [a-z]
+ *        and [!a] match one byte of a set, and a backslash escapes the next byte.
+ *        A "**" segment matches any number of directories, including none.
+ * @param filter Optional limits, or NULL for every match (see TreeFilter)
+ *
+ * @return TreeQuery* A cursor for tree_query_next, to be released with
+ *         tree_query_free, or NULL if:
+ *         - The tree or pattern is NULL
+ *         - The pattern has more than 63 segments
+ *         - Memory allocation fails
+ *
+ * @note The search runs as tree_query_next asks for results. It only goes into
+ *       directories whose name can match their path segment, looks up plain
+ *       segments through the directory's name index instead of scanning it,
+ *       stays above filter->max_depth and skips subtrees whose total_size is
+ *       below filter->min_size. Matches come in pre-order, leaves of a
+ *       directory before its subdirectories.
+ *
+ * @warning Like tree_iter_begin the query takes no locks: the tree must not
+ *          change while it is open.
+ */
+TreeQuery *tree_query(Tree *tree, const char *pattern, const TreeFilter *filter)
+{
+    if (tree == NULL || pattern == NULL)
+        return NULL;
+
+    TreeQuery *query = calloc(1, sizeof(TreeQuery));
+    if (query == NULL)
+        return NULL;
+    query->pattern = strdup(pattern);
+    if (query->pattern == NULL)
+    {
+        free(query);
+        return NULL;
+    }
+    query->tree = tree;
+    if (filter != NULL)
+        query->filter = *filter;
+    if (!(query->filter.flags & (TREE_ITER_DIRECTORIES | TREE_ITER_LEAVES)))
+        query->filter.flags |= TREE_ITER_DIRECTORIES | TREE_ITER_LEAVES;
+
+    // Empty segments, as in "//" or a trailing '/', are skipped
+    for (char *segment = query->pattern; *segment != '\0';)
+    {
+        char *end = strchr(segment, '/');
+        size_t len = end != NULL ? (size_t)(end - segment) : strlen(segment);
+        if (len > 0)
+        {
+            if (query->count == QUERY_MAX_SEGMENTS)
+            {
+                tree_query_free(query);
+                return NULL;
+            }
+            QuerySegment *entry = &query->segments[query->count++];
+            entry->text = segment;
+            entry->len = len;
+            if (len == 2 && segment[0] == '*' && segment[1] == '*')
+                entry->kind = SEGMENT_ANY;
+            else if (memchr(segment, '*', len) || memchr(segment, '?', len) || memchr(segment, '[', len) ||
+                     memchr(segment, '\\', len))
+                entry->kind = SEGMENT_GLOB;
+            else
+                entry->kind = SEGMENT_LITERAL;
+            entry->hash = hash_name(segment, len);
+        }
+        if (end == NULL)
+            break;
+        segment = end + 1;
+    }
+
+    query->root_pending = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE) != NULL;
+    return query;
+}
+
+/**
+ * @brief Returns the next match of a query started by tree_query.
+ *
+ * @param query Cursor from tree_query
+ * @return Node* The next matching directory or leaf, or NULL once there are
+ *         no more (or memory ran out)
+ */
+Node *tree_query_next(TreeQuery *query)
+{
+    if (query == NULL)
+        return NULL;
+
+    bool want_dirs = (query->filter.flags & TREE_ITER_DIRECTORIES) != 0;
+    bool want_leaves = (query->filter.flags & TREE_ITER_LEAVES) != 0;
+    if (query->root_pending)
+    {
+        query->root_pending = false;
+        Directory *root = query->tree->root;
+        uint64_t states = query_closure(query, 1);
+        if (query_descends(query, root, states, 1) && !query_push(query, root, states, 1))
+            return NULL;
+        if (want_dirs && query_accepts(query, states) && query_size_ok(query, root->total_size))
+            return &root->base;
+    }
+
+    while (query->depth > 0)
+    {
+        QueryFrame *frame = &query->stack[query->depth - 1];
+        if (frame->leaf != NULL)
+        {
+            Leaf *leaf = frame->leaf;
+            frame->leaf = frame->literal ? NULL : leaf->next_leaf;
+            if (want_leaves && query_size_ok(query, leaf->size) &&
+                query_accepts(query, query_advance(query, frame->states, &leaf->base)))
+                return &leaf->base;
+            continue;
+        }
+        if (frame->child != NULL)
+        {
+            Directory *dir = frame->child;
+            frame->child = frame->literal ? NULL : dir->next_dir;
+            uint64_t states = query_advance(query, frame->states, &dir->base);
+            uint32_t depth = frame->depth;
+            if (states == 0)
+                continue;
+            // frame may move when the stack grows
+            if (query_descends(query, dir, states, depth + 1) && !query_push(query, dir, states, depth + 1))
+                return NULL;
+            if (want_dirs && query_accepts(query, states) && query_size_ok(query, dir->total_size))
+                return &dir->base;
+            continue;
+        }
+        query->depth--;
+    }
+    return NULL;
+}
+
+void tree_query_free(TreeQuery *query)
+{
+    if (query == NULL)
+        return;
+    free(query->stack);
+    free(query->pattern);
+    free(query);
+}
+
+/**
+ * @brief Returns the total number of files (leaves) in the tree.
+ *
+ * @param tree Pointer to the tree structure
+ *
+ * @return uint32_t Total number of files (leaves) in the tree, or 0 if:
+ *         - The tree is NULL
+ *         - The tree is empty
+ *
+ * @note The count is maintained by create_leaf, remove_leaf and remove_directory,
+ *       so this is O(1). get_directory_file_count gives the same figure for a subtree.
+ */
+uint32_t get_total_files(Tree *tree)
+{
+    if (tree == NULL || tree->root == NULL)
+        return 0;
+    return __atomic_load_n(&tree->total_files, __ATOMIC_RELAXED);
+}
+
+// Bounded min-heap of directories for tree_top_n, keyed by the total size each
+// had when it was offered so that concurrent updates cannot break the ordering
+typedef struct TopHeap
+{
+    Directory **dirs;
+    uint64_t *sizes;
+    uint32_t count;
+    uint32_t capacity;
+} TopHeap;
+
+static void top_swap(TopHeap *heap, uint32_t a, uint32_t b)
+{
+    Directory *dir = heap->dirs[a];
+    uint64_t size = heap->sizes[a];
+    heap->dirs[a] = heap->dirs[b];
+    heap->sizes[a] = heap->sizes[b];
+    heap->dirs[b] = dir;
+    heap->sizes[b] = size;
+}
+
+static void top_sift_down(TopHeap *heap, uint32_t count, uint32_t i)
+{
+    for (;;)
+    {
+        uint32_t smallest = i;
+        uint32_t left = 2 * i + 1;
+        uint32_t right = left + 1;
+        if (left < count && heap->sizes[left] < heap->sizes[smallest])
+            smallest = left;
+        if (right < count && heap->sizes[right] < heap->sizes[smallest])
+            smallest = right;
+        if (smallest == i)
+            return;
+        top_swap(heap, i, smallest);
+        i = smallest;
+    }
+}
+
+// Whether a directory of this size could still make the cut
+static inline bool top_wants(const TopHeap *heap, uint64_t size)
+{
+    return heap->count < heap->capacity || size > heap->sizes[0];
+}
+
+static void top_offer(TopHeap *heap, Directory *dir, uint64_t size)
+{
+    if (heap->count < heap->capacity)
+    {
+        uint32_t i = heap->count++;
+        heap->dirs[i] = dir;
+        heap->sizes[i] = size;
+        while (i > 0 && heap->sizes[(i - 1) / 2] > heap->sizes[i])
+        {
+            top_swap(heap, i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+    else if (size > heap->sizes[0])
+    {
+        heap->dirs[0] = dir;
+        heap->sizes[0] = size;
+        top_sift_down(heap, heap->count, 0);
+    }
+}
+
+typedef struct TopFrame
+{
+    Directory *dir;
+    uint32_t depth;
+} TopFrame;
+
+/**
+ * @brief Finds the largest directories below a directory, like du | sort -rn | head.
+ *
+ * @param tree Pointer to the tree structure
+ * @param dir Directory whose subtree is searched (NULL for the root)
+ * @param depth How many levels below dir to consider (0 for unlimited)
+ * @param out Array of at least n entries that receives the directories
+ * @param n Number of directories wanted
+ *
+ * @return uint32_t Number of directories stored in out, largest total size first
+ *         (fewer than n if the subtree has fewer directories), or 0 if:
+ *         - The tree or out is NULL, or n is 0
+ *         - Memory allocation fails
+ *
+ * @note dir itself is not reported. Sizes come from the maintained subtree totals,
+ *       and once n candidates are held a subtree is skipped as soon as its root is
+ *       no larger than the smallest of them, since nothing below it can be larger.
+ *       Ties are broken arbitrarily.
+ *
+ * @note In concurrent trees subtree removal waits for the search to finish; sizes
+ *       changed by concurrent leaf updates are read as they are at that moment.
+ */
+uint32_t tree_top_n(Tree *tree, Directory *dir, uint32_t depth, Directory **out, uint32_t n)
+{
+    if (tree == NULL || out == NULL || n == 0)
+        return 0;
+
+    bool concurrent = is_concurrent(tree);
+    if (concurrent)
+        lock_read(&tree->structure_lock);
+    if (dir == NULL)
+        dir = tree->root;
+    if (dir == NULL)
+    {
+        if (concurrent)
+            unlock_read(&tree->structure_lock);
+        return 0;
+    }
+
+    TopHeap heap = {.dirs = out, .sizes = malloc(n * sizeof(uint64_t)), .count = 0, .capacity = n};
+    TopFrame inline_stack[64];
+    TopFrame *stack = inline_stack;
+    size_t capacity = 64;
+    size_t top = 0;
+    bool failed = heap.sizes == NULL;
+
+    if (!failed)
+        stack[top++] = (TopFrame){dir, 0};
+    while (top > 0 && !failed)
+    {
+        TopFrame frame = stack[--top];
+        if (frame.dir != dir)
+        {
+            uint64_t size = get_directory_size(frame.dir);
+            if (!top_wants(&heap, size))
+                continue;
+            top_offer(&heap, frame.dir, size);
+        }
+        if (depth != 0 && frame.depth == depth)
+            continue;
+        dir_read_lock(tree, frame.dir);
+        for (Directory *child = frame.dir->first_child; child != NULL; child = child->next_dir)
+        {
+            if (!top_wants(&heap, get_directory_size(child)))
+                continue;
+            if (top == capacity)
+            {
+                TopFrame *grown = malloc(capacity * 2 * sizeof(TopFrame));
+                if (grown == NULL)
+                {
+                    failed = true;
+                    break;
+                }
+                memcpy(grown, stack, top * sizeof(TopFrame));
+                if (stack != inline_stack)
+                    free(stack);
+                stack = grown;
+                capacity *= 2;
+            }
+            stack[top++] = (TopFrame){child, frame.depth + 1};
+        }
+        dir_read_unlock(tree, frame.dir);
+    }
+    if (stack != inline_stack)
+        free(stack);
+    if (concurrent)
+        unlock_read(&tree->structure_lock);
+
+    // Heap sort: repeatedly move the smallest to the back, leaving out largest first
+    for (uint32_t end = heap.count; end > 1; end--)
+    {
+        top_swap(&heap, 0, end - 1);
+        top_sift_down(&heap, end - 1, 0);
+    }
+    free(heap.sizes);
+    return failed ? 0 : heap.count;
+}
+
+/**
+ * @brief Counts the leaves below a directory by size class.
+ *
+ * @param tree Pointer to the tree structure
+ * @param dir Directory whose subtree is counted (NULL for the root)
+ * @param bins Receives the counts: bins[0] for empty leaves and bins[i] for
+ *             leaves of at least 2^(i-1) and less than 2^i bytes
+ *
+ * @return int - 0 on success, or -1 if the tree or bins is NULL
+ *
+ * @note With TREE_OPT_SIZE_HISTOGRAM every directory keeps these counts for its
+ *       subtree, updated as leaves are created, removed and moved, so this is a
+ *       copy of TREE_HISTOGRAM_BINS counters. Otherwise, and in frozen trees, the
+ *       subtree is walked.
+ *
+ * @warning Without TREE_OPT_SIZE_HISTOGRAM the tree must not be modified during the walk.
+ */
+int tree_size_histogram(Tree *tree, Directory *dir, uint64_t bins[TREE_HISTOGRAM_BINS])
+{
+    if (tree == NULL || bins == NULL)
+        return -1;
+
+    memset(bins, 0, TREE_HISTOGRAM_BINS * sizeof(uint64_t));
+    bool concurrent = is_concurrent(tree);
+    if (concurrent)
+        lock_read(&tree->structure_lock);
+    if (dir == NULL)
+        dir = tree->root;
+    if (dir != NULL && dir->histogram != NULL)
+    {
+        for (uint32_t i = 0; i < TREE_HISTOGRAM_BINS; i++)
+            bins[i] = __atomic_load_n(&dir->histogram[i], __ATOMIC_RELAXED);
+    }
+    else if (dir != NULL)
+    {
+        // Stackless, so the depth of the subtree does not matter
+        TreeIter iter;
+        tree_iter_begin(&iter, tree, dir, TREE_ITER_LEAVES);
+        for (Node *node = tree_iter_next(&iter); node != NULL; node = tree_iter_next(&iter))
+            bins[size_bin(((Leaf *)node)->size)]++;
+    }
+    if (concurrent)
+        unlock_read(&tree->structure_lock);
+    return 0;
+}
+
+// Parallel traversal engine. Each worker owns a deque of directories; it pops
+// its own work LIFO (depth-first, cache-warm) while idle workers steal FIFO
+// from the others, which hands them the shallowest and usually largest
+// subtrees. Work is split at first_child boundaries: visiting a directory
+// pushes each of its subdirectories as a separate task.
+typedef struct PoolDeque
+{
+    pthread_mutex_t lock;
+    Directory **items; // Live tasks are items[head, tail)
+    size_t head;
+    size_t tail;
+    size_t capacity;
+} PoolDeque;
+
+typedef struct PoolJob
+{
+    Tree *tree;
+    tree_visit_fn visit;
+    void *ctx;
+    char *locals;       // One cache-line aligned scratch slot per worker
+    size_t local_size;  // Slot stride
+    size_t pending;     // Tasks pushed but not finished (atomic)
+    bool cancelled;     // Set by a visit returning false (atomic)
+    bool failed;        // A push could not allocate (atomic)
+} PoolJob;
+
+struct TreePool
+{
+    unsigned threads; // Workers including the calling thread
+    pthread_t *handles;
+    PoolDeque *deques;
+    pthread_mutex_t lock; // Guards everything below
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    PoolJob *job;
+    uint64_t generation; // Bumped for every job
+    unsigned active;     // Background workers still on the current job
+    bool shutdown;
+    pthread_mutex_t submit; // Serializes tree_parallel_visit callers
+};
+
+typedef struct PoolWorker
+{
+    TreePool *pool;
+    unsigned id;
+} PoolWorker;
+
+static bool deque_push(PoolDeque *deque, Directory *dir)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity)
+    {
+        if (deque->head > 0)
+        {
+            memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(Directory *));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        }
+        else
+        {
+            size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+            Directory **items = realloc(deque->items, capacity * sizeof(Directory *));
+            if (items == NULL)
+            {
+                pthread_mutex_unlock(&deque->lock);
+                return false;
+            }
+            deque->items = items;
+            deque->capacity = capacity;
+        }
+    }
+    deque->items[deque->tail++] = dir;
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+static Directory *deque_pop(PoolDeque *deque)
+{
+    Directory *dir = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+        dir = deque->items[--deque->tail];
+    pthread_mutex_unlock(&deque->lock);
+    return dir;
+}
+
+static Directory *deque_steal(PoolDeque *deque)
+{
+    Directory *dir = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+        dir = deque->items[deque->head++];
+    pthread_mutex_unlock(&deque->lock);
+    return dir;
+}
+
+// Visits one directory and queues its children on the worker's deque
+static void pool_run_task(PoolJob *job, PoolDeque *own, Directory *dir, void *local)
+{
+    if (!__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED))
+    {
+        dir_read_lock(job->tree, dir);
+        if (!job->visit(dir, local, job->ctx))
+        {
+            __atomic_store_n(&job->cancelled, true, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            // Push in reverse so the owner pops children in list order
+            for (Directory *child = dir->last_child; child != NULL; child = child->prev_dir)
+            {
+                __atomic_add_fetch(&job->pending, 1, __ATOMIC_RELAXED);
+                if (!deque_push(own, child))
+                {
+                    __atomic_sub_fetch(&job->pending, 1, __ATOMIC_RELAXED);
+                    __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+                    __atomic_store_n(&job->cancelled, true, __ATOMIC_RELAXED);
+                    break;
+                }
+            }
+        }
+        dir_read_unlock(job->tree, dir);
+    }
+    __atomic_sub_fetch(&job->pending, 1, __ATOMIC_RELEASE);
+}
+
+// Work loop shared by the calling thread and the background workers
+static void pool_work(TreePool *pool, PoolJob *job, unsigned id)
+{
+    PoolDeque *own = &pool->deques[id];
+    void *local = job->locals != NULL ? job->locals + (size_t)id * job->local_size : NULL;
+    unsigned victim = id;
+
+    for (;;)
+    {
+        Directory *dir = deque_pop(own);
+        for (unsigned i = 1; dir == NULL && i < pool->threads; i++)
+        {
+            victim = (victim + 1) % pool->threads;
+            if (victim != id)
+                dir = deque_steal(&pool->deques[victim]);
+        }
+
+        if (dir != NULL)
+        {
+            pool_run_task(job, own, dir, local);
+            continue;
+        }
+        if (__atomic_load_n(&job->pending, __ATOMIC_ACQUIRE) == 0)
+            return;
+        sched_yield();
+    }
+}
+
+static void *pool_thread(void *arg)
+{
+    PoolWorker *worker = arg;
+    TreePool *pool = worker->pool;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (!pool->shutdown && pool->generation == seen)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->shutdown)
+            break;
+        seen = pool->generation;
+        PoolJob *job = pool->job;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool_work(pool, job, worker->id);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->active == 0)
+            pthread_cond_signal(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(worker);
+    return NULL;
+}
+
+// Stops and joins the first 'started' workers, then frees the pool
+static void pool_shutdown(TreePool *pool, unsigned started)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned i = 0; i < started; i++)
+        pthread_join(pool->handles[i], NULL);
+    for (unsigned i = 0; i < pool->threads; i++)
+    {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].items);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->submit);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->deques);
+    free(pool->handles);
+    free(pool);
+}
+
+static void pool_destroy(TreePool *pool)
+{
+    pool_shutdown(pool, pool->threads - 1);
+}
+
+static TreePool *pool_create(unsigned threads)
+{
+    TreePool *pool = calloc(1, sizeof(TreePool));
+    if (pool == NULL)
+        return NULL;
+    pool->threads = threads;
+    pool->deques = calloc(threads, sizeof(PoolDeque));
+    pool->handles = calloc(threads - 1, sizeof(pthread_t));
+    if (pool->deques == NULL || pool->handles == NULL)
+    {
+        free(pool->deques);
+        free(pool->handles);
+        free(pool);
+        return NULL;
+    }
+    for (unsigned i = 0; i < threads; i++)
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->submit, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    // Worker 0 is whichever thread calls tree_parallel_visit
+    for (unsigned i = 1; i < threads; i++)
+    {
+        PoolWorker *worker = malloc(sizeof(PoolWorker));
+        if (worker != NULL)
+        {
+            worker->pool = pool;
+            worker->id = i;
+        }
+        if (worker == NULL || pthread_create(&pool->handles[i - 1], NULL, pool_thread, worker) != 0)
+        {
+            free(worker);
+            pool_shutdown(pool, i - 1);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/**
+ * @brief Sets how many threads parallel traversals of the tree may use.
+ *
+ * @param tree Pointer to the tree structure
+ * @param threads Total worker count including the calling thread; 0 or 1 disables the pool
+ *
+ * @return int - 0 on success, or -1 if:
+ *         - The tree is NULL
+ *         - The worker threads could not be created (the tree is left single-threaded)
+ *
+ * @note Any existing pool is joined and replaced. The pool is owned by the tree
+ *       and shut down by destroy_tree. find_leaf runs on it.
+ *
+ * @warning Must not be called while a traversal of this tree is running.
+ */
+int tree_set_parallelism(Tree *tree, unsigned threads)
+{
+    if (tree == NULL)
+        return -1;
+
+    if (tree->pool != NULL)
+    {
+        pool_destroy(tree->pool);
+        tree->pool = NULL;
+    }
+    if (threads <= 1)
+        return 0;
+
+    tree->pool = pool_create(threads);
+    return tree->pool != NULL ? 0 : -1;
+}
+
+// Single-threaded traversal with an explicit stack, in the same pre-order as
+// tree_iter_next: a directory, then each child subtree in list order. It keeps
+// its own stack because a directory's children must be listed under its lock.
+static int visit_sequential(Tree *tree, Directory *start, tree_visit_fn visit, void *local, void *ctx)
+{
+    Directory *inline_stack[64];
+    Directory **stack = inline_stack;
+    size_t capacity = 64;
+    size_t depth = 0;
+    int status = 0;
+
+    stack[depth++] = start;
+    while (depth > 0)
+    {
+        Directory *dir = stack[--depth];
+        dir_read_lock(tree, dir);
+        if (!visit(dir, local, ctx))
+        {
+            dir_read_unlock(tree, dir);
+            status = 1;
+            break;
+        }
+        for (Directory *child = dir->last_child; child != NULL; child = child->prev_dir)
+        {
+            if (depth == capacity)
+            {
+                Directory **grown = malloc(capacity * 2 * sizeof(Directory *));
+                if (grown == NULL)
+                {
+                    dir_read_unlock(tree, dir);
+                    status = -1;
+                    goto done;
+                }
+                memcpy(grown, stack, depth * sizeof(Directory *));
+                if (stack != inline_stack)
+                    free(stack);
+                stack = grown;
+                capacity *= 2;
+            }
+            stack[depth++] = child;
+        }
+        dir_read_unlock(tree, dir);
+    }
+done:
+    if (stack != inline_stack)
+        free(stack);
+    return status;
+}
+
+/**
+ * @brief Calls a visit function for every directory below start, in parallel when possible.
+ *
+ * @param tree Pointer to the tree structure
+ * @param start Directory whose subtree is traversed (NULL for the root)
+ * @param visit Called once per directory, including start; returning false cancels the traversal
+ * @param local_size Size of the per-worker scratch handed to visit (may be 0)
+ * @param reduce Called once per worker with its scratch after the traversal (can be NULL)
+ * @param result Passed to reduce as the accumulator
+ * @param ctx User context passed to visit and reduce
+ *
+ * @return int - 0 if every directory was visited, 1 if a visit cancelled the
+ *         traversal, or -1 if:
+ *         - The tree or visit function is NULL
+ *         - Memory allocation fails
+ *
+ * @note Without a pool (see tree_set_parallelism) directories are visited on the
+ *       calling thread in pre-order, children in list order. With a pool the
+ *       order is unspecified and visit runs concurrently on several threads;
+ *       after cancellation, directories already in flight may still be visited.
+ *       Per-worker scratch is zero-initialized and padded to its own cache line.
+ *
+ * @note In concurrent trees each directory is read-locked while it is visited
+ *       and subtree removal waits for the traversal to finish; leaves may still be
+ *       created and removed concurrently.
+ *
+ * @warning Apart from concurrent trees, the tree must not be modified during the
+ *          traversal. visit must not start another traversal of the same tree.
+ */
+int tree_parallel_visit(Tree *tree, Directory *start, tree_visit_fn visit, size_t local_size,
+                        tree_reduce_fn reduce, void *result, void *ctx)
+{
+    if (tree == NULL || visit == NULL)
+        return -1;
+    if (start == NULL)
+        start = tree->root;
+    if (start == NULL)
+        return 0;
+
+    TreePool *pool = tree->pool;
+    unsigned threads = pool != NULL ? pool->threads : 1;
+    size_t stride = (local_size + 63) & ~(size_t)63;
+    char *locals = NULL;
+    if (stride > 0)
+    {
+        locals = aligned_alloc(64, stride * threads);
+        if (locals == NULL)
+            return -1;
+        memset(locals, 0, stride * threads);
+    }
+
+    // Subtree removal waits for running traversals before freeing anything
+    if (is_concurrent(tree))
+        lock_read(&tree->structure_lock);
+
+    int status;
+    if (pool == NULL)
+    {
+        status = visit_sequential(tree, start, visit, locals, ctx);
+    }
+    else
+    {
+        PoolJob job = {.tree = tree, .visit = visit, .ctx = ctx, .locals = locals, .local_size = stride, .pending = 1};
+
+        pthread_mutex_lock(&pool->submit);
+        if (!deque_push(&pool->deques[0], start))
+        {
+            pthread_mutex_unlock(&pool->submit);
+            if (is_concurrent(tree))
+                unlock_read(&tree->structure_lock);
+            free(locals);
+            return -1;
+        }
+        pthread_mutex_lock(&pool->lock);
+        pool->job = &job;
+        pool->generation++;
+        pool->active = pool->threads - 1;
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+
+        pool_work(pool, &job, 0);
+
+        // Wait for every worker to leave the job before reading their scratch
+        pthread_mutex_lock(&pool->lock);
+        while (pool->active > 0)
+            pthread_cond_wait(&pool->idle, &pool->lock);
+        pool->job = NULL;
+        pthread_mutex_unlock(&pool->lock);
+        pthread_mutex_unlock(&pool->submit);
+
+        status = job.failed ? -1 : job.cancelled ? 1 : 0;
+    }
+
+    if (is_concurrent(tree))
+        unlock_read(&tree->structure_lock);
+
+    if (reduce != NULL && status >= 0)
+    {
+        for (unsigned i = 0; i < threads; i++)
+            reduce(result, locals != NULL ? locals + (size_t)i * stride : NULL, ctx);
+    }
+    free(locals);
+    return status;
+}
+
+// Binary images. save_tree writes a position-independent snapshot that
+// load_tree maps read-only and queries in place:
+//
+//   ImageHeader | ImageDir[dir_count] | ImageLeaf[leaf_count] | names | payloads
+//
+// Records refer to each other by index and to names and payloads by offset
+// into their sections, so the file can be mapped at any address. Directories
+// are stored breadth-first from the root; the children and the leaves of each
+// directory are contiguous and sorted by name, so lookups binary search.
+// The format uses the byte order of the machine that wrote it.
+//
+// Version 2 added the header's journal sequence number. Version 1 images have
+// the same sections after a header that ends just before it; they still load,
+// as containing no journal records. save_tree only writes version 2.
+#define IMAGE_MAGIC "TREEIMG1"
+#define IMAGE_VERSION 2
+#define IMAGE_NO_VALUE UINT64_MAX
+#define IMAGE_ALIGN 8
+
+typedef struct ImageHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t file_size;
+    uint32_t dir_count;
+    uint32_t leaf_count;
+    uint64_t dirs_offset;
+    uint64_t leaves_offset;
+    uint64_t names_offset;
+    uint64_t names_size;
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint64_t sequence; // Last journal record the image contains, 0 if none (version 2)
+} ImageHeader;
+
+#define IMAGE_V1_HEADER_SIZE offsetof(ImageHeader, sequence)
+
+struct ImageDir
+{
+    uint32_t name;     // Offset into the name section
+    uint16_t name_len;
+    uint16_t reserved;
+    uint32_t parent;   // Index of the parent, UINT32_MAX for the root
+    uint32_t first_child;
+    uint32_t child_count;
+    uint32_t first_leaf;
+    uint32_t leaf_count;
+    uint32_t subtree_files;
+    uint64_t total_size;
+};
+
+struct ImageLeaf
+{
+    uint32_t name;
+    uint16_t name_len;
+    uint16_t reserved;
+    uint32_t parent;
+    uint32_t reserved2;
+    uint64_t size;
+    uint64_t value; // Offset into the payload section, IMAGE_NO_VALUE if none
+};
+
+struct TreeImage
+{
+    const char *base;
+    size_t size;
+    const ImageHeader *header;
+    const ImageDir *dirs;
+    const ImageLeaf *leaves;
+    const char *names;
+    const char *data;
+    uint64_t sequence; // From the header, 0 for version 1 images
+};
+
+static int node_compare(const void *a, const void *b)
+{
+    const Node *x = *(Node *const *)a;
+    const Node *y = *(Node *const *)b;
+    return name_compare(x->name, x->name_len, y->name, y->name_len);
+}
+
+// Records for every node in image order, built before anything is written
+typedef struct ImageLayout
+{
+    Directory **dir_nodes;
+    Leaf **leaf_nodes;
+    ImageDir *dirs;
+    ImageLeaf *leaves;
+    char *names;
+    uint32_t dir_count;
+    uint32_t leaf_count;
+    uint64_t names_size;
+    uint64_t data_size;
+} ImageLayout;
+
+static void image_layout_free(ImageLayout *layout)
+{
+    free(layout->dir_nodes);
+    free(layout->leaf_nodes);
+    free(layout->dirs);
+    free(layout->leaves);
+    free(layout->names);
+    memset(layout, 0, sizeof(ImageLayout));
+}
+
+// Appends n pointers to a growable array
+static bool append_nodes(void ***array, size_t *count, size_t *capacity, void **items, size_t n)
+{
+    if (n == 0)
+        return true;
+    if (*count + n > *capacity)
+    {
+        size_t grown = *capacity ? *capacity : 64;
+        while (grown < *count + n)
+            grown *= 2;
+        void **resized = realloc(*array, grown * sizeof(void *));
+        if (resized == NULL)
+            return false;
+        *array = resized;
+        *capacity = grown;
+    }
+    memcpy(*array + *count, items, n * sizeof(void *));
+    *count += n;
+    return true;
+}
+
+/**
+ * @brief Lays out a tree in image order.
+ *
+ * @param tree Pointer to the tree structure
+ * @param layout Receives the records, names and node order; free with image_layout_free
+ * @return int 0 on success, or -1 if memory allocation fails or the image would
+ *         exceed the format's 32-bit counts and name offsets
+ *
+ * @note Directory totals are recomputed from the leaves rather than copied,
+ *       so the image is exact even if the live counters are not.
+ */
+static int image_layout_build(Tree *tree, ImageLayout *layout)
+{
+    memset(layout, 0, sizeof(ImageLayout));
+    Directory *root = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+    if (root == NULL)
+        return 0;
+
+    size_t dir_count = 0, dir_capacity = 0, leaf_count = 0, leaf_capacity = 0;
+    void **dirs = NULL, **leaves = NULL, **scratch = NULL;
+    size_t scratch_capacity = 0;
+    size_t *leaf_start = NULL;
+    size_t leaf_start_capacity = 0;
+    void *item = root;
+
+    if (!append_nodes(&dirs, &dir_count, &dir_capacity, &item, 1))
+        return -1;
+
+    // Breadth-first: appending the sorted children of dirs[i] keeps every
+    // sibling group contiguous and places children after their parent
+    for (size_t i = 0; i < dir_count; i++)
+    {
+        Directory *dir = dirs[i];
+        dir_read_lock(tree, dir);
+        // Size from the lists themselves rather than trusting the counters
+        size_t children = 0, files = 0;
+        for (Directory *child = dir->first_child; child != NULL; child = child->next_dir)
+            children++;
+        for (Leaf *leaf = dir->first_leaf; leaf != NULL; leaf = leaf->next_leaf)
+            files++;
+        size_t n = children > files ? children : files;
+        if (n > scratch_capacity)
+        {
+            void **grown = realloc(scratch, n * sizeof(void *));
+            if (grown == NULL)
+            {
+                dir_read_unlock(tree, dir);
+                goto fail;
+            }
+            scratch = grown;
+            scratch_capacity = n;
+        }
+        if (i + 1 > leaf_start_capacity)
+        {
+            size_t grown_capacity = leaf_start_capacity ? leaf_start_capacity * 2 : 64;
+            size_t *grown = realloc(leaf_start, grown_capacity * sizeof(size_t));
+            if (grown == NULL)
+            {
+                dir_read_unlock(tree, dir);
+                goto fail;
+            }
+            leaf_start = grown;
+            leaf_start_capacity = grown_capacity;
+        }
+
+        n = 0;
+        for (Directory *child = dir->first_child; child != NULL; child = child->next_dir)
+            scratch[n++] = child;
+        qsort(scratch, n, sizeof(void *), node_compare);
+        bool ok = append_nodes(&dirs, &dir_count, &dir_capacity, scratch, n);
+
+        n = 0;
+        for (Leaf *leaf = dir->first_leaf; leaf != NULL; leaf = leaf->next_leaf)
+            scratch[n++] = leaf;
+        qsort(scratch, n, sizeof(void *), node_compare);
+        leaf_start[i] = leaf_count;
+        ok = ok && append_nodes(&leaves, &leaf_count, &leaf_capacity, scratch, n);
+        dir_read_unlock(tree, dir);
+        if (!ok)
+            goto fail;
+    }
+    free(scratch);
+    scratch = NULL;
+
+    if (dir_count >= UINT32_MAX || leaf_count >= UINT32_MAX)
+        goto fail;
+    layout->dir_nodes = (Directory **)dirs;
+    layout->leaf_nodes = (Leaf **)leaves;
+    layout->dir_count = (uint32_t)dir_count;
+    layout->leaf_count = (uint32_t)leaf_count;
+    layout->dirs = calloc(dir_count, sizeof(ImageDir));
+    layout->leaves = calloc(leaf_count ? leaf_count : 1, sizeof(ImageLeaf));
+    if (layout->dirs == NULL || layout->leaves == NULL)
+    {
+        free(leaf_start);
+        image_layout_free(layout);
+        return -1;
+    }
+
+    // Names section, then the records that point into it
+    uint64_t names_size = 0;
+    for (size_t i = 0; i < dir_count; i++)
+        names_size += (uint64_t)layout->dir_nodes[i]->base.name_len + 1;
+    for (size_t i = 0; i < leaf_count; i++)
+        names_size += (uint64_t)layout->leaf_nodes[i]->base.name_len + 1;
+    if (names_size > UINT32_MAX || (layout->names = malloc(names_size ? names_size : 1)) == NULL)
+    {
+        free(leaf_start);
+        image_layout_free(layout);
+        return -1;
+    }
+    layout->names_size = names_size;
+
+    uint64_t name_offset = 0;
+    uint64_t data_offset = 0;
+    size_t next_child = 1;
+    layout->dirs[0].parent = UINT32_MAX;
+    for (size_t i = 0; i < dir_count; i++)
+    {
+        Directory *dir = layout->dir_nodes[i];
+        ImageDir *record = &layout->dirs[i];
+        record->name = (uint32_t)name_offset;
+        record->name_len = dir->base.name_len;
+        memcpy(layout->names + name_offset, dir->base.name, (size_t)dir->base.name_len + 1);
+        name_offset += (uint64_t)dir->base.name_len + 1;
+
+        record->first_child = (uint32_t)next_child;
+        record->child_count = 0;
+        for (Directory *child = dir->first_child; child != NULL; child = child->next_dir)
+            layout->dirs[next_child + record->child_count++].parent = (uint32_t)i;
+        next_child += record->child_count;
+
+        record->first_leaf = (uint32_t)leaf_start[i];
+        record->leaf_count = (uint32_t)((i + 1 < dir_count ? leaf_start[i + 1] : leaf_count) - leaf_start[i]);
+        for (uint32_t j = 0; j < record->leaf_count; j++)
+        {
+            Leaf *leaf = layout->leaf_nodes[record->first_leaf + j];
+            ImageLeaf *out = &layout->leaves[record->first_leaf + j];
+            out->name = (uint32_t)name_offset;
+            out->name_len = leaf->base.name_len;
+            memcpy(layout->names + name_offset, leaf->base.name, (size_t)leaf->base.name_len + 1);
+            name_offset += (uint64_t)leaf->base.name_len + 1;
+            out->parent = (uint32_t)i;
+            out->size = leaf->size;
+            if (leaf->value != NULL)
+            {
+                out->value = data_offset;
+                data_offset += ((uint64_t)leaf->size + IMAGE_ALIGN - 1) & ~(uint64_t)(IMAGE_ALIGN - 1);
+            }
+            else
+            {
+                out->value = IMAGE_NO_VALUE;
+            }
+            record->total_size += leaf->size;
+        }
+        record->subtree_files = record->leaf_count;
+    }
+    layout->data_size = data_offset;
+    free(leaf_start);
+
+    // Children come after their parents, so a reverse sweep rolls totals up
+    for (size_t i = dir_count; i-- > 1;)
+    {
+        ImageDir *parent = &layout->dirs[layout->dirs[i].parent];
+        parent->total_size += layout->dirs[i].total_size;
+        parent->subtree_files += layout->dirs[i].subtree_files;
+    }
+    return 0;
+
+fail:
+    free(dirs);
+    free(leaves);
+    free(scratch);
+    free(leaf_start);
+    return -1;
+}
+
+static void image_header_init(ImageHeader *header, const ImageLayout *layout)
+{
+    memset(header, 0, sizeof(ImageHeader));
+    memcpy(header->magic, IMAGE_MAGIC, sizeof(header->magic));
+    header->version = IMAGE_VERSION;
+    header->header_size = sizeof(ImageHeader);
+    header->dir_count = layout->dir_count;
+    header->leaf_count = layout->leaf_count;
+    header->dirs_offset = sizeof(ImageHeader);
+    header->leaves_offset = header->dirs_offset + (uint64_t)layout->dir_count * sizeof(ImageDir);
+    header->names_offset = header->leaves_offset + (uint64_t)layout->leaf_count * sizeof(ImageLeaf);
+    header->names_size = layout->names_size;
+    header->data_offset = (header->names_offset + layout->names_size + IMAGE_ALIGN - 1) & ~(uint64_t)(IMAGE_ALIGN - 1);
+    header->data_size = layout->data_size;
+    header->file_size = header->data_offset + layout->data_size;
+}
+
+// save_tree for an image that contains the journal up to sequence, or for a
+// journaled tree everything it has logged
+static int image_save(Tree *tree, const char *path, uint64_t sequence)
+{
+    if (tree == NULL || path == NULL)
+        return -1;
+
+    size_t path_len = strlen(path);
+    char *tmp_path = malloc(path_len + 5);
+    if (tmp_path == NULL)
+        return -1;
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+
+    // Keep every writer out until the last payload is written: the layout
+    // walks the lists unlocked and the leaves it collects must stay alive
+    versions_exclude(tree);
+    // With writers out a journaled tree holds exactly the records logged so far
+    if (tree->journal != NULL)
+        sequence = journal_sequence(tree);
+
+    int status = -1;
+    ImageLayout layout;
+    FILE *file = NULL;
+    if (image_layout_build(tree, &layout) != 0)
+        goto done;
+
+    ImageHeader header;
+    image_header_init(&header, &layout);
+    header.sequence = sequence;
+    file = fopen(tmp_path, "wb");
+    if (file == NULL)
+        goto done;
+
+    static const char padding[IMAGE_ALIGN] = {0};
+    // An empty tree has no sections, only the header
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    if (layout.dir_count > 0)
+    {
+        ok = ok && fwrite(layout.dirs, sizeof(ImageDir), layout.dir_count, file) == layout.dir_count;
+        ok = ok && fwrite(layout.leaves, sizeof(ImageLeaf), layout.leaf_count, file) == layout.leaf_count;
+        ok = ok && fwrite(layout.names, 1, layout.names_size, file) == layout.names_size;
+    }
+    uint64_t pad = header.data_offset - (header.names_offset + layout.names_size);
+    ok = ok && fwrite(padding, 1, pad, file) == pad;
+    for (uint32_t i = 0; ok && i < layout.leaf_count; i++)
+    {
+        Leaf *leaf = layout.leaf_nodes[i];
+        if (leaf->value == NULL)
+            continue;
+        uint64_t padded = ((uint64_t)leaf->size + IMAGE_ALIGN - 1) & ~(uint64_t)(IMAGE_ALIGN - 1);
+        ok = fwrite(leaf->value, 1, leaf->size, file) == leaf->size &&
+             fwrite(padding, 1, padded - leaf->size, file) == padded - leaf->size;
+    }
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    file = NULL;
+    if (ok && rename(tmp_path, path) == 0)
+        status = 0;
+    else
+        remove(tmp_path);
+
+done:
+    if (file != NULL)
+    {
+        fclose(file);
+        remove(tmp_path);
+    }
+    versions_include(tree);
+    image_layout_free(&layout);
+    free(tmp_path);
+    return status;
+}
+
+/**
+ * @brief Writes a binary image of the tree to a file.
+ *
+ * @param tree Pointer to the tree structure
+ * @param path File to write; it is replaced atomically
+ *
+ * @return int - 0 on success, or -1 if:
+ *         - Any input parameter is NULL
+ *         - Memory allocation fails
+ *         - The file cannot be written
+ *
+ * @note Leaf payloads are stored inline: a leaf with a non-NULL value is taken
+ *       to point at 'size' bytes, which are copied into the image. The image is
+ *       written to "<path>.tmp", synced and renamed over path, so readers never
+ *       see a partial file. In concurrent trees every mutation waits for the save;
+ *       lookups and traversals do not. The image of a journaled tree records the
+ *       last journal sequence number it contains, so tree_journal_open does not
+ *       replay those records over it.
+ */
+int save_tree(Tree *tree, const char *path)
+{
+    return image_save(tree, path, 0);
+}
+
+// Checks that the header describes sections lying inside the image. Only the
+// fields of the header's own version may be read.
+static bool image_header_valid(const ImageHeader *header, size_t size)
+{
+    if (size < IMAGE_V1_HEADER_SIZE || memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0)
+        return false;
+    size_t header_size = header->version == IMAGE_VERSION ? sizeof(ImageHeader)
+                         : header->version == 1       ? IMAGE_V1_HEADER_SIZE
+                                                      : 0;
+    if (header_size == 0 || size < header_size || header->header_size != header_size || header->file_size != size)
+        return false;
+    return header->dirs_offset == header_size &&
+           header->leaves_offset == header->dirs_offset + (uint64_t)header->dir_count * sizeof(ImageDir) &&
+           header->names_offset == header->leaves_offset + (uint64_t)header->leaf_count * sizeof(ImageLeaf) &&
+           header->names_offset + header->names_size <= header->data_offset &&
+           header->data_offset + header->data_size == size;
+}
+
+/**
+ * @brief Maps a binary image written by save_tree.
+ *
+ * @param path File to load
+ *
+ * @return TreeImage* Read-only image to query with the image_* functions, or NULL if:
+ *         - path is NULL
+ *         - The file cannot be opened or mapped
+ *         - The file is not a valid image
+ *
+ * @note Loading maps the file and checks its header; nothing is allocated per
+ *       node and pages are faulted in as queries touch them. The image stays
+ *       valid until unload_tree, independently of any Tree. Images in the
+ *       older version 1 format, written before journaling, load as well.
+ *
+ * @warning Only the header is validated; the records are trusted to come from save_tree.
+ */
+TreeImage *load_tree(const char *path)
+{
+    if (path == NULL)
+        return NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)IMAGE_V1_HEADER_SIZE)
+    {
+        close(fd);
+        return NULL;
+    }
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    const ImageHeader *header = base;
+    TreeImage *image = malloc(sizeof(TreeImage));
+    if (image == NULL || !image_header_valid(header, (size_t)st.st_size))
+    {
+        free(image);
+        munmap(base, (size_t)st.st_size);
+        return NULL;
+    }
+    image->base = base;
+    image->size = (size_t)st.st_size;
+    image->header = header;
+    image->dirs = (const ImageDir *)(image->base + header->dirs_offset);
+    image->leaves = (const ImageLeaf *)(image->base + header->leaves_offset);
+    image->names = image->base + header->names_offset;
+    image->data = image->base + header->data_offset;
+    image->sequence = header->version >= 2 ? header->sequence : 0;
+    return image;
+}
+
+void unload_tree(TreeImage *image)
+{
+    if (image == NULL)
+        return;
+    munmap((void *)image->base, image->size);
+    free(image);
+}
+
+const ImageDir *image_root(const TreeImage *image)
+{
+    if (image == NULL || image->header->dir_count == 0)
+        return NULL;
+    return &image->dirs[0];
+}
+
+// Binary search of a sorted sibling group for a directory name
+static const ImageDir *image_child_directory(const TreeImage *image, const ImageDir *dir, const char *name, size_t len)
+{
+    uint32_t low = dir->first_child, high = dir->first_child + dir->child_count;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        const ImageDir *child = &image->dirs[mid];
+        int cmp = name_compare(name, len, image->names + child->name, child->name_len);
+        if (cmp == 0)
+            return child;
+        if (cmp < 0)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return NULL;
+}
+
+static const ImageLeaf *image_child_leaf(const TreeImage *image, const ImageDir *dir, const char *name, size_t len)
+{
+    uint32_t low = dir->first_leaf, high = dir->first_leaf + dir->leaf_count;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        const ImageLeaf *leaf = &image->leaves[mid];
+        int cmp = name_compare(name, len, image->names + leaf->name, leaf->name_len);
+        if (cmp == 0)
+            return leaf;
+        if (cmp < 0)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Searches an image for a directory by path, like find_directory.
+ *
+ * @param image Image from load_tree
+ * @param path Path below the root, e.g. "/hello/world"; "/" names the root
+ *
+ * @return const ImageDir* The directory record inside the mapping, or NULL if
+ *         any input parameter is NULL or the directory does not exist
+ *
+ * @note Each component is a binary search over the sorted children of the
+ *       current directory. Nothing is allocated.
+ */
+const ImageDir *image_find_directory(const TreeImage *image, const char *path)
+{
+    if (image == NULL || path == NULL || *path == '\0')
+        return NULL;
+
+    const ImageDir *current = image_root(image);
+    const char *cursor = path;
+    PathSlice component;
+    while (current != NULL && path_next(&cursor, &component))
+        current = image_child_directory(image, current, component.ptr, component.len);
+    return current;
+}
+
+/**
+ * @brief Searches an image subtree for a leaf by bare name, like find_leaf.
+ *
+ * @param image Image from load_tree
+ * @param start Directory to search from (NULL for the root)
+ * @param name The name of the leaf to search for
+ *
+ * @return const ImageLeaf* The first match, or NULL if not found or if memory
+ *         allocation fails
+ *
+ * @note Depth-first like find_leaf, but siblings are visited in name order
+ *       rather than insertion order. Each directory is a binary search.
+ */
+const ImageLeaf *image_find_leaf(const TreeImage *image, const ImageDir *start, const char *name)
+{
+    if (image == NULL || name == NULL)
+        return NULL;
+    if (start == NULL)
+        start = image_root(image);
+    if (start == NULL)
+        return NULL;
+
+    size_t len = strlen(name);
+    uint32_t inline_stack[64];
+    uint32_t *stack = inline_stack;
+    size_t capacity = 64, depth = 0;
+    const ImageLeaf *found = NULL;
+
+    stack[depth++] = (uint32_t)(start - image->dirs);
+    while (depth > 0 && found == NULL)
+    {
+        const ImageDir *dir = &image->dirs[stack[--depth]];
+        found = image_child_leaf(image, dir, name, len);
+        if (depth + dir->child_count > capacity)
+        {
+            size_t grown_capacity = capacity;
+            while (grown_capacity < depth + dir->child_count)
+                grown_capacity *= 2;
+            uint32_t *grown = malloc(grown_capacity * sizeof(uint32_t));
+            if (grown == NULL)
+                break;
+            memcpy(grown, stack, depth * sizeof(uint32_t));
+            if (stack != inline_stack)
+                free(stack);
+            stack = grown;
+            capacity = grown_capacity;
+        }
+        // Push in reverse so children pop in name order
+        for (uint32_t i = dir->child_count; i-- > 0;)
+            stack[depth++] = dir->first_child + i;
+    }
+    if (stack != inline_stack)
+        free(stack);
+    return found;
+}
+
+/**
+ * @brief Looks up a leaf in an image by its full path, like find_leaf_by_path.
+ *
+ * @param image Image from load_tree
+ * @param path Full path below the root, e.g. "/logs/app/current.log"
+ * @return const ImageLeaf* The leaf record, or NULL if it does not exist
+ */
+const ImageLeaf *image_find_leaf_by_path(const TreeImage *image, const char *path)
+{
+    if (image == NULL || path == NULL)
+        return NULL;
+
+    const ImageDir *dir = image_root(image);
+    const char *cursor = path;
+    PathSlice component;
+    if (dir == NULL || !path_next(&cursor, &component))
+        return NULL;
+    for (;;)
+    {
+        PathSlice next;
+        if (!path_next(&cursor, &next))
+            break;
+        dir = image_child_directory(image, dir, component.ptr, component.len);
+        if (dir == NULL)
+            return NULL;
+        component = next;
+    }
+    return image_child_leaf(image, dir, component.ptr, component.len);
+}
+
+const char *image_dir_name(const TreeImage *image, const ImageDir *dir)
+{
+    if (image == NULL || dir == NULL)
+        return NULL;
+    return image->names + dir->name;
+}
+
+const char *image_leaf_name(const TreeImage *image, const ImageLeaf *leaf)
+{
+    if (image == NULL || leaf == NULL)
+        return NULL;
+    return image->names + leaf->name;
+}
+
+const ImageDir *image_dir_parent(const TreeImage *image, const ImageDir *dir)
+{
+    if (image == NULL || dir == NULL || dir->parent == UINT32_MAX)
+        return NULL;
+    return &image->dirs[dir->parent];
+}
+
+const ImageDir *image_leaf_parent(const TreeImage *image, const ImageLeaf *leaf)
+{
+    if (image == NULL || leaf == NULL)
+        return NULL;
+    return &image->dirs[leaf->parent];
+}
+
+uint64_t image_dir_size(const ImageDir *dir)
+{
+    if (dir == NULL)
+        return 0;
+    return dir->total_size;
+}
+
+uint32_t image_dir_file_count(const ImageDir *dir)
+{
+    if (dir == NULL)
+        return 0;
+    return dir->subtree_files;
+}
+
+uint32_t image_dir_count(const ImageDir *dir)
+{
+    if (dir == NULL)
+        return 0;
+    return dir->child_count;
+}
+
+uint64_t image_leaf_size(const ImageLeaf *leaf)
+{
+    if (leaf == NULL)
+        return 0;
+    return leaf->size;
+}
+
+// Returns the payload stored for a leaf (leaf_size bytes), or NULL if it had no value
+const void *image_leaf_value(const TreeImage *image, const ImageLeaf *leaf)
+{
+    if (image == NULL || leaf == NULL || leaf->value == IMAGE_NO_VALUE)
+        return NULL;
+    return image->data + leaf->value;
+}
+
+uint32_t image_total_directories(const TreeImage *image)
+{
+    if (image == NULL)
+        return 0;
+    return image->header->dir_count;
+}
+
+uint32_t image_total_files(const TreeImage *image)
+{
+    if (image == NULL)
+        return 0;
+    return image->header->leaf_count;
+}
+
+// Journal. tree_journal_open restores a tree from its last image and attaches an
+// append-only log of every later mutation:
+//
+//   JournalHeader | JournalRecord path name value | JournalRecord path name value | ...
+//
+// Records name nodes by path, so they replay against any tree of the same shape,
+// and carry a sequence number and a checksum; replay stops at the first torn or
+// corrupt record and the log is cut back to it. Records are appended to a memory
+// buffer under the locks of the mutation itself, which keeps them in an order that
+// replays, and written out afterwards. While one thread writes or syncs, others
+// append to the second buffer, so one fsync commits a whole group of mutations.
+// Compaction seals the log as "<journal>.old", starts a fresh one and, off the
+// mutating threads, replays the image plus the sealed log into a private tree
+// whose image replaces the old one. Images record the last sequence number they
+// contain, so a crash at any point never applies a record twice.
+#define JOURNAL_MAGIC "TREEJNL1"
+#define JOURNAL_VERSION 1
+#define JOURNAL_NO_VALUE UINT64_MAX
+#define JOURNAL_BUFFER (64 * 1024)
+
+typedef struct JournalHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+} JournalHeader;
+
+typedef struct JournalRecord
+{
+    uint32_t checksum; // FNV-1a of the rest of the record, payload included
+    uint32_t op;       // JOURNAL_*
+    uint64_t sequence;
+    uint32_t path_len;
+    uint32_t name_len;
+    uint64_t size;      // Leaf size for JOURNAL_CREATE and JOURNAL_UPDATE
+    uint64_t value_len; // Bytes of value after the name, JOURNAL_NO_VALUE for a NULL value
+} JournalRecord;
+
+struct TreeJournal
+{
+    pthread_mutex_t lock; // Guards the buffers and counters
+    pthread_mutex_t io;   // Serializes writing, syncing and sealing the file
+    char *buffer;         // Records not written yet
+    size_t used;
+    size_t capacity;
+    char *spare; // The buffer being written, while appends go to the other one
+    size_t spare_capacity;
+    uint64_t sequence;     // Last sequence number handed out
+    uint64_t synced;       // Last sequence number known to be durable
+    uint64_t appended;     // Bytes appended so far
+    uint64_t synced_bytes; // Bytes of those known to be durable
+    uint64_t file_bytes;   // Size of the current log file
+    int fd;
+    bool failed;     // A record was lost: the log no longer matches the tree
+    bool compacting; // A compaction holds the sealed log
+    bool compactor_started;
+    pthread_cond_t idle; // Signaled when compacting is cleared
+    pthread_t compactor;
+    TreeJournalConfig config;
+    char *image_path;
+    char *journal_path;
+    char *sealed_path;
+};
+
+static bool journal_reserve(TreeJournal *journal, size_t size)
+{
+    if (journal->used + size <= journal->capacity)
+        return true;
+    size_t capacity = journal->capacity ? journal->capacity : JOURNAL_BUFFER;
+    while (capacity < journal->used + size)
+        capacity *= 2;
+    char *grown = realloc(journal->buffer, capacity);
+    if (grown == NULL)
+        return false;
+    journal->buffer = grown;
+    journal->capacity = capacity;
+    return true;
+}
+
+// Appends one record: the path of node (empty for NULL), then target's path or
+// name, then value. The caller holds the locks that order this mutation.
+static void journal_log(Tree *tree, uint32_t op, Node *node, Node *target, const char *name, const void *value,
+                        uint64_t size)
+{
+    TreeJournal *journal = tree->journal;
+    if (journal == NULL)
+        return;
+
+    size_t path_len = node != NULL ? node_path_length(node) : 0;
+    size_t name_len = target != NULL ? node_path_length(target) : name != NULL ? strlen(name) : 0;
+    size_t value_len = value != NULL ? (size_t)size : 0;
+    size_t total = sizeof(JournalRecord) + path_len + name_len + value_len;
+    JournalRecord record = {.op = op,
+                            .path_len = (uint32_t)path_len,
+                            .name_len = (uint32_t)name_len,
+                            .size = size,
+                            .value_len = value != NULL ? size : JOURNAL_NO_VALUE};
+
+    pthread_mutex_lock(&journal->lock);
+    // The spare byte takes node_path_write's terminator
+    if (!journal_reserve(journal, total + 1))
+    {
+        journal->failed = true;
+        pthread_mutex_unlock(&journal->lock);
+        return;
+    }
+    char *out = journal->buffer + journal->used;
+    char *cursor = out + sizeof(JournalRecord);
+    if (node != NULL)
+        node_path_write(node, cursor, path_len);
+    cursor += path_len;
+    if (target != NULL)
+        node_path_write(target, cursor, name_len);
+    else if (name_len > 0)
+        memcpy(cursor, name, name_len);
+    cursor += name_len;
+    if (value_len > 0)
+        memcpy(cursor, value, value_len);
+
+    record.sequence = ++journal->sequence;
+    memcpy(out, &record, sizeof(record));
+    record.checksum = hash_name(out + sizeof(uint32_t), total - sizeof(uint32_t));
+    memcpy(out, &record.checksum, sizeof(uint32_t));
+    journal->used += total;
+    journal->appended += total;
+    pthread_mutex_unlock(&journal->lock);
+}
+
+static bool journal_write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, data, len);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    return true;
+}
+
+// Writes the buffered records out and, with sync, makes everything appended so
+// far durable. The caller holds journal->io.
+static void journal_flush_locked(TreeJournal *journal, bool sync)
+{
+    pthread_mutex_lock(&journal->lock);
+    char *data = journal->buffer;
+    size_t used = journal->used;
+    size_t capacity = journal->capacity;
+    uint64_t sequence = journal->sequence;
+    uint64_t appended = journal->appended;
+    journal->buffer = journal->spare;
+    journal->capacity = journal->spare_capacity;
+    journal->used = 0;
+    journal->spare = data;
+    journal->spare_capacity = capacity;
+    pthread_mutex_unlock(&journal->lock);
+
+    bool ok = journal_write_all(journal->fd, data, used);
+    if (ok && sync && journal->synced < sequence)
+        ok = fdatasync(journal->fd) == 0;
+
+    pthread_mutex_lock(&journal->lock);
+    journal->file_bytes += used;
+    if (!ok)
+    {
+        journal->failed = true;
+    }
+    else if (sync)
+    {
+        journal->synced = sequence;
+        journal->synced_bytes = appended;
+    }
+    pthread_mutex_unlock(&journal->lock);
+}
+
+static int journal_compact_start(TreeJournal *journal, bool wait);
+
+// Last sequence number handed out; records up to it are reflected in the tree
+static uint64_t journal_sequence(Tree *tree)
+{
+    TreeJournal *journal = tree->journal;
+    pthread_mutex_lock(&journal->lock);
+    uint64_t sequence = journal->sequence;
+    pthread_mutex_unlock(&journal->lock);
+    return sequence;
+}
+
+// Called by every mutating function once it has released its locks: writes and
+// syncs the buffer when the group commit settings say so
+static void journal_commit(Tree *tree)
+{
+    TreeJournal *journal = tree->journal;
+    if (journal == NULL)
+        return;
+
+    const TreeJournalConfig *config = &journal->config;
+    pthread_mutex_lock(&journal->lock);
+    bool sync = (config->sync_records != 0 && journal->sequence - journal->synced >= config->sync_records) ||
+                (config->sync_bytes != 0 && journal->appended - journal->synced_bytes >= config->sync_bytes);
+    bool write = sync || journal->used >= JOURNAL_BUFFER;
+    bool compact = config->compact_bytes != 0 && !journal->compacting && journal->file_bytes >= config->compact_bytes;
+    pthread_mutex_unlock(&journal->lock);
+
+    if (write)
+    {
+        pthread_mutex_lock(&journal->io);
+        journal_flush_locked(journal, sync);
+        pthread_mutex_unlock(&journal->io);
+    }
+    if (compact)
+        journal_compact_start(journal, false);
+}
+
+// Creates an empty log file, replacing any file at path
+static int journal_create(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.header_size = sizeof(JournalHeader);
+    if (!journal_write_all(fd, (const char *)&header, sizeof(header)) || fdatasync(fd) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Replayed values are malloc'd copies of the logged bytes, except where a
+// TREE_OPT_INLINE_VALUES leaf copies them into itself anyway
+static bool journal_copies(Tree *tree, const void *data, uint64_t size)
+{
+    return data != NULL && !((tree->options & TREE_OPT_INLINE_VALUES) && size <= TREE_INLINE_VALUE_MAX);
+}
+
+// Creates (parent) or updates (leaf) a leaf from logged bytes; -1 if the copy
+// cannot be made or the tree refuses the leaf
+static int journal_apply_value(Tree *tree, Directory *parent, Leaf *leaf, const char *name, const void *data,
+                               uint64_t size)
+{
+    void *value = (void *)data;
+    if (journal_copies(tree, data, size))
+    {
+        value = malloc(size > 0 ? (size_t)size : 1);
+        if (value == NULL)
+            return -1;
+        memcpy(value, data, (size_t)size);
+    }
+    Leaf *result = parent != NULL ? create_leaf(tree, parent, name, value, size) : update_leaf(tree, leaf, value, size);
+    if (result == NULL)
+    {
+        if (value != data)
+            free(value);
+        return -1;
+    }
+    return 0;
+}
+
+// Applies one record. Records are only logged for mutations that succeeded, and
+// replay starts from the state they were logged against, so every step has to
+// resolve and succeed again; -1 means the log does not match the tree.
+static int journal_apply(Tree *tree, const JournalRecord *record, const char *path, const char *name,
+                         const char *value)
+{
+    Directory *dir = NULL;
+    Directory *target = NULL;
+    Leaf *leaf = NULL;
+    Node *node = NULL;
+    switch (record->op)
+    {
+    case JOURNAL_MKDIR:
+        if (*path != '\0' && (dir = find_directory(tree, path)) == NULL)
+            return -1;
+        return create_directory(tree, dir, name) != NULL ? 0 : -1;
+    case JOURNAL_CREATE:
+        if ((dir = find_directory(tree, path)) == NULL)
+            return -1;
+        return journal_apply_value(tree, dir, NULL, name, value, record->size);
+    case JOURNAL_UPDATE:
+        if ((leaf = find_leaf_by_path(tree, path)) == NULL)
+            return -1;
+        return journal_apply_value(tree, NULL, leaf, NULL, value, record->size);
+    case JOURNAL_RMDIR:
+        if ((dir = find_directory(tree, path)) == NULL)
+            return -1;
+        return remove_directory(tree, dir);
+    case JOURNAL_UNLINK:
+        if ((leaf = find_leaf_by_path(tree, path)) == NULL)
+            return -1;
+        return remove_leaf(tree, leaf);
+    case JOURNAL_MOVE_DIR:
+        if ((dir = find_directory(tree, path)) == NULL || (target = find_directory(tree, name)) == NULL)
+            return -1;
+        return move_directory(tree, dir, target);
+    case JOURNAL_MOVE_LEAF:
+        if ((leaf = find_leaf_by_path(tree, path)) == NULL || (target = find_directory(tree, name)) == NULL)
+            return -1;
+        return move_leaf(tree, leaf, target);
+    case JOURNAL_RENAME_DIR:
+    case JOURNAL_RENAME_LEAF:
+        if (value == NULL || record->value_len >= 256)
+            return -1;
+        if (*path == '\0')
+        {
+            node = record->op == JOURNAL_RENAME_DIR && tree->root != NULL ? &tree->root->base : NULL;
+        }
+        else if ((dir = find_directory(tree, path)) != NULL)
+        {
+            size_t len = (size_t)record->value_len;
+            uint32_t hash = hash_name(value, len);
+            node = record->op == JOURNAL_RENAME_DIR ? (Node *)find_child_directory(dir, value, len, hash)
+                                                    : (Node *)find_child_leaf(dir, value, len, hash);
+        }
+        if (node == NULL)
+            return -1;
+        return rename_node(tree, node, name);
+    default:
+        return -1;
+    }
+}
+
+/**
+ * @brief Replays the log at path into tree.
+ *
+ * @param sequence Records up to this sequence number are skipped; raised to the last one applied
+ * @param valid If not NULL, receives the offset just past the last intact record,
+ *              or 0 if the file is missing or shorter than its header
+ * @return 0 on success (a missing file is an empty log), or -1 if the file cannot
+ *         be read, is not a log, or memory allocation fails
+ */
+static int journal_replay(Tree *tree, const char *path, uint64_t *sequence, off_t *valid)
+{
+    if (valid != NULL)
+        *valid = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size < sizeof(JournalHeader))
+    {
+        close(fd);
+        return 0;
+    }
+    char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return -1;
+
+    JournalHeader header;
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 || header.version != JOURNAL_VERSION ||
+        header.header_size != sizeof(JournalHeader))
+    {
+        munmap(base, size);
+        return -1;
+    }
+
+    int status = 0;
+    char *scratch = NULL;
+    size_t scratch_size = 0;
+    size_t offset = sizeof(JournalHeader);
+    while (size - offset >= sizeof(JournalRecord))
+    {
+        JournalRecord record;
+        memcpy(&record, base + offset, sizeof(record));
+        size_t avail = size - offset - sizeof(record);
+        uint64_t value_len = record.value_len == JOURNAL_NO_VALUE ? 0 : record.value_len;
+        if (record.path_len > avail || record.name_len > avail - record.path_len ||
+            value_len > avail - record.path_len - record.name_len)
+            break;
+        size_t total = sizeof(record) + record.path_len + record.name_len + (size_t)value_len;
+        if (hash_name(base + offset + sizeof(uint32_t), total - sizeof(uint32_t)) != record.checksum)
+            break;
+
+        if (record.sequence > *sequence)
+        {
+            // Path and name get terminators in a copy; the value is used in place
+            size_t need = (size_t)record.path_len + record.name_len + 2;
+            if (need > scratch_size)
+            {
+                char *grown = realloc(scratch, need);
+                if (grown == NULL)
+                {
+                    status = -1;
+                    break;
+                }
+                scratch = grown;
+                scratch_size = need;
+            }
+            const char *payload = base + offset + sizeof(record);
+            memcpy(scratch, payload, record.path_len);
+            scratch[record.path_len] = '\0';
+            char *name = scratch + record.path_len + 1;
+            memcpy(name, payload + record.path_len, record.name_len);
+            name[record.name_len] = '\0';
+            const char *value =
+                record.value_len == JOURNAL_NO_VALUE ? NULL : payload + record.path_len + record.name_len;
+            if (journal_apply(tree, &record, scratch, name, value) != 0)
+            {
+                status = -1;
+                break;
+            }
+            *sequence = record.sequence;
+        }
+        offset += total;
+    }
+    if (valid != NULL)
+        *valid = (off_t)offset;
+    free(scratch);
+    munmap(base, size);
+    return status;
+}
+
+// Rebuilds the empty tree from the image at path, if there is one, and reports
+// the last journal sequence number it contains
+static int journal_load_image(Tree *tree, const char *path, uint64_t *sequence)
+{
+    if (access(path, F_OK) != 0)
+        return errno == ENOENT ? 0 : -1;
+    TreeImage *image = load_tree(path);
+    if (image == NULL)
+        return -1;
+
+    *sequence = image->sequence;
+    uint32_t dir_count = image->header->dir_count;
+    Directory **dirs = malloc((dir_count > 0 ? dir_count : 1) * sizeof(Directory *));
+    int status = dirs != NULL ? 0 : -1;
+    // Parents come before their children, the root first
+    for (uint32_t i = 0; status == 0 && i < dir_count; i++)
+    {
+        const ImageDir *record = &image->dirs[i];
+        dirs[i] = create_directory(tree, i > 0 ? dirs[record->parent] : NULL, image->names + record->name);
+        if (dirs[i] == NULL)
+            status = -1;
+    }
+    for (uint32_t i = 0; status == 0 && i < image->header->leaf_count; i++)
+    {
+        const ImageLeaf *record = &image->leaves[i];
+        const void *data = image_leaf_value(image, record);
+        void *value = (void *)data;
+        if (journal_copies(tree, data, record->size))
+        {
+            value = malloc(record->size > 0 ? (size_t)record->size : 1);
+            if (value == NULL)
+            {
+                status = -1;
+                break;
+            }
+            memcpy(value, data, (size_t)record->size);
+        }
+        if (create_leaf(tree, dirs[record->parent], image->names + record->name, value, record->size) == NULL)
+        {
+            if (value != data)
+                free(value);
+            status = -1;
+        }
+    }
+    free(dirs);
+    unload_tree(image);
+    return status;
+}
+
+// Gives up the compacting flag and wakes tree_journal_close if it is waiting for it
+static void journal_compact_done(TreeJournal *journal)
+{
+    pthread_mutex_lock(&journal->lock);
+    journal->compacting = false;
+    pthread_cond_broadcast(&journal->idle);
+    pthread_mutex_unlock(&journal->lock);
+}
+
+// Builds a fresh image from the current one plus the sealed log, then drops the log
+static int journal_compact_run(TreeJournal *journal)
+{
+    Tree scratch;
+    init_tree_ex(&scratch, NULL, free, TREE_OPT_ARENA);
+    uint64_t sequence = 0;
+    int status = journal_load_image(&scratch, journal->image_path, &sequence);
+    if (status == 0)
+        status = journal_replay(&scratch, journal->sealed_path, &sequence, NULL);
+    if (status == 0)
+        status = image_save(&scratch, journal->image_path, sequence);
+    if (status == 0 && unlink(journal->sealed_path) != 0 && errno != ENOENT)
+        status = -1;
+    destroy_tree(&scratch);
+    journal_compact_done(journal);
+    return status;
+}
+
+static void *journal_compact_thread(void *arg)
+{
+    journal_compact_run(arg);
+    return NULL;
+}
+
+// Moves the log aside as the sealed log and starts an empty one. A sealed log
+// left by a failed compaction is kept instead, for this compaction to retry.
+static int journal_seal(TreeJournal *journal)
+{
+    int status = 0;
+    pthread_mutex_lock(&journal->io);
+    journal_flush_locked(journal, true);
+    if (access(journal->sealed_path, F_OK) != 0)
+    {
+        int fd = -1;
+        if (rename(journal->journal_path, journal->sealed_path) == 0)
+            fd = journal_create(journal->journal_path);
+        if (fd < 0)
+        {
+            // Appends carry on into the old file, under whichever name it has
+            status = -1;
+        }
+        else
+        {
+            close(journal->fd);
+            journal->fd = fd;
+            pthread_mutex_lock(&journal->lock);
+            journal->file_bytes = sizeof(JournalHeader);
+            pthread_mutex_unlock(&journal->lock);
+        }
+    }
+    pthread_mutex_unlock(&journal->io);
+    return status;
+}
+
+static int journal_compact_start(TreeJournal *journal, bool wait)
+{
+    pthread_mutex_lock(&journal->lock);
+    bool busy = journal->compacting;
+    journal->compacting = true;
+    pthread_mutex_unlock(&journal->lock);
+    if (busy)
+        return 1;
+
+    // Only the holder of the compacting flag touches the compactor thread
+    if (journal->compactor_started)
+    {
+        pthread_join(journal->compactor, NULL);
+        journal->compactor_started = false;
+    }
+    if (journal_seal(journal) != 0)
+    {
+        journal_compact_done(journal);
+        return -1;
+    }
+    if (!wait && pthread_create(&journal->compactor, NULL, journal_compact_thread, journal) == 0)
+    {
+        journal->compactor_started = true;
+        return 0;
+    }
+    return journal_compact_run(journal);
+}
+
+static void journal_free(TreeJournal *journal)
+{
+    pthread_mutex_destroy(&journal->lock);
+    pthread_mutex_destroy(&journal->io);
+    pthread_cond_destroy(&journal->idle);
+    free(journal->buffer);
+    free(journal->spare);
+    free(journal->image_path);
+    free(journal->journal_path);
+    free(journal->sealed_path);
+    free(journal);
+}
+
+static char *journal_strdup(const char *text, const char *suffix)
+{
+    size_t len = strlen(text);
+    size_t suffix_len = strlen(suffix);
+    char *copy = malloc(len + suffix_len + 1);
+    if (copy != NULL)
+    {
+        memcpy(copy, text, len);
+        memcpy(copy + len, suffix, suffix_len + 1);
+    }
+    return copy;
+}
+
+/**
+ * @brief Restores a tree from its image and journal and starts journaling it.
+ *
+ * @param tree An empty, mutable tree from init_tree or init_tree_ex
+ * @param image Image file the journal is compacted into (need not exist yet)
+ * @param journal Log file for the mutations (need not exist yet)
+ * @param config Group commit and compaction settings (NULL for the defaults, all zero)
+ *
+ * @return int - 0 on success, or -1 if:
+ *         - Any of tree, image or journal is NULL
+ *         - The tree is frozen, already has a journal or is not empty
+ *         - A file exists but cannot be read or is damaged, other than a torn
+ *           final record in a log, which is dropped
+ *         - The journal cannot be created or opened
+ *         - Memory allocation fails
+ *
+ * @note The tree is loaded from image, then the records not in it are replayed,
+ *       first from "<journal>.old" (left by an interrupted compaction) and then
+ *       from journal. Restored values are malloc'd copies of the saved bytes,
+ *       and are handed to the tree's destroy function like any other value;
+ *       with TREE_OPT_INLINE_VALUES small ones are copied into their leaves. As
+ *       in save_tree, a leaf with a non-NULL value is taken to point at 'size'
+ *       bytes.
+ *
+ * @note Afterwards create, remove, move, rename and update_leaf calls append a
+ *       record each. Records are written to the file in 64 KiB batches and made
+ *       durable by tree_journal_sync, tree_journal_close, or when config's
+ *       sync_records or sync_bytes are reached; concurrent mutations that arrive
+ *       while a sync is in progress share the next one. Once the log reaches
+ *       config's compact_bytes, tree_journal_compact runs in the background.
+ *
+ * @warning On failure the tree may hold part of the restored state; destroy it.
+ *          Names containing '/' cannot be replayed.
+ */
+int tree_journal_open(Tree *tree, const char *image, const char *journal, const TreeJournalConfig *config)
+{
+    if (tree == NULL || image == NULL || journal == NULL || tree->journal != NULL || tree->frozen != NULL ||
+        tree->root != NULL)
+        return -1;
+
+    TreeJournal *state = calloc(1, sizeof(TreeJournal));
+    if (state == NULL)
+        return -1;
+    pthread_mutex_init(&state->lock, NULL);
+    pthread_mutex_init(&state->io, NULL);
+    pthread_cond_init(&state->idle, NULL);
+    state->fd = -1;
+    if (config != NULL)
+        state->config = *config;
+    state->image_path = journal_strdup(image, "");
+    state->journal_path = journal_strdup(journal, "");
+    state->sealed_path = journal_strdup(journal, ".old");
+
+    uint64_t sequence = 0;
+    off_t valid = 0;
+    int status = state->image_path && state->journal_path && state->sealed_path ? 0 : -1;
+    if (status == 0)
+        status = journal_load_image(tree, image, &sequence);
+    if (status == 0)
+        status = journal_replay(tree, state->sealed_path, &sequence, NULL);
+    if (status == 0)
+        status = journal_replay(tree, journal, &sequence, &valid);
+    if (status == 0)
+    {
+        if (valid == 0)
+        {
+            state->fd = journal_create(journal);
+        }
+        else
+        {
+            // Cut off a torn final record before appending after it
+            state->fd = open(journal, O_WRONLY | O_APPEND | O_CLOEXEC);
+            if (state->fd >= 0 && ftruncate(state->fd, valid) != 0)
+            {
+                close(state->fd);
+                state->fd = -1;
+            }
+        }
+        status = state->fd >= 0 ? 0 : -1;
+    }
+    if (status != 0)
+    {
+        journal_free(state);
+        return -1;
+    }
+
+    state->file_bytes = valid > 0 ? (uint64_t)valid : sizeof(JournalHeader);
+    state->sequence = sequence;
+    state->synced = sequence;
+    tree->journal = state;
+    return 0;
+}
+
+/**
+ * @brief Makes every mutation journaled so far durable.
+ *
+ * @param tree Pointer to the tree structure
+ *
+ * @return int - 0 on success, or -1 if:
+ *         - The tree is NULL or has no journal
+ *         - A record could not be buffered, written or synced since the journal
+ *           was opened; the log then no longer matches the tree
+ */
+int tree_journal_sync(Tree *tree)
+{
+    if (tree == NULL || tree->journal == NULL)
+        return -1;
+
+    TreeJournal *journal = tree->journal;
+    pthread_mutex_lock(&journal->io);
+    journal_flush_locked(journal, true);
+    pthread_mutex_unlock(&journal->io);
+    pthread_mutex_lock(&journal->lock);
+    bool failed = journal->failed;
+    pthread_mutex_unlock(&journal->lock);
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief Folds the journal into a new image.
+ *
+ * @param tree Pointer to the tree structure
+ * @param wait Whether to finish the compaction before returning
+ *
+ * @return int - 0 once the compaction has started (or, with wait, finished), 1 if
+ *         one is already running, or -1 if:
+ *         - The tree is NULL or has no journal
+ *         - The journal cannot be sealed, or (with wait) the image cannot be written
+ *
+ * @note The journal is synced and sealed, and mutations continue into a fresh
+ *       one straight away. The new image is built from the previous image and
+ *       the sealed log, not from the tree, so the tree is neither locked nor
+ *       read; without wait this runs on a thread of its own. A failed
+ *       compaction leaves the sealed log in place for the next one to retry.
+ */
+int tree_journal_compact(Tree *tree, bool wait)
+{
+    if (tree == NULL || tree->journal == NULL)
+        return -1;
+    return journal_compact_start(tree->journal, wait);
+}
+
+/**
+ * @brief Syncs and detaches the journal of a tree.
+ *
+ * @param tree Pointer to the tree structure
+ *
+ * @return int - 0 on success, or -1 if the tree is NULL, has no journal, or
+ *         tree_journal_sync would have failed
+ *
+ * @note Waits for a background compaction to finish. destroy_tree calls this.
+ *       The tree remains usable without a journal.
+ */
+int tree_journal_close(Tree *tree)
+{
+    if (tree == NULL || tree->journal == NULL)
+        return -1;
+
+    TreeJournal *journal = tree->journal;
+    // Take the compacting flag like a compaction would: once a running one
+    // hands it back, no other can start and the compactor thread can be joined
+    pthread_mutex_lock(&journal->lock);
+    while (journal->compacting)
+        pthread_cond_wait(&journal->idle, &journal->lock);
+    journal->compacting = true;
+    pthread_mutex_unlock(&journal->lock);
+    if (journal->compactor_started)
+        pthread_join(journal->compactor, NULL);
+
+    pthread_mutex_lock(&journal->io);
+    journal_flush_locked(journal, true);
+    pthread_mutex_unlock(&journal->io);
+    int status = journal->failed ? -1 : 0;
+    if (close(journal->fd) != 0)
+        status = -1;
+    tree->journal = NULL;
+    journal_free(journal);
+    return status;
+}
+
+// Frozen trees. tree_freeze moves every node into one array per node type, in
+// the image order used by save_tree, so each directory's subdirectories and
+// leaves are contiguous runs sorted by name and lookups binary search them.
+struct TreeFrozen
+{
+    Directory *dirs;
+    Leaf *leaves;
+    char *names;  // Every node name, NUL-terminated, in node order
+    char *values; // Inline leaf values, in leaf order (NULL if there are none)
+    uint32_t dir_count;
+    uint32_t leaf_count;
+};
+
+static void frozen_free(TreeFrozen *frozen)
+{
+    free(frozen->dirs);
+    free(frozen->leaves);
+    free(frozen->names);
+    free(frozen->values);
+    free(frozen);
+}
+
+// Frees the nodes of a mutable tree without touching leaf values
+static void release_nodes(Tree *tree)
+{
+    if (tree->arena != NULL)
+    {
+        arena_release(tree->arena);
+        tree->arena = NULL;
+        return;
+    }
+
+    TreeIter iter;
+    tree_iter_begin(&iter, tree, tree->root, TREE_ITER_POSTORDER);
+    for (Node *node = tree_iter_next(&iter); node != NULL; node = tree_iter_next(&iter))
+    {
+        if (node->tag & TREE_TAG_LEAF)
         {
-            parent->first_child = new_dir;
+            leaf_delete(tree, (Leaf *)node);
         }
         else
         {
-            // Add to end of sibling list
-            Directory *curr = parent->first_child;
-            while (curr->next_dir != NULL)
+            dir_index_free(tree, (Directory *)node);
+            dir_histogram_free(tree, (Directory *)node);
+            node_free_name(tree, node);
+            tree_free(tree, node, sizeof(Directory));
+        }
+    }
+}
+
+/**
+ * @brief Converts a tree into a compact, read-only layout.
+ *
+ * @param tree Pointer to the tree structure
+ *
+ * @return int - 0 on success (or if the tree is already frozen), or -1 if:
+ *         - The tree is NULL
+ *         - The tree has live snapshots or leaf_acquire handles
+ *         - Memory allocation fails, in which case the tree is unchanged
+ *
+ * @note All directories end up in one array and all leaves in another, breadth-first,
+ *       with the children of each directory stored contiguously in byte-wise name
+ *       order, and all names in one block. The per-directory name indexes are
+ *       dropped: find_directory, find_leaf, find_leaf_by_path and lookup_path
+ *       binary search each directory instead. Directory and leaf pointers obtained
+ *       before freezing are invalidated; leaf values and the tree's destroy
+ *       function carry over. Totals are recomputed from the leaves.
+ *       Afterwards every function that would modify the tree fails.
+ *
+ * @warning No other thread may use the tree while it is being frozen.
+ */
+int tree_freeze(Tree *tree)
+{
+    if (tree == NULL)
+        return -1;
+    if (tree->frozen != NULL)
+        return 0;
+    if (versions_live(tree) || __atomic_load_n(&tree->pinned, __ATOMIC_ACQUIRE) != 0)
+        return -1;
+
+    ImageLayout layout;
+    if (image_layout_build(tree, &layout) != 0)
+        return -1;
+
+    TreeFrozen *frozen = calloc(1, sizeof(TreeFrozen));
+    if (frozen == NULL)
+    {
+        image_layout_free(&layout);
+        return -1;
+    }
+    frozen->dir_count = layout.dir_count;
+    frozen->leaf_count = layout.leaf_count;
+    if (layout.dir_count > 0)
+    {
+        frozen->dirs = calloc(layout.dir_count, sizeof(Directory));
+        frozen->leaves = calloc(layout.leaf_count ? layout.leaf_count : 1, sizeof(Leaf));
+        // Inline values move with their leaves
+        size_t inline_size = 0;
+        for (uint32_t i = 0; i < layout.leaf_count; i++)
+        {
+            const Leaf *old = layout.leaf_nodes[i];
+            if (old->base.tag & TREE_TAG_INLINE)
+                inline_size += (size_t)old->size;
+        }
+        if (inline_size > 0)
+            frozen->values = malloc(inline_size);
+        if (frozen->dirs == NULL || frozen->leaves == NULL || (inline_size > 0 && frozen->values == NULL))
+        {
+            frozen_free(frozen);
+            image_layout_free(&layout);
+            return -1;
+        }
+        // The name section is already in node order
+        frozen->names = layout.names;
+        layout.names = NULL;
+    }
+
+    for (uint32_t i = 0; i < layout.dir_count; i++)
+    {
+        const ImageDir *record = &layout.dirs[i];
+        const Directory *old = layout.dir_nodes[i];
+        Directory *dir = &frozen->dirs[i];
+        dir->base.name = frozen->names + record->name;
+        dir->base.name_len = old->base.name_len;
+        dir->base.hash = old->base.hash;
+        dir->base.tag = old->base.tag | TREE_TAG_FROZEN;
+        dir->base.parent = i > 0 ? &frozen->dirs[record->parent].base : NULL;
+        dir->next_dir = i > 0 && i + 1 < layout.dir_count && layout.dirs[i + 1].parent == record->parent
+                            ? &frozen->dirs[i + 1]
+                            : NULL;
+        dir->prev_dir = i > 1 && layout.dirs[i - 1].parent == record->parent ? &frozen->dirs[i - 1] : NULL;
+        if (record->child_count > 0)
+        {
+            dir->first_child = &frozen->dirs[record->first_child];
+            dir->last_child = &frozen->dirs[record->first_child + record->child_count - 1];
+        }
+        if (record->leaf_count > 0)
+        {
+            dir->first_leaf = &frozen->leaves[record->first_leaf];
+            dir->last_leaf = &frozen->leaves[record->first_leaf + record->leaf_count - 1];
+        }
+        dir->dir_count = record->child_count;
+        dir->leaf_count = record->leaf_count;
+        dir->subtree_files = record->subtree_files;
+        dir->subtree_dirs = old->subtree_dirs;
+        dir->total_size = record->total_size;
+    }
+    size_t inline_offset = 0;
+    for (uint32_t i = 0; i < layout.leaf_count; i++)
+    {
+        const ImageLeaf *record = &layout.leaves[i];
+        const Leaf *old = layout.leaf_nodes[i];
+        Leaf *leaf = &frozen->leaves[i];
+        leaf->base.name = frozen->names + record->name;
+        leaf->base.name_len = old->base.name_len;
+        leaf->base.hash = old->base.hash;
+        leaf->base.tag = old->base.tag;
+        leaf->base.parent = &frozen->dirs[record->parent].base;
+        leaf->next_leaf = i + 1 < layout.leaf_count && layout.leaves[i + 1].parent == record->parent
+                              ? &frozen->leaves[i + 1]
+                              : NULL;
+        leaf->prev_leaf = i > 0 && layout.leaves[i - 1].parent == record->parent ? &frozen->leaves[i - 1] : NULL;
+        leaf->value = old->value;
+        leaf->size = old->size;
+        if (old->base.tag & TREE_TAG_INLINE)
+        {
+            leaf->value = memcpy(frozen->values + inline_offset, old->value, (size_t)old->size);
+            inline_offset += (size_t)old->size;
+        }
+    }
+    image_layout_free(&layout);
+
+    // Swap the layouts over, then index the new nodes if the tree keeps a path index
+    path_index_free(tree);
+    path_cache_invalidate(tree);
+    release_nodes(tree);
+    tree->frozen = frozen;
+    tree->root = frozen->dir_count > 0 ? &frozen->dirs[0] : NULL;
+    tree->total_dirs = frozen->dir_count;
+    tree->total_files = frozen->leaf_count;
+    tree->total_size = tree->root != NULL ? tree->root->total_size : 0;
+    if (tree->options & TREE_OPT_PATH_INDEX)
+    {
+        TreeIter iter;
+        tree_iter_begin(&iter, tree, NULL, TREE_ITER_PREORDER);
+        for (Node *node = tree_iter_next(&iter); node != NULL; node = tree_iter_next(&iter))
+            path_index_add(tree, node);
+    }
+    return 0;
+}
+
+bool tree_is_frozen(Tree *tree)
+{
+    if (tree == NULL)
+        return false;
+    return tree->frozen != NULL;
+}
+
+// Snapshots. A snapshot is the epoch it was taken in: tree_snapshot just
+// bumps the tree's epoch, so the snapshot sees every change made before it.
+// Nodes are shared with the live tree. The first change to a directory after
+// a snapshot first saves the directory's totals in a DirVersion; its child and
+// leaf lists are copied into the same record only if they are about to change
+// too. Because totals propagate upwards, a change saves every directory on the
+// path from the modified node to the root, once per snapshot. Removed nodes
+// are retired rather than freed while an older snapshot can still reach them.
+// Records and retired nodes are reclaimed, oldest first, as snapshots are
+// released.
+struct TreeSnapshot
+{
+    Tree *tree;
+    TreeSnapshot *older;
+    TreeSnapshot *newer;
+    uint64_t epoch;
+    Directory *root;
+    uint32_t total_dirs;
+    uint32_t total_files;
+    uint64_t total_size;
+};
+
+struct DirVersion
+{
+    DirVersion *older;    // Previous state of the same directory
+    DirVersion **link;    // The pointer that refers to this record
+    DirVersion *next;     // Next record in creation order, across the tree
+    uint64_t from;        // First epoch this state belongs to
+    uint64_t to;          // Last epoch this state belongs to
+    Directory **children; // Saved lists, NULL until the lists change (see saved)
+    Leaf **leaves;
+    bool saved;           // Lists were copied; otherwise they match the next newer state
+    uint32_t dir_count;
+    uint32_t leaf_count;
+    uint32_t subtree_files;
+    uint64_t total_size;
+};
+
+// A removed node waiting for the snapshots that can see it
+typedef struct RetiredNode
+{
+    struct RetiredNode *next;
+    Node *node;
+    uint64_t epoch; // Epoch of the removal
+} RetiredNode;
+
+struct TreeVersions
+{
+    uint64_t epoch; // Current epoch; changes made now are invisible to every snapshot
+    TreeSnapshot *oldest;
+    TreeSnapshot *newest;
+    DirVersion *records; // Oldest first
+    DirVersion *last_record;
+    RetiredNode *retired; // Oldest first
+    RetiredNode *last_retired;
+};
+
+static bool versions_live(Tree *tree)
+{
+    return tree->versions != NULL && tree->versions->newest != NULL;
+}
+
+static uint64_t versions_epoch(Tree *tree)
+{
+    return tree->versions != NULL ? tree->versions->epoch : 0;
+}
+
+/**
+ * @brief Enters the version lock for one mutation.
+ *
+ * @param tree Pointer to the tree structure
+ * @return bool Whether the lock was taken exclusively; pass it to versions_exit
+ *
+ * @note Only concurrent trees lock. While the gate is down (no snapshot, and
+ *       nobody in versions_exclude) a writer only announces itself in
+ *       versions_writers and touches no shared lock; otherwise it takes the
+ *       lock exclusively, so snapshot readers, which share it, never see a
+ *       change half made. It must be entered before any directory lock.
+ */
+static bool versions_enter(Tree *tree)
+{
+    if (!is_concurrent(tree))
+        return false;
+    if (__atomic_load_n(&tree->versions_gate, __ATOMIC_SEQ_CST) == 0)
+    {
+        // Announce, then check again: versions_exclude raises the gate before
+        // it counts writers, so one of the two always sees the other
+        __atomic_add_fetch(&tree->versions_writers, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&tree->versions_gate, __ATOMIC_SEQ_CST) == 0)
+            return false;
+        __atomic_sub_fetch(&tree->versions_writers, 1, __ATOMIC_SEQ_CST);
+    }
+    lock_write(&tree->versions_lock);
+    return true;
+}
+
+static void versions_exit(Tree *tree, bool exclusive)
+{
+    if (!is_concurrent(tree))
+        return;
+    if (exclusive)
+        unlock_write(&tree->versions_lock);
+    else
+        __atomic_sub_fetch(&tree->versions_writers, 1, __ATOMIC_SEQ_CST);
+}
+
+// Takes the version lock exclusively and waits out the writers that entered
+// without it, keeping every writer out until versions_include
+static void versions_exclude(Tree *tree)
+{
+    if (!is_concurrent(tree))
+        return;
+    __atomic_add_fetch(&tree->versions_gate, 1, __ATOMIC_SEQ_CST);
+    lock_write(&tree->versions_lock);
+    unsigned spins = 0;
+    while (__atomic_load_n(&tree->versions_writers, __ATOMIC_SEQ_CST) != 0)
+        lock_backoff(&spins);
+}
+
+static void versions_include(Tree *tree)
+{
+    if (!is_concurrent(tree))
+        return;
+    unlock_write(&tree->versions_lock);
+    __atomic_sub_fetch(&tree->versions_gate, 1, __ATOMIC_SEQ_CST);
+}
+
+// Copies a directory's current lists into a record
+static bool version_save_lists(Tree *tree, Directory *dir, DirVersion *record)
+{
+    // The record's counts size the copies, so take them from the lists
+    uint32_t children = 0, files = 0;
+    for (Directory *child = dir->first_child; child != NULL; child = child->next_dir)
+        children++;
+    for (Leaf *leaf = dir->first_leaf; leaf != NULL; leaf = leaf->next_leaf)
+        files++;
+    record->dir_count = children;
+    record->leaf_count = files;
+
+    record->children = tree_alloc(tree, (size_t)children * sizeof(Directory *) + 1);
+    record->leaves = tree_alloc(tree, (size_t)files * sizeof(Leaf *) + 1);
+    if (record->children == NULL || record->leaves == NULL)
+        return false;
+
+    uint32_t i = 0;
+    for (Directory *child = dir->first_child; child != NULL; child = child->next_dir)
+        record->children[i++] = child;
+    i = 0;
+    for (Leaf *leaf = dir->first_leaf; leaf != NULL; leaf = leaf->next_leaf)
+        record->leaves[i++] = leaf;
+    record->saved = true;
+    return true;
+}
+
+/**
+ * @brief Preserves a directory's state for snapshots before it changes.
+ *
+ * @param tree Pointer to the tree structure
+ * @param dir The directory about to change
+ * @param lists Whether its child or leaf list changes, not just its totals
+ *
+ * @note Does nothing unless a snapshot taken since the directory last changed
+ *       is live. If memory runs out the state is lost and snapshots that needed
+ *       it see the live lists instead.
+ */
+static void versions_touch(Tree *tree, Directory *dir, bool lists)
+{
+    if (!versions_live(tree))
+        return;
+
+    TreeVersions *versions = tree->versions;
+    DirVersion *head = dir->versions;
+    if (dir->version < versions->epoch)
+    {
+        if (versions->newest->epoch >= dir->version)
+        {
+            DirVersion *record = tree_alloc(tree, sizeof(DirVersion));
+            if (record != NULL)
             {
-                curr = curr->next_dir;
+                memset(record, 0, sizeof(DirVersion));
+                record->from = dir->version;
+                record->to = versions->epoch - 1;
+                record->dir_count = dir->dir_count;
+                record->leaf_count = dir->leaf_count;
+                record->subtree_files = dir->subtree_files;
+                record->total_size = dir->total_size;
+
+                record->older = head;
+                if (head != NULL)
+                    head->link = &record->older;
+                record->link = &dir->versions;
+                dir->versions = record;
+                head = record;
+
+                if (versions->last_record == NULL)
+                    versions->records = record;
+                else
+                    versions->last_record->next = record;
+                versions->last_record = record;
             }
-            curr->next_dir = new_dir;
         }
-        parent->dir_count++;
+        dir->version = versions->epoch;
     }
 
-    tree->total_dirs++;
-    return new_dir;
+    // Records above the last one with saved lists share the live lists until now
+    if (lists && head != NULL && !head->saved && !version_save_lists(tree, dir, head))
+    {
+        tree_free(tree, head->children, (size_t)head->dir_count * sizeof(Directory *) + 1);
+        tree_free(tree, head->leaves, (size_t)head->leaf_count * sizeof(Leaf *) + 1);
+        head->children = NULL;
+        head->leaves = NULL;
+    }
 }
 
 /**
- * @brief Creates a nested directory path, creating intermediate directories as needed
+ * @brief Keeps a removed node alive for the snapshots that can still see it.
  *
- * @param tree Pointer to the tree structure where the directories will be created
- * @param path Full path of directories to create (e.g., "/hello/world")
+ * @param tree Pointer to the tree structure
+ * @param node A leaf or directory subtree already unlinked from the tree
+ * @return bool true if the node was retired, false if the caller should free it now
+ */
+static bool versions_retire(Tree *tree, Node *node)
+{
+    if (!versions_live(tree))
+        return false;
+
+    RetiredNode *entry = malloc(sizeof(RetiredNode));
+    if (entry == NULL)
+        return false; // Snapshots must tolerate it; better than leaking the subtree
+    entry->next = NULL;
+    entry->node = node;
+    entry->epoch = tree->versions->epoch;
+
+    TreeVersions *versions = tree->versions;
+    if (versions->last_retired == NULL)
+        versions->retired = entry;
+    else
+        versions->last_retired->next = entry;
+    versions->last_retired = entry;
+    return true;
+}
+
+static void version_free(Tree *tree, DirVersion *record)
+{
+    // Older records are reclaimed first, so this one is the oldest in its chain
+    *record->link = NULL;
+    if (record->saved)
+    {
+        tree_free(tree, record->children, (size_t)record->dir_count * sizeof(Directory *) + 1);
+        tree_free(tree, record->leaves, (size_t)record->leaf_count * sizeof(Leaf *) + 1);
+    }
+    tree_free(tree, record, sizeof(DirVersion));
+}
+
+static void retired_free(Tree *tree, RetiredNode *entry)
+{
+    Node *node = entry->node;
+    if (node->tag & TREE_TAG_LEAF)
+    {
+        leaf_free(tree, (Leaf *)node);
+    }
+    else
+    {
+        // Snapshot readers may have cached its path since the removal
+        destroy_directory(tree, (Directory *)node);
+        path_cache_invalidate(tree);
+    }
+    free(entry);
+}
+
+// Reclaims the records and retired nodes no live snapshot can reach
+static void versions_collect(Tree *tree)
+{
+    TreeVersions *versions = tree->versions;
+    uint64_t oldest = versions->oldest != NULL ? versions->oldest->epoch : UINT64_MAX;
+
+    // Records first: those of a retired subtree end before its removal epoch
+    while (versions->records != NULL && versions->records->to < oldest)
+    {
+        DirVersion *record = versions->records;
+        versions->records = record->next;
+        version_free(tree, record);
+    }
+    if (versions->records == NULL)
+        versions->last_record = NULL;
+
+    // A node removed in epoch e is visible to snapshots taken before e
+    while (versions->retired != NULL && versions->retired->epoch <= oldest)
+    {
+        RetiredNode *entry = versions->retired;
+        versions->retired = entry->next;
+        retired_free(tree, entry);
+    }
+    if (versions->retired == NULL)
+        versions->last_retired = NULL;
+}
+
+// Drops all snapshot state; called by destroy_tree
+static void versions_free(Tree *tree)
+{
+    TreeVersions *versions = tree->versions;
+    if (versions == NULL)
+        return;
+
+    while (versions->oldest != NULL)
+    {
+        TreeSnapshot *snapshot = versions->oldest;
+        versions->oldest = snapshot->newer;
+        free(snapshot);
+    }
+    versions->newest = NULL;
+    versions_collect(tree);
+    free(versions);
+    tree->versions = NULL;
+}
+
+/**
+ * @brief Takes a read-only, point-in-time view of a tree.
  *
- * @return Directory* Pointer to the last directory in the path, or NULL if:
- *         - Any input parameter is NULL
- *         - Path is empty
+ * @param tree Pointer to the tree structure
+ *
+ * @return TreeSnapshot* The snapshot, to be passed to snapshot_release, or NULL if:
+ *         - The tree is NULL
  *         - Memory allocation fails
- *         - Path component name >= 256 characters
- *         - Invalid path format
  *
- * @note This function:
- *       - Splits the path into components
- *       - Creates or finds each directory in the path
- *       - Creates missing intermediate directories
- *       - Returns existing directories if they already exist
- *       - Properly handles absolute paths (starting with /)
+ * @note Taking a snapshot is O(1): nothing is copied until the tree changes.
+ *       While snapshots exist, each directory keeps at most one saved state
+ *       per snapshot interval, written by the first change after the snapshot,
+ *       and removed nodes (including their values) are only freed once every
+ *       snapshot that can see them is released.
+ *       In concurrent trees snapshots can be queried from any thread while
+ *       writers run; writers then take turns, and each query waits for the
+ *       mutation in progress.
+ */
+TreeSnapshot *tree_snapshot(Tree *tree)
+{
+    if (tree == NULL)
+        return NULL;
+
+    versions_exclude(tree);
+
+    TreeSnapshot *snapshot = NULL;
+    if (tree->versions == NULL)
+    {
+        tree->versions = calloc(1, sizeof(TreeVersions));
+        if (tree->versions != NULL)
+            tree->versions->epoch = 1;
+    }
+    TreeVersions *versions = tree->versions;
+    if (versions != NULL && (snapshot = malloc(sizeof(TreeSnapshot))) != NULL)
+    {
+        snapshot->tree = tree;
+        snapshot->epoch = versions->epoch++;
+        snapshot->root = tree->root;
+        snapshot->total_dirs = tree->total_dirs;
+        snapshot->total_files = tree->total_files;
+        snapshot->total_size = tree->total_size;
+        snapshot->newer = NULL;
+        snapshot->older = versions->newest;
+        if (versions->newest == NULL)
+            versions->oldest = snapshot;
+        else
+            versions->newest->newer = snapshot;
+        versions->newest = snapshot;
+        // Writers keep taking the lock until the snapshot is released
+        __atomic_add_fetch(&tree->versions_gate, 1, __ATOMIC_SEQ_CST);
+    }
+
+    versions_include(tree);
+    return snapshot;
+}
+
+/**
+ * @brief Releases a snapshot and reclaims the state only it was keeping.
  *
- * @example
- *     // Create nested directories
- *     Directory *dir = create_nested_directory(tree, "/hello/world");
- *     // Creates:
- *     // /
- *     // └── hello/
- *     //     └── world/
+ * @param snapshot Snapshot from tree_snapshot (can be NULL)
+ *
+ * @note Nodes obtained through the snapshot must not be used afterwards.
+ *       Retired leaves have their values destroyed here.
+ */
+void snapshot_release(TreeSnapshot *snapshot)
+{
+    if (snapshot == NULL)
+        return;
+
+    Tree *tree = snapshot->tree;
+    versions_exclude(tree);
+
+    TreeVersions *versions = tree->versions;
+    if (snapshot->older == NULL)
+        versions->oldest = snapshot->newer;
+    else
+        snapshot->older->newer = snapshot->newer;
+    if (snapshot->newer == NULL)
+        versions->newest = snapshot->older;
+    else
+        snapshot->newer->older = snapshot->older;
+    free(snapshot);
+    versions_collect(tree);
+    __atomic_sub_fetch(&tree->versions_gate, 1, __ATOMIC_SEQ_CST);
+
+    versions_include(tree);
+}
+
+// A directory as a snapshot sees it
+typedef struct DirView
+{
+    Directory *dir;
+    const DirVersion *lists; // Saved lists, or NULL to use the live ones
+    uint32_t dir_count;
+    uint32_t leaf_count;
+    uint32_t subtree_files;
+    uint64_t total_size;
+} DirView;
+
+static void snapshot_view(const TreeSnapshot *snapshot, Directory *dir, DirView *view)
+{
+    view->dir = dir;
+    view->lists = NULL;
+
+    const DirVersion *record = NULL;
+    if (dir->version > snapshot->epoch)
+    {
+        // Find the state the snapshot saw, remembering the nearest saved lists
+        for (record = dir->versions; record != NULL; record = record->older)
+        {
+            if (record->saved)
+                view->lists = record;
+            if (record->from <= snapshot->epoch)
+                break;
+        }
+    }
+    if (record != NULL)
+    {
+        view->dir_count = record->dir_count;
+        view->leaf_count = record->leaf_count;
+        view->subtree_files = record->subtree_files;
+        view->total_size = record->total_size;
+    }
+    else
+    {
+        // Unchanged since the snapshot (or its state could not be saved)
+        view->lists = NULL;
+        view->dir_count = dir->dir_count;
+        view->leaf_count = dir->leaf_count;
+        view->subtree_files = dir->subtree_files;
+        view->total_size = dir->total_size;
+    }
+}
+
+static Directory *view_child_directory(const DirView *view, const char *name, size_t len, uint32_t hash)
+{
+    if (view->lists == NULL)
+        return find_child_directory(view->dir, name, len, hash);
+    for (uint32_t i = 0; i < view->lists->dir_count; i++)
+    {
+        if (node_name_equals(&view->lists->children[i]->base, name, len, hash))
+            return view->lists->children[i];
+    }
+    return NULL;
+}
+
+static Leaf *view_child_leaf(const DirView *view, const char *name, size_t len, uint32_t hash)
+{
+    if (view->lists == NULL)
+        return find_child_leaf(view->dir, name, len, hash);
+    for (uint32_t i = 0; i < view->lists->leaf_count; i++)
+    {
+        if (node_name_equals(&view->lists->leaves[i]->base, name, len, hash))
+            return view->lists->leaves[i];
+    }
+    return NULL;
+}
+
+// Snapshot queries share the version lock, which excludes writers while snapshots exist
+static inline void snapshot_lock(TreeSnapshot *snapshot)
+{
+    if (is_concurrent(snapshot->tree))
+        lock_read(&snapshot->tree->versions_lock);
+}
+
+static inline void snapshot_unlock(TreeSnapshot *snapshot)
+{
+    if (is_concurrent(snapshot->tree))
+        unlock_read(&snapshot->tree->versions_lock);
+}
+
+Directory *snapshot_root(TreeSnapshot *snapshot)
+{
+    if (snapshot == NULL)
+        return NULL;
+    return snapshot->root;
+}
+
+// Resolves a directory path in a snapshot; the caller holds the snapshot lock
+static Directory *snapshot_resolve(TreeSnapshot *snapshot, const char **cursor, PathSlice *last)
+{
+    Directory *dir = snapshot->root;
+    PathSlice component, next = {.ptr = NULL, .len = 0};
+    bool more = dir != NULL && path_next(cursor, &component);
+    while (more)
+    {
+        more = path_next(cursor, &next);
+        if (!more && last != NULL)
+        {
+            *last = component; // The leaf name, resolved by the caller
+            break;
+        }
+        DirView view;
+        snapshot_view(snapshot, dir, &view);
+        dir = view_child_directory(&view, component.ptr, component.len, hash_name(component.ptr, component.len));
+        if (dir == NULL)
+            break;
+        component = next;
+    }
+    return dir;
+}
+
+/**
+ * @brief Searches a snapshot for a directory by path, like find_directory.
+ *
+ * @param snapshot Snapshot from tree_snapshot
+ * @param path Path below the root, e.g. "/hello/world"; "/" names the root
+ *
+ * @return Directory* The directory as of the snapshot, or NULL if any input
+ *         parameter is NULL or the directory did not exist then
+ *
+ * @note The directory may since have been removed from the live tree; it stays
+ *       valid until the snapshot is released. Read its totals through the
+ *       snapshot_* getters, which return the values the snapshot saw.
+ */
+Directory *snapshot_find_directory(TreeSnapshot *snapshot, const char *path)
+{
+    if (snapshot == NULL || path == NULL || *path == '\0')
+        return NULL;
+
+    snapshot_lock(snapshot);
+    const char *cursor = path;
+    Directory *dir = snapshot_resolve(snapshot, &cursor, NULL);
+    snapshot_unlock(snapshot);
+    return dir;
+}
+
+/**
+ * @brief Looks up a leaf in a snapshot by its full path, like find_leaf_by_path.
  *
- * @warning
- *     - Path components must be separated by '/'
- *     - Each path component must be < 256 characters
- *     - Memory for path components is freed before returning
+ * @param snapshot Snapshot from tree_snapshot
+ * @param path Full path below the root, e.g. "/logs/app/current.log"
+ * @return Leaf* The leaf as of the snapshot, or NULL if it did not exist then
  */
-Directory *create_nested_directory(Tree *tree, const char *path)
+Leaf *snapshot_find_leaf_by_path(TreeSnapshot *snapshot, const char *path)
 {
-    if (tree == NULL || path == NULL || strlen(path) == 0)
+    if (snapshot == NULL || path == NULL)
         return NULL;
 
-    int count;
-    char **components = split_path(path, &count);
-    if (!components)
+    snapshot_lock(snapshot);
+    Leaf *leaf = NULL;
+    const char *cursor = path;
+    PathSlice name = {.ptr = NULL, .len = 0};
+    Directory *dir = snapshot_resolve(snapshot, &cursor, &name);
+    if (dir != NULL && name.ptr != NULL)
+    {
+        DirView view;
+        snapshot_view(snapshot, dir, &view);
+        leaf = view_child_leaf(&view, name.ptr, name.len, hash_name(name.ptr, name.len));
+    }
+    snapshot_unlock(snapshot);
+    return leaf;
+}
+
+/**
+ * @brief Searches a snapshot subtree for a leaf by bare name, like find_leaf.
+ *
+ * @param snapshot Snapshot from tree_snapshot
+ * @param start Directory to search from (NULL for the snapshot's root)
+ * @param name The name of the leaf to search for
+ *
+ * @return Leaf* The first match in depth-first order, or NULL if not found
+ *         or if memory allocation fails
+ */
+Leaf *snapshot_find_leaf(TreeSnapshot *snapshot, Directory *start, const char *name)
+{
+    if (snapshot == NULL || name == NULL)
+        return NULL;
+    if (start == NULL)
+        start = snapshot->root;
+    if (start == NULL)
         return NULL;
 
-    Directory *current = tree->root;
-    // Directory *parent = NULL;
+    size_t len = strlen(name);
+    uint32_t hash = hash_name(name, len);
+    Directory *inline_stack[64];
+    Directory **stack = inline_stack;
+    size_t capacity = 64, depth = 0;
+    Leaf *found = NULL;
 
-    for (int i = 0; i < count; i++)
+    snapshot_lock(snapshot);
+    stack[depth++] = start;
+    while (depth > 0 && found == NULL)
     {
-        if (strlen(components[i]) == 0)
-            continue; // Skip empty components
-
-        if (i == 0)
+        DirView view;
+        snapshot_view(snapshot, stack[--depth], &view);
+        found = view_child_leaf(&view, name, len, hash);
+        if (depth + view.dir_count > capacity)
         {
-            // Handle root level
-            if (current == NULL)
-            {
-                current = create_directory(tree, NULL, components[i]);
-            }
-            else
-            {
-                Directory *found = find_child_directory(current, components[i]);
-                if (!found)
-                {
-                    current = create_directory(tree, current, components[i]);
-                }
-                else
-                {
-                    current = found;
-                }
-            }
+            size_t grown_capacity = capacity;
+            while (grown_capacity < depth + view.dir_count)
+                grown_capacity *= 2;
+            Directory **grown = malloc(grown_capacity * sizeof(Directory *));
+            if (grown == NULL)
+                break;
+            memcpy(grown, stack, depth * sizeof(Directory *));
+            if (stack != inline_stack)
+                free(stack);
+            stack = grown;
+            capacity = grown_capacity;
         }
-        else
+        // Push in reverse so children are searched in list order
+        if (view.lists != NULL)
         {
-            // Handle nested directories
-            Directory *found = find_child_directory(current, components[i]);
-            if (!found)
-            {
-                found = create_directory(tree, current, components[i]);
-            }
-            if (!found)
-            {
-                free_path_components(components, count);
-                return NULL;
-            }
-            current = found;
+            for (uint32_t i = view.lists->dir_count; i-- > 0;)
+                stack[depth++] = view.lists->children[i];
         }
-
-        if (!current)
+        else
         {
-            free_path_components(components, count);
-            return NULL;
+            for (Directory *child = view.dir->last_child; child != NULL; child = child->prev_dir)
+                stack[depth++] = child;
         }
     }
+    snapshot_unlock(snapshot);
 
-    free_path_components(components, count);
-    return current;
+    if (stack != inline_stack)
+        free(stack);
+    return found;
 }
 
 /**
- * @brief Searches for a directory in the tree based on the specified path.
- *
- * @param tree Pointer to the tree structure where the search will be performed
- * @param path A string representing the full path of the directory to search for
+ * @brief Lists a directory's contents as of a snapshot.
  *
- * @return Directory* Pointer to the found directory if it exists, or NULL if:
- *         - Any input parameter is NULL
- *         - The path is empty
- *         - The directory is not found in the tree
+ * @param snapshot Snapshot from tree_snapshot
+ * @param dir Directory obtained through the snapshot
+ * @param out Receives up to capacity nodes: subdirectories first, then leaves
+ * @param capacity Size of out (may be 0 to just count)
  *
- * @note This function splits the input path into components to handle nested directories.
- *       It iterates through each component, searching for the corresponding directory.
- *       If any component is not found, the function returns NULL.
- *       The search is case-sensitive and traverses the tree structure recursively.
+ * @return uint32_t Number of entries the directory had, which may exceed capacity
  */
+uint32_t snapshot_list(TreeSnapshot *snapshot, Directory *dir, Node **out, uint32_t capacity)
+{
+    if (snapshot == NULL || dir == NULL)
+        return 0;
 
-Directory *find_directory(Tree *tree, const char *path)
+    snapshot_lock(snapshot);
+    DirView view;
+    snapshot_view(snapshot, dir, &view);
+    uint32_t n = 0;
+    if (view.lists != NULL)
+    {
+        for (uint32_t i = 0; i < view.lists->dir_count; i++, n++)
+            if (n < capacity)
+                out[n] = &view.lists->children[i]->base;
+        for (uint32_t i = 0; i < view.lists->leaf_count; i++, n++)
+            if (n < capacity)
+                out[n] = &view.lists->leaves[i]->base;
+    }
+    else
+    {
+        for (Directory *child = dir->first_child; child != NULL; child = child->next_dir, n++)
+            if (n < capacity)
+                out[n] = &child->base;
+        for (Leaf *leaf = dir->first_leaf; leaf != NULL; leaf = leaf->next_leaf, n++)
+            if (n < capacity)
+                out[n] = &leaf->base;
+    }
+    snapshot_unlock(snapshot);
+    return n;
+}
+
+uint64_t snapshot_directory_size(TreeSnapshot *snapshot, Directory *dir)
 {
-    if (!tree || !path || strlen(path) == 0)
-        return NULL;
+    if (snapshot == NULL || dir == NULL)
+        return 0;
+    DirView view;
+    snapshot_lock(snapshot);
+    snapshot_view(snapshot, dir, &view);
+    snapshot_unlock(snapshot);
+    return view.total_size;
+}
 
-    int count;
-    char **components = split_path(path, &count);
-    if (!components)
-        return NULL;
+uint32_t snapshot_directory_count(TreeSnapshot *snapshot, Directory *dir)
+{
+    if (snapshot == NULL || dir == NULL)
+        return 0;
+    DirView view;
+    snapshot_lock(snapshot);
+    snapshot_view(snapshot, dir, &view);
+    snapshot_unlock(snapshot);
+    return view.dir_count;
+}
 
-    Directory *current = tree->root;
+uint32_t snapshot_directory_file_count(TreeSnapshot *snapshot, Directory *dir)
+{
+    if (snapshot == NULL || dir == NULL)
+        return 0;
+    DirView view;
+    snapshot_lock(snapshot);
+    snapshot_view(snapshot, dir, &view);
+    snapshot_unlock(snapshot);
+    return view.subtree_files;
+}
 
-    // Skip first component if it's empty (happens with leading /)
-    int start = (strlen(components[0]) == 0) ? 1 : 0;
+uint64_t snapshot_total_size(TreeSnapshot *snapshot)
+{
+    if (snapshot == NULL)
+        return 0;
+    return snapshot->total_size;
+}
 
-    for (int i = start; i < count; i++)
-    {
-        if (!current)
-        {
-            free_path_components(components, count);
-            return NULL;
-        }
-        current = find_child_directory(current, components[i]);
-    }
+uint32_t snapshot_total_files(TreeSnapshot *snapshot)
+{
+    if (snapshot == NULL)
+        return 0;
+    return snapshot->total_files;
+}
 
-    free_path_components(components, count);
-    return current;
+uint32_t snapshot_total_directories(TreeSnapshot *snapshot)
+{
+    if (snapshot == NULL)
+        return 0;
+    return snapshot->total_dirs;
+}
+
+#ifdef TREE_STATS
+static const char *const op_names[TREE_OP_COUNT] = {
+    "create_directory", "create_nested_directory", "remove_directory", "find_directory", "create_leaf",
+    "remove_leaf",      "find_leaf",               "find_leaf_by_path", "lookup_path",
+};
+
+static inline uint64_t stats_load(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
 }
+#endif
 
 /**
- * @brief Removes a directory from the tree and its contents.
+ * @brief Writes the tree's instrumentation counters as one JSON object.
  *
  * @param tree Pointer to the tree structure
- * @param dir Pointer to the directory to be removed
- *
+ * @param out Stream to write to
  * @return int - 0 on success, or -1 if:
- *         - The tree or directory is NULL
- *         - The directory is the root with children
+ *         - Any input parameter is NULL
+ *         - The library was built without -DTREE_STATS
+ *         - Writing fails
  *
- * @note This function cannot remove the root directory if it has children or leaves.
- *       It updates the parent's child list and directory count, recursively destroys
- *       the directory and all its contents, and decreases the total directory count in the tree.
+ * @note The object holds the tree-wide counters followed by "ops", which maps
+ *       each timed operation to its call count, total and maximum latency in
+ *       nanoseconds, and a latency histogram whose keys are the lower bounds of
+ *       power-of-two nanosecond buckets; empty buckets are left out. Counters
+ *       keep running while they are written, so in concurrent trees the values
+ *       need not be from a single instant.
  */
-
-int remove_directory(Tree *tree, Directory *dir)
+int tree_stats_dump(Tree *tree, FILE *out)
 {
-    if (tree == NULL || dir == NULL)
-        return -1;
-
-    // Cannot remove root if it has children
-    if (dir == tree->root && (dir->first_child != NULL || dir->first_leaf != NULL))
+#ifdef TREE_STATS
+    if (tree == NULL || out == NULL || tree->stats == NULL)
         return -1;
 
-    // Find parent and remove from parent's list
-    Directory *parent = (Directory *)dir->base.parent;
-    if (parent != NULL)
+    const TreeStats *stats = tree->stats;
+    fprintf(out,
+            "{\"siblings_scanned\":%" PRIu64 ",\"name_compares\":%" PRIu64 ",\"allocations\":%" PRIu64
+            ",\"allocated_bytes\":%" PRIu64 ",\"frees\":%" PRIu64 ",\"freed_bytes\":%" PRIu64
+            ",\"propagations\":%" PRIu64 ",\"propagation_hops\":%" PRIu64 ",\"ops\":{",
+            stats_load(&stats->siblings_scanned), stats_load(&stats->name_compares),
+            stats_load(&stats->allocations), stats_load(&stats->allocated_bytes), stats_load(&stats->frees),
+            stats_load(&stats->freed_bytes), stats_load(&stats->propagations),
+            stats_load(&stats->propagation_hops));
+    for (uint32_t i = 0; i < TREE_OP_COUNT; i++)
     {
-        if (parent->first_child == dir)
+        const OpStats *op = &stats->ops[i];
+        fprintf(out, "%s\"%s\":{\"calls\":%" PRIu64 ",\"total_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 ",\"histogram_ns\":{",
+                i > 0 ? "," : "", op_names[i], stats_load(&op->calls), stats_load(&op->total_ns),
+                stats_load(&op->max_ns));
+        bool first = true;
+        for (unsigned b = 0; b < STATS_BUCKETS; b++)
         {
-            parent->first_child = dir->next_dir;
+            uint64_t count = stats_load(&op->buckets[b]);
+            if (count == 0)
+                continue;
+            fprintf(out, "%s\"%" PRIu64 "\":%" PRIu64, first ? "" : ",", b > 0 ? (uint64_t)1 << b : 0, count);
+            first = false;
         }
-        else
-        {
-            Directory *curr = parent->first_child;
-            while (curr != NULL && curr->next_dir != dir)
-                curr = curr->next_dir;
-            if (curr != NULL)
-                curr->next_dir = dir->next_dir;
-        }
-        parent->dir_count--;
+        fputs("}}", out);
     }
+    fputs("}}\n", out);
+    return ferror(out) ? -1 : 0;
+#else
+    (void)tree;
+    (void)out;
+    return -1;
+#endif
+}
 
-    // Recursively destroy the directory and its contents
-    destroy_directory(tree, dir);
-    tree->total_dirs--;
-
+/**
+ * @brief Zeroes the tree's instrumentation counters and histograms.
+ *
+ * @param tree Pointer to the tree structure
+ * @return int - 0 on success, or -1 if the tree is NULL or the library was built without -DTREE_STATS
+ *
+ * @note The trace callback stays installed. Operations running meanwhile may
+ *       be counted on either side of the reset.
+ */
+int tree_stats_reset(Tree *tree)
+{
+#ifdef TREE_STATS
+    if (tree == NULL || tree->stats == NULL)
+        return -1;
+    TreeStats *stats = tree->stats;
+    uint64_t *counter = (uint64_t *)stats;
+    uint64_t *end = (uint64_t *)&stats->trace;
+    for (; counter < end; counter++)
+        __atomic_store_n(counter, 0, __ATOMIC_RELAXED);
     return 0;
+#else
+    (void)tree;
+    return -1;
+#endif
 }
 
 /**
- * @brief Creates a new leaf (file) node and adds it to the specified parent directory.
+ * @brief Installs a callback invoked after every timed operation.
  *
  * @param tree Pointer to the tree structure
- * @param parent Pointer to the parent directory where the leaf will be added
- * @param name Name of the new leaf (must be less than 256 characters)
- * @param value Pointer to the leaf's data value
- * @param size Size of the leaf in bytes
- *
- * @return Leaf* Pointer to the newly created leaf on success, or NULL if:
- *         - Any input parameter is NULL
- *         - Name is too long (>= 256 chars)
- *         - A file with the same name exists in parent
- *         - Memory allocation fails
+ * @param trace Callback, or NULL to remove the current one
+ * @param ctx Passed through to the callback
+ * @return int - 0 on success, or -1 if the tree is NULL or the library was built without -DTREE_STATS
  *
- * @note This function updates the total size of the parent directory and all ancestors,
- *       adds the leaf to the end of the parent's leaf list, initializes all leaf fields
- *       including base node properties, and copies the name into the leaf with null termination.
+ * @note The callback runs on the calling thread once the operation has released
+ *       its locks. Set it before sharing the tree between threads.
  */
-Leaf *create_leaf(Tree *tree, Directory *parent, const char *name, void *value, uint16_t size)
+int tree_set_trace(Tree *tree, tree_trace_fn trace, void *ctx)
 {
-    if (tree == NULL || parent == NULL || name == NULL || strlen(name) >= 256)
-        return NULL;
-
-    // Check if a file with the same name already exists in this directory
-    Leaf *curr = parent->first_leaf;
-    while (curr != NULL)
-    {
-        if (strcmp(curr->base.name, name) == 0)
-            return NULL; // File already exists
-        curr = curr->next_leaf;
-    }
-
-    // Create new leaf
-    Leaf *new_leaf = (Leaf *)malloc(sizeof(Leaf));
-    if (new_leaf == NULL)
-        return NULL;
-
-    // Initialize the leaf
-    memset(new_leaf, 0, sizeof(Leaf));
-    strncpy(new_leaf->base.name, name, 255);
-    new_leaf->base.parent = (Node *)parent;
-    new_leaf->base.tag = TREE_TAG_LEAF;
-    new_leaf->value = value;
-    new_leaf->size = size;
-
-    // Add to parent's leaf list
-    if (parent->first_leaf == NULL)
-    {
-        parent->first_leaf = new_leaf;
-    }
-    else
-    {
-        // Add to end of leaf list
-        curr = parent->first_leaf;
-        while (curr->next_leaf != NULL)
-            curr = curr->next_leaf;
-        curr->next_leaf = new_leaf;
-    }
+#ifdef TREE_STATS
+    if (tree == NULL || tree->stats == NULL)
+        return -1;
+    tree->stats->trace_ctx = ctx;
+    __atomic_store_n(&tree->stats->trace, trace, __ATOMIC_RELEASE);
+    return 0;
+#else
+    (void)tree;
+    (void)trace;
+    (void)ctx;
+    return -1;
+#endif
+}
 
-    // Update size totals
-    parent->total_size += size;
-    Directory *dir = parent;
-    while (dir->base.parent != NULL)
-    {
-        dir = (Directory *)dir->base.parent;
-        dir->total_size += size;
-    }
-    tree->total_size += size;
+// Sharded trees. Each shard is a complete Tree whose root carries the shared
+// root name; an entry directly below the root goes to the shard its name hashes
+// to, and everything beneath it follows. Paths are therefore routed by their
+// first component alone, and only the root itself exists in every shard.
 
-    return new_leaf;
+// Shard owning the top-level entry named by path's first component (shard 0 for the root)
+static uint32_t shard_index(const TreeShards *shards, const char *path)
+{
+    PathSlice component;
+    if (!path_next(&path, &component))
+        return 0;
+    return hash_name(component.ptr, component.len) % shards->count;
 }
 
 /**
- * @brief Removes a leaf (file) from the tree and updates the necessary size totals.
- *
- * @param tree Pointer to the tree structure
- * @param leaf Pointer to the leaf (file) to be removed
+ * @brief Initializes a set of independent trees that together hold one tree.
  *
+ * @param shards Pointer to the shard set to initialize
+ * @param count Number of trees to split the entries below the root between
+ * @param root Name of the shared root directory
+ * @param compare Name order for the list_* queries of every shard, as for init_tree_ex
+ * @param destroy Function pointer for cleaning up node values (can be NULL)
+ * @param options TREE_OPT_* flags given to every shard
  * @return int - 0 on success, or -1 if:
- *         - The tree or leaf is NULL
- *         - The leaf has no parent
+ *         - shards or root is NULL, count is 0, or root is not a valid name
+ *         - Memory allocation fails
  *
- * @note This function updates the total size of the parent directory and the tree.
- *       If the leaf has a value and a destroy function is provided, it calls the destroy
- *       function on the value. The leaf is freed after removal from the parent's list.
+ * @note Every shard has its own root, allocator, locks and totals, so with
+ *       TREE_OPT_CONCURRENT writers working under different top-level entries
+ *       contend only when those entries hash to the same shard. Each shard is
+ *       allocated on its own cache lines for the same reason.
+ *       Use tree_shard to get the tree that owns a path and call the ordinary
+ *       API on it; the tree_shards_* functions cover the common lookups and the
+ *       tree-wide totals.
+ *
+ * @warning A top-level entry must stay in the shard its name hashes to: do not
+ *          rename entries directly below the root, and do not move nodes to or
+ *          from the root level. Nodes of different shards cannot be mixed in one call.
  */
-int remove_leaf(Tree *tree, Leaf *leaf)
+int tree_shards_init(TreeShards *shards, uint32_t count, const char *root, int (*compare)(void *key1, void *key2),
+                     void (*destroy)(void *data), uint32_t options)
 {
-    if (tree == NULL || leaf == NULL)
+    if (shards == NULL || count == 0 || root == NULL)
         return -1;
 
-    Directory *parent = (Directory *)leaf->base.parent;
-    if (parent == NULL)
+    shards->trees = calloc(count, sizeof(Tree *));
+    shards->count = 0;
+    if (shards->trees == NULL)
         return -1;
 
-    // Remove from parent's leaf list
-    if (parent->first_leaf == leaf)
+    size_t tree_size = (sizeof(Tree) + 63) & ~(size_t)63;
+    for (uint32_t i = 0; i < count; i++)
     {
-        parent->first_leaf = leaf->next_leaf;
+        Tree *tree = aligned_alloc(64, tree_size);
+        if (tree == NULL)
+            break;
+        init_tree_ex(tree, compare, destroy, options);
+        shards->trees[shards->count++] = tree;
+        if (create_directory(tree, NULL, root) == NULL)
+            break;
     }
-    else
+    if (shards->count < count || shards->trees[count - 1]->root == NULL)
     {
-        Leaf *curr = parent->first_leaf;
-        while (curr != NULL && curr->next_leaf != leaf)
-            curr = curr->next_leaf;
-        if (curr != NULL)
-            curr->next_leaf = leaf->next_leaf;
+        tree_shards_destroy(shards);
+        return -1;
     }
+    return 0;
+}
 
-    // Update size totals
-    parent->total_size -= leaf->size;
-    Directory *dir = parent;
-    while (dir->base.parent != NULL)
+/**
+ * @brief Destroys every shard and the shard set itself.
+ *
+ * @param shards Pointer to the shard set, safe to pass NULL or an already destroyed set
+ *
+ * @note Each shard is torn down with destroy_tree.
+ */
+void tree_shards_destroy(TreeShards *shards)
+{
+    if (shards == NULL || shards->trees == NULL)
+        return;
+    for (uint32_t i = 0; i < shards->count; i++)
     {
-        dir = (Directory *)dir->base.parent;
-        dir->total_size -= leaf->size;
+        destroy_tree(shards->trees[i]);
+        free(shards->trees[i]);
     }
-    tree->total_size -= leaf->size;
+    free(shards->trees);
+    shards->trees = NULL;
+    shards->count = 0;
+}
 
-    // Clean up leaf data
-    if (tree->destroy != NULL && leaf->value != NULL)
-        tree->destroy(leaf->value);
+/**
+ * @brief Returns the shard that owns a path.
+ *
+ * @param shards Pointer to the shard set
+ * @param path Path below the root, e.g. "/logs/app", or a bare top-level name
+ * @return Tree* The owning tree, or NULL if shards or path is NULL
+ *
+ * @note Only the first path component is looked at, and nothing is locked, so
+ *       this costs one hash of that name. Paths naming the root go to shard 0.
+ */
+Tree *tree_shard(TreeShards *shards, const char *path)
+{
+    if (shards == NULL || shards->trees == NULL || path == NULL)
+        return NULL;
+    return shards->trees[shard_index(shards, path)];
+}
 
-    free(leaf);
-    return 0;
+/**
+ * @brief create_nested_directory on the shard that owns path.
+ *
+ * @param shards Pointer to the shard set
+ * @param path Full path of directories to create below the root
+ * @return Directory* The last directory of path, or NULL as for create_nested_directory
+ */
+Directory *tree_shards_create_nested_directory(TreeShards *shards, const char *path)
+{
+    return create_nested_directory(tree_shard(shards, path), path);
 }
+
 /**
- * @brief Recursively searches for a leaf (file) in the tree or subtree.
+ * @brief find_directory on the shard that owns path.
  *
- * @param tree Pointer to the tree structure
- * @param start Pointer to the directory from which to start the search
- * @param name The name of the leaf to search for
+ * @param shards Pointer to the shard set
+ * @param path Directory path below the root
+ * @return Directory* The directory, or NULL if it does not exist; "/" gives shard 0's root
+ */
+Directory *tree_shards_find_directory(TreeShards *shards, const char *path)
+{
+    return find_directory(tree_shard(shards, path), path);
+}
+
+/**
+ * @brief find_leaf_by_path on the shard that owns path.
  *
- * @return Leaf* Pointer to the found leaf if it exists, or NULL if:
- *         - The tree is NULL
- *         - Name is NULL
- *         - The leaf is not found
+ * @param shards Pointer to the shard set
+ * @param path Leaf path below the root
+ * @return Leaf* The leaf, or NULL if it does not exist
+ */
+Leaf *tree_shards_find_leaf_by_path(TreeShards *shards, const char *path)
+{
+    return find_leaf_by_path(tree_shard(shards, path), path);
+}
+
+/**
+ * @brief lookup_path on the shard that owns path.
  *
- * @note If 'start' is NULL, the search begins from the root of the tree.
- *       The function first searches in the leaves of the current directory,
- *       and if not found, it recursively searches in all child directories.
- *       The search is case-sensitive.
+ * @param shards Pointer to the shard set
+ * @param path Path below the root
+ * @return Node* The directory or leaf at path, or NULL if nothing exists there
  */
-Leaf *find_leaf(Tree *tree, Directory *start, const char *name)
+Node *tree_shards_lookup_path(TreeShards *shards, const char *path)
 {
-    if (tree == NULL || name == NULL)
-        return NULL;
+    return lookup_path(tree_shard(shards, path), path);
+}
 
-    Directory *curr = start ? start : tree->root;
-    if (curr == NULL)
-        return NULL;
+/**
+ * @brief Bulk-loads records, each into the shard that owns its path.
+ *
+ * @param shards Pointer to the shard set
+ * @param records Array of (path, value, size) records; see TreeRecord
+ * @param count Number of records
+ * @return long Number of leaves created, or -1 if:
+ *         - shards is NULL, or records is NULL with a non-zero count
+ *         - Memory allocation fails before anything is loaded
+ *
+ * @note The records are partitioned by shard, keeping their order, and each
+ *       part goes through one tree_load_batch call. Records without a path, and
+ *       those a shard cannot load, are skipped as in tree_load_batch.
+ */
+long tree_shards_load_batch(TreeShards *shards, const TreeRecord *records, size_t count)
+{
+    if (shards == NULL || shards->trees == NULL || (records == NULL && count > 0))
+        return -1;
+    if (count == 0)
+        return 0;
+    if (shards->count == 1)
+        return tree_load_batch(shards->trees[0], records, count);
 
-    // First search in current directory's leaves
-    Leaf *leaf = curr->first_leaf;
-    while (leaf != NULL)
+    // Counting sort of the records by shard
+    size_t *offsets = calloc(shards->count + 1, sizeof(size_t));
+    TreeRecord *sorted = malloc(count * sizeof(TreeRecord));
+    uint32_t *owners = malloc(count * sizeof(uint32_t));
+    if (offsets == NULL || sorted == NULL || owners == NULL)
     {
-        if (strcmp(leaf->base.name, name) == 0)
-            return leaf;
-        leaf = leaf->next_leaf;
+        free(offsets);
+        free(sorted);
+        free(owners);
+        return -1;
     }
-
-    // If not found, recursively search in subdirectories
-    Directory *child = curr->first_child;
-    while (child != NULL)
+    for (size_t i = 0; i < count; i++)
     {
-        Leaf *result = find_leaf(tree, child, name);
-        if (result != NULL)
-            return result;
-        child = child->next_dir;
+        owners[i] = records[i].path != NULL ? shard_index(shards, records[i].path) : 0;
+        offsets[owners[i] + 1]++;
     }
+    for (uint32_t s = 0; s < shards->count; s++)
+        offsets[s + 1] += offsets[s];
+    for (size_t i = 0; i < count; i++)
+        sorted[offsets[owners[i]]++] = records[i];
 
-    return NULL;
+    // offsets[s] is now where shard s + 1 starts
+    long loaded = 0;
+    size_t start = 0;
+    for (uint32_t s = 0; s < shards->count; s++)
+    {
+        long n = tree_load_batch(shards->trees[s], sorted + start, offsets[s] - start);
+        if (n > 0)
+            loaded += n;
+        start = offsets[s];
+    }
+    free(offsets);
+    free(sorted);
+    free(owners);
+    return loaded;
 }
 
 /**
- * @brief Recursively counts the total number of files (leaves) in the tree or subtree.
- *
- * @param tree Pointer to the tree structure
+ * @brief Returns the total size of the leaves of all shards.
  *
- * @return uint32_t Total number of files (leaves) in the tree, or 0 if:
- *         - The tree is NULL
- *         - The tree is empty
+ * @param shards Pointer to the shard set
+ * @return uint64_t Sum of get_total_size over the shards, or 0 if shards is NULL
  *
- * @note This function traverses the entire tree structure recursively.
- *       For each directory, it counts its immediate files and creates temporary
- *       subtrees to count files in child directories. It maintains original tree
- *       function pointers during recursion.
+ * @note Each shard's total is read atomically, but not all at the same instant,
+ *       so under concurrent writers the sum may mix slightly different moments.
  */
-uint32_t get_total_files(Tree *tree)
+uint64_t tree_shards_total_size(TreeShards *shards)
 {
-    if (tree == NULL || tree->root == NULL)
+    if (shards == NULL || shards->trees == NULL)
         return 0;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < shards->count; i++)
+        total += get_total_size(shards->trees[i]);
+    return total;
+}
 
-    uint32_t count = 0;
-    Directory *curr = tree->root;
-
-    // Count files in current directory
-    Leaf *leaf = curr->first_leaf;
-    while (leaf != NULL)
+/**
+ * @brief Returns the number of directories of all shards, counting the shared root once.
+ *
+ * @param shards Pointer to the shard set
+ * @return uint32_t Total number of directories, or 0 if shards is NULL
+ */
+uint32_t tree_shards_total_directories(TreeShards *shards)
+{
+    if (shards == NULL || shards->trees == NULL)
+        return 0;
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < shards->count; i++)
     {
-        count++;
-        leaf = leaf->next_leaf;
+        Tree *tree = shards->trees[i];
+        uint32_t dirs = get_total_directories(tree);
+        // Only shard 0's root stands for the shared root
+        if (i > 0 && dirs > 0 && __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE) != NULL)
+            dirs--;
+        total += dirs;
     }
+    return total;
+}
 
-    // Recursively count files in subdirectories
-    Directory *child = curr->first_child;
-    while (child != NULL)
-    {
-        // Create a new Tree instance with the same function pointers
-        Tree subtree = {
-            .root = child,
-            .total_dirs = tree->total_dirs,
-            .total_size = tree->total_size,
-            .destroy = tree->destroy,
-            .compare = tree->compare};
-        count += get_total_files(&subtree);
-        child = child->next_dir;
-    }
-    return count;
+/**
+ * @brief Returns the number of files (leaves) of all shards.
+ *
+ * @param shards Pointer to the shard set
+ * @return uint32_t Total number of files, or 0 if shards is NULL
+ */
+uint32_t tree_shards_total_files(TreeShards *shards)
+{
+    if (shards == NULL || shards->trees == NULL)
+        return 0;
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < shards->count; i++)
+        total += get_total_files(shards->trees[i]);
+    return total;
 }
@@ -11,15 +11,78 @@ typedef struct Node Node;
 typedef struct Leaf Leaf;
 typedef struct Directory Directory;
 typedef struct Tree Tree;
+typedef struct DirIndex DirIndex;
+typedef struct DirPrints DirPrints;
+typedef struct DirOrder DirOrder;
+typedef struct TreeArena TreeArena;
+typedef struct TreePool TreePool;
+typedef struct PathIndex PathIndex;
+typedef struct PathCache PathCache;
+typedef struct TreeReclaimer TreeReclaimer;
+typedef struct TreeQuery TreeQuery;
+typedef struct TreeJournal TreeJournal;
+typedef uint32_t TreeLock; // Reader-writer spin lock word, see TREE_OPT_CONCURRENT
+typedef struct TreeImage TreeImage;
+typedef struct ImageDir ImageDir;
+typedef struct ImageLeaf ImageLeaf;
+typedef struct TreeFrozen TreeFrozen;
+typedef struct TreeSnapshot TreeSnapshot;
+typedef struct TreeVersions TreeVersions;
+typedef struct DirVersion DirVersion;
+typedef struct TreeStats TreeStats;
 
 #define TREE_TAG_ROOT 0x01 /* 0000 0001 */
 #define TREE_TAG_NODE 0x02 /* 0000 0010 */
 #define TREE_TAG_LEAF 0x04 /* 0000 0100 */
+#define TREE_TAG_FROZEN 0x08 /* 0000 1000, directories of a frozen tree */
+#define TREE_TAG_INLINE 0x10 /* 0001 0000, leaves whose value is stored in the leaf itself */
+
+// Tree options for init_tree_ex
+#define TREE_OPT_ARENA 0x01      /* Allocate nodes from per-tree slabs released in bulk by destroy_tree */
+#define TREE_OPT_PATH_INDEX 0x02 /* Keep a tree-wide full path -> node hash index */
+#define TREE_OPT_CONCURRENT 0x04 /* Allow concurrent readers and writers (per-directory locks, atomic totals) */
+#define TREE_OPT_INLINE_VALUES 0x08 /* Copy values of at most TREE_INLINE_VALUE_MAX bytes into their leaves */
+#define TREE_OPT_BACKGROUND_RECLAIM 0x10 /* Free remove_directory_async subtrees on a tree-owned thread (with TREE_OPT_CONCURRENT) */
+#define TREE_OPT_SIZE_HISTOGRAM 0x20 /* Keep a leaf size histogram for every directory's subtree */
+
+// Traversal order and filters for tree_iter_begin. Without a filter both
+// directories and leaves are returned.
+#define TREE_ITER_PREORDER 0x00    /* A directory before its leaves and subdirectories */
+#define TREE_ITER_POSTORDER 0x01   /* A directory after its leaves and subdirectories */
+#define TREE_ITER_DIRECTORIES 0x02 /* Return directories */
+#define TREE_ITER_LEAVES 0x04      /* Return leaves */
+
+// A directory builds its name index once it holds more than this many
+// subdirectories or leaves; smaller directories are scanned through their
+// name fingerprints, and the smallest just walk their lists.
+#define TREE_INDEX_THRESHOLD 256
+#define TREE_FINGERPRINT_THRESHOLD 8
+
+// Largest value, in bytes, that TREE_OPT_INLINE_VALUES stores inside its leaf
+#define TREE_INLINE_VALUE_MAX 32
+
+// Bins of tree_size_histogram: bin 0 counts empty leaves and bin i (1..64)
+// leaves of at least 2^(i-1) and less than 2^i bytes
+#define TREE_HISTOGRAM_BINS 65
+
+// Operations timed by the instrumentation layer (builds with -DTREE_STATS)
+#define TREE_OP_CREATE_DIRECTORY 0
+#define TREE_OP_CREATE_NESTED_DIRECTORY 1
+#define TREE_OP_REMOVE_DIRECTORY 2
+#define TREE_OP_FIND_DIRECTORY 3
+#define TREE_OP_CREATE_LEAF 4
+#define TREE_OP_REMOVE_LEAF 5
+#define TREE_OP_FIND_LEAF 6
+#define TREE_OP_FIND_LEAF_BY_PATH 7
+#define TREE_OP_LOOKUP_PATH 8
+#define TREE_OP_COUNT 9
 
 struct Node
 {
-    char name[256];
+    const char *name; // NUL-terminated, owned by the tree
     Node *parent;
+    uint32_t hash;    // Cached hash of name
+    uint8_t name_len; // strlen(name), always < 256
     uint8_t tag;
 };
 
@@ -27,8 +90,10 @@ struct Leaf
 {
     Node base;
     Leaf *next_leaf; // Links to next file in same directory
-    void *value;
-    uint16_t size;
+    Leaf *prev_leaf; // Links to previous file in same directory
+    void *value;     // Points into the leaf itself when tagged TREE_TAG_INLINE
+    uint64_t size;
+    uint32_t pins;   // leaf_acquire handles, with the top bit set once the leaf has left the tree
 };
 
 // Directory node with separate lists for files and subdirectories
@@ -36,47 +101,272 @@ struct Directory
 {
     Node base;
     Directory *next_dir;    // Links to next sibling directory
+    Directory *prev_dir;    // Links to previous sibling directory
     Leaf *first_leaf;       // Links to first file
+    Leaf *last_leaf;        // Links to last file
     Directory *first_child; // Links to first subdirectory
-    uint16_t dir_count;     // Number of subdirectories
-    uint32_t total_size;    // Total size of all contents
+    Directory *last_child;  // Links to last subdirectory
+    uint32_t dir_count;     // Number of subdirectories
+    uint32_t leaf_count;    // Number of files
+    uint32_t subtree_files; // Number of files in this directory and all descendants
+    uint32_t subtree_dirs;  // Number of directories below this one
+    uint64_t total_size;    // Total size of all contents
+    DirIndex *index;        // Name index over children and leaves (NULL until built)
+    DirPrints *prints;      // Name fingerprints for scans below TREE_INDEX_THRESHOLD (NULL until built)
+    DirOrder *order;        // Entries in name order for list_* queries (NULL until the first one)
+    uint32_t *histogram;    // TREE_HISTOGRAM_BINS leaf counts for the subtree (TREE_OPT_SIZE_HISTOGRAM only)
+    uint64_t version;       // Snapshot epoch of the last change that had to be preserved
+    DirVersion *versions;   // Earlier states still visible to snapshots, newest first
+    TreeLock lock;          // Guards the lists and index (TREE_OPT_CONCURRENT only)
 };
 
 struct Tree
 {
     Directory *root;
     uint32_t total_dirs;
-    uint32_t total_size;
+    uint32_t total_files;
+    uint64_t total_size;
     void (*destroy)(void *);
     int (*compare)(void *, void *);
+    uint32_t options;  // TREE_OPT_* flags given to init_tree_ex
+    TreeArena *arena;  // Slab allocator state (TREE_OPT_ARENA only)
+    TreePool *pool;    // Worker threads for parallel traversal (NULL when single-threaded)
+    PathIndex *paths;  // Full path index (TREE_OPT_PATH_INDEX only)
+    PathCache *path_cache; // Directory paths memoized for tree_node_path (NULL until the first call)
+    TreeReclaimer *reclaimer; // Subtrees queued by remove_directory_async (NULL until the first)
+    TreeFrozen *frozen; // Read-only node arrays built by tree_freeze (NULL while mutable)
+    TreeJournal *journal; // Change log attached by tree_journal_open (NULL otherwise)
+    TreeVersions *versions; // Snapshot bookkeeping (NULL until the first tree_snapshot)
+    TreeStats *stats;       // Instrumentation counters (TREE_STATS builds only, else NULL)
+    uint32_t pinned;        // Outstanding leaf_acquire handles
+    // TREE_OPT_CONCURRENT only
+    TreeLock root_lock;      // Serializes root creation
+    TreeLock structure_lock; // Shared by subtree traversals, exclusive for subtree removal
+    TreeLock paths_lock;     // Guards the path index
+    TreeLock alloc_lock;     // Guards the arena
+    TreeLock versions_lock;  // Exclusive for writers and snapshots while snapshots exist
+    uint32_t versions_gate;    // Live snapshots plus threads keeping writers out; writers lock while nonzero
+    uint32_t versions_writers; // Writers running without versions_lock while the gate is 0
 };
+
+// One entry of a batch load. A path ending in '/' creates just the directory;
+// any other path names a leaf, whose missing parent directories are created.
+typedef struct TreeRecord
+{
+    const char *path;
+    void *value;
+    uint64_t size;
+} TreeRecord;
+
+// Cursor for tree_iter_next. The walk follows the nodes' own sibling and
+// parent links, so it needs no stack and never allocates.
+typedef struct TreeIter
+{
+    Directory *start; // Subtree being walked
+    Node *node;       // Next position, NULL once the walk is over
+    uint8_t phase;    // Where the walk is relative to node when it is a directory
+    uint8_t flags;    // TREE_ITER_* flags
+    Node *last;       // Node returned by the latest call, kept while tracking paths
+    char *path;       // Caller's buffer from tree_iter_paths (NULL when not tracking paths)
+    size_t path_size; // Size of path
+    size_t path_len;  // Length of the walked directory's path, even where it did not fit
+} TreeIter;
+
+// A leaf's payload pinned by leaf_acquire. data and size stay valid, and the
+// value is not destroyed, until leaf_release, even if the leaf is removed or
+// updated in the meantime.
+typedef struct TreeValue
+{
+    const void *data;
+    uint64_t size;
+    Leaf *leaf; // The pinned leaf
+} TreeValue;
+
+// Independent trees sharing one root name. Every entry directly below the root,
+// and everything under it, lives in the tree picked by hashing the entry's name,
+// so writers under different top-level entries share no locks or totals.
+typedef struct TreeShards
+{
+    Tree **trees;   // count trees, each with its own root, allocator and locks
+    uint32_t count;
+} TreeShards;
+
+// Limits for tree_query; fields left at zero do not limit anything
+typedef struct TreeFilter
+{
+    uint64_t min_size;  // Smallest leaf size or directory total_size returned
+    uint64_t max_size;  // Largest one, 0 for no bound
+    uint32_t max_depth; // Deepest level returned, the root's entries being level 1
+    uint32_t flags;     // TREE_ITER_DIRECTORIES and/or TREE_ITER_LEAVES, 0 for both
+} TreeFilter;
+
+// Group commit settings for tree_journal_open; fields left at zero disable
+// their trigger. Records are always written out once 64 KiB are buffered.
+typedef struct TreeJournalConfig
+{
+    uint32_t sync_records;  // fsync once this many records are not yet durable (1 for every mutation)
+    uint32_t sync_bytes;    // ... or once this many bytes are not yet durable
+    uint64_t compact_bytes; // Compact in the background once the journal file reaches this size
+} TreeJournalConfig;
+
+// Parallel traversal callbacks.
+// A visit function is called once for every directory of the traversed subtree,
+// possibly from several threads at once. 'local' is zero-initialized scratch
+// private to the calling worker; returning false cancels the traversal.
+typedef bool (*tree_visit_fn)(Directory *dir, void *local, void *ctx);
+// Folds one worker's scratch into the caller's result, called serially after the walk
+typedef void (*tree_reduce_fn)(void *result, const void *local, void *ctx);
+// Called after every timed operation (TREE_OP_*) with its path or name argument
+// and latency, on the thread that made the call
+typedef void (*tree_trace_fn)(uint32_t op, const char *arg, uint64_t ns, void *ctx);
+// Called once a subtree queued by remove_directory_async has been freed
+typedef void (*tree_reclaim_fn)(Tree *tree, void *ctx);
+
+// The library's public API. Release builds compile with -fvisibility=hidden,
+// so these are the only symbols libtree.so exports; calls between them and
+// into tree.c's internal functions bind locally and can be inlined.
+#if defined(__GNUC__)
+#pragma GCC visibility push(default)
+#endif
+
 // Tree Management
 void init_tree(Tree *tree, int (*compare)(void *key1, void *key2), void (*destroy)(void *data));
+void init_tree_ex(Tree *tree, int (*compare)(void *key1, void *key2), void (*destroy)(void *data), uint32_t options);
 void destroy_tree(Tree *tree);
+int tree_freeze(Tree *tree);
+bool tree_is_frozen(Tree *tree);
+int tree_set_parallelism(Tree *tree, unsigned threads);
 
 // Directory Operations
 Directory *create_directory(Tree *tree, Directory *parent, const char *name);
 Directory *create_nested_directory(Tree *tree, const char *path);
 int remove_directory(Tree *tree, Directory *dir);
+int remove_directory_async(Tree *tree, Directory *dir, tree_reclaim_fn done, void *ctx);
+int tree_reclaim(Tree *tree, size_t budget);
+int move_directory(Tree *tree, Directory *dir, Directory *new_parent);
 Directory *find_directory(Tree *tree, const char *path);
 
 // File Operations
-Leaf *create_leaf(Tree *tree, Directory *parent, const char *name, void *value, uint16_t size);
+Leaf *create_leaf(Tree *tree, Directory *parent, const char *name, void *value, uint64_t size);
 int remove_leaf(Tree *tree, Leaf *leaf);
+int move_leaf(Tree *tree, Leaf *leaf, Directory *new_parent);
+long tree_load_batch(Tree *tree, const TreeRecord *records, size_t count);
+// Swaps in a new leaf with the same name holding value and size, and removes
+// the old one as remove_leaf does. Use the returned leaf from then on: every other
+// pointer to the old leaf is stale once this returns (leaf_acquire handles
+// still keep its value readable until released).
+Leaf *update_leaf(Tree *tree, Leaf *leaf, void *value, uint64_t size);
+int leaf_acquire(Tree *tree, Leaf *leaf, TreeValue *value);
+int leaf_acquire_path(Tree *tree, const char *path, TreeValue *value);
+void leaf_release(Tree *tree, TreeValue *value);
 Leaf *find_leaf(Tree *tree, Directory *start, const char *name);
+Leaf *find_leaf_by_path(Tree *tree, const char *path);
+
+// Ordered Listing
+Node *list_seek(Tree *tree, Directory *dir, const char *name);
+Node *list_next(Tree *tree, Directory *dir, Node *node);
+uint32_t list_range(Tree *tree, Directory *dir, const char *lo, const char *hi, Node **out, uint32_t capacity);
+uint32_t list_prefix(Tree *tree, Directory *dir, const char *prefix, Node **out, uint32_t capacity);
+
+// Iteration
+void tree_iter_begin(TreeIter *iter, Tree *tree, Directory *start, uint32_t flags);
+Node *tree_iter_next(TreeIter *iter);
+void tree_iter_paths(TreeIter *iter, char *buf, size_t size);
+const char *tree_iter_path(TreeIter *iter, size_t *len);
+
+// Queries
+TreeQuery *tree_query(Tree *tree, const char *pattern, const TreeFilter *filter);
+Node *tree_query_next(TreeQuery *query);
+void tree_query_free(TreeQuery *query);
+
+// Snapshots
+TreeSnapshot *tree_snapshot(Tree *tree);
+void snapshot_release(TreeSnapshot *snapshot);
+Directory *snapshot_root(TreeSnapshot *snapshot);
+Directory *snapshot_find_directory(TreeSnapshot *snapshot, const char *path);
+Leaf *snapshot_find_leaf(TreeSnapshot *snapshot, Directory *start, const char *name);
+Leaf *snapshot_find_leaf_by_path(TreeSnapshot *snapshot, const char *path);
+uint32_t snapshot_list(TreeSnapshot *snapshot, Directory *dir, Node **out, uint32_t capacity);
+uint64_t snapshot_directory_size(TreeSnapshot *snapshot, Directory *dir);
+uint32_t snapshot_directory_count(TreeSnapshot *snapshot, Directory *dir);
+uint32_t snapshot_directory_file_count(TreeSnapshot *snapshot, Directory *dir);
+uint64_t snapshot_total_size(TreeSnapshot *snapshot);
+uint32_t snapshot_total_files(TreeSnapshot *snapshot);
+uint32_t snapshot_total_directories(TreeSnapshot *snapshot);
+
+// Path Lookup
+Node *lookup_path(Tree *tree, const char *path);
+
+// Traversal
+int tree_parallel_visit(Tree *tree, Directory *start, tree_visit_fn visit, size_t local_size,
+                        tree_reduce_fn reduce, void *result, void *ctx);
 
 // Node Information
 bool is_directory(Node *node);
 bool is_leaf(Node *node);
+int rename_node(Tree *tree, Node *node, const char *name);
 const char *get_node_name(Node *node);
 char *get_node_path(Node *node);
+size_t tree_node_path(Tree *tree, Node *node, char *buf, size_t size);
 Directory *get_parent_directory(Directory *dir);
 
+// Binary Images
+int save_tree(Tree *tree, const char *path);
+TreeImage *load_tree(const char *path);
+void unload_tree(TreeImage *image);
+const ImageDir *image_root(const TreeImage *image);
+const ImageDir *image_find_directory(const TreeImage *image, const char *path);
+const ImageLeaf *image_find_leaf(const TreeImage *image, const ImageDir *start, const char *name);
+const ImageLeaf *image_find_leaf_by_path(const TreeImage *image, const char *path);
+const char *image_dir_name(const TreeImage *image, const ImageDir *dir);
+const char *image_leaf_name(const TreeImage *image, const ImageLeaf *leaf);
+const ImageDir *image_dir_parent(const TreeImage *image, const ImageDir *dir);
+const ImageDir *image_leaf_parent(const TreeImage *image, const ImageLeaf *leaf);
+uint64_t image_dir_size(const ImageDir *dir);
+uint32_t image_dir_file_count(const ImageDir *dir);
+uint32_t image_dir_count(const ImageDir *dir);
+uint64_t image_leaf_size(const ImageLeaf *leaf);
+const void *image_leaf_value(const TreeImage *image, const ImageLeaf *leaf);
+uint32_t image_total_directories(const TreeImage *image);
+uint32_t image_total_files(const TreeImage *image);
+
+// Journal
+int tree_journal_open(Tree *tree, const char *image, const char *journal, const TreeJournalConfig *config);
+int tree_journal_sync(Tree *tree);
+int tree_journal_compact(Tree *tree, bool wait);
+int tree_journal_close(Tree *tree);
+
+// Sharding
+int tree_shards_init(TreeShards *shards, uint32_t count, const char *root, int (*compare)(void *key1, void *key2),
+                     void (*destroy)(void *data), uint32_t options);
+void tree_shards_destroy(TreeShards *shards);
+Tree *tree_shard(TreeShards *shards, const char *path);
+Directory *tree_shards_create_nested_directory(TreeShards *shards, const char *path);
+Directory *tree_shards_find_directory(TreeShards *shards, const char *path);
+Leaf *tree_shards_find_leaf_by_path(TreeShards *shards, const char *path);
+Node *tree_shards_lookup_path(TreeShards *shards, const char *path);
+long tree_shards_load_batch(TreeShards *shards, const TreeRecord *records, size_t count);
+uint64_t tree_shards_total_size(TreeShards *shards);
+uint32_t tree_shards_total_directories(TreeShards *shards);
+uint32_t tree_shards_total_files(TreeShards *shards);
+
 // Tree Statistics
-uint32_t get_directory_size(Directory *dir);
-uint32_t get_total_size(Tree *tree);
-uint16_t get_directory_count(Directory *dir);
+uint64_t get_directory_size(Directory *dir);
+uint64_t get_total_size(Tree *tree);
+uint32_t get_directory_count(Directory *dir);
+uint32_t get_directory_file_count(Directory *dir);
 uint32_t get_total_directories(Tree *tree);
 uint32_t get_total_files(Tree *tree);
+uint32_t tree_top_n(Tree *tree, Directory *dir, uint32_t depth, Directory **out, uint32_t n);
+int tree_size_histogram(Tree *tree, Directory *dir, uint64_t bins[TREE_HISTOGRAM_BINS]);
+
+// Instrumentation (no-ops returning -1 unless built with -DTREE_STATS)
+int tree_stats_dump(Tree *tree, FILE *out);
+int tree_stats_reset(Tree *tree);
+int tree_set_trace(Tree *tree, tree_trace_fn trace, void *ctx);
+
+#if defined(__GNUC__)
+#pragma GCC visibility pop
+#endif
 
 #endif
\ No newline at end of file